@@ -0,0 +1,324 @@
+// Load generator and latency benchmark for the chat server.
+//
+// Starts a number of receiver and sender connections (each on its own
+// thread, using the regular Connection class) spread across a number
+// of rooms. Senders publish at a target rate; every message carries
+// the CLOCK_MONOTONIC time it was sent, so receivers can measure the
+// end-to-end delivery latency. At the end, throughput and latency
+// percentiles are printed.
+//
+// Usage: ./chatbench [options]
+//   -H <host>      server host (default localhost)
+//   -p <port>      server port (default 5000)
+//   -u <path>      connect over a UNIX domain socket instead of TCP
+//   -m             receivers take deliveries through shared memory
+//                  rings (needs -u)
+//   -s <count>     sender connections (default 1)
+//   -r <count>     receiver connections (default 10)
+//   -R <count>     rooms; connection i uses room i % count (default 1)
+//   -n <count>     messages sent by each sender (default 10000)
+//   -t <rate>      target total send rate in msgs/sec, 0 = as fast as
+//                  possible (default 0)
+//   -z <bytes>     message size (default 64)
+//   -b             use binary framing (allows messages past MAX_LEN)
+//   -W <count>     sender pipeline window: requests in flight before
+//                  waiting for acks (default 1, one request at a time)
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+#include "message.h"
+#include "connection.h"
+#include "client_util.h"
+
+namespace {
+
+struct BenchConfig {
+    std::string host;
+    int port;
+    std::string unix_path;
+    int senders;
+    int receivers;
+    int rooms;
+    long messages;    // per sender
+    double rate;      // total msgs/sec, 0 = unlimited
+    size_t msg_size;
+    bool binary;
+    bool shm;
+    size_t window;
+
+    BenchConfig()
+        : host("localhost"), port(5000), senders(1), receivers(10), rooms(1),
+          messages(10000), rate(0), msg_size(64), binary(false), shm(false),
+          window(1) { }
+};
+
+BenchConfig config;
+
+// all connections log in before anybody sends
+pthread_barrier_t ready_barrier;
+
+std::atomic<int> senders_left;
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+std::string room_name(int i) {
+    return "bench" + std::to_string(i % config.rooms);
+}
+
+void connect_to_server(Connection &conn) {
+    if (!config.unix_path.empty()) {
+        conn.connect_unix(config.unix_path);
+    } else {
+        conn.connect(config.host, config.port);
+    }
+}
+
+// send a request and wait for the server's ok
+bool request(Connection &conn, const Message &req) {
+    Message reply;
+    return conn.send(req) && conn.receive(reply) && reply.tag == TAG_OK;
+}
+
+struct ReceiverArg {
+    int index;
+    long expected;                  // deliveries we should get
+    long received;
+    std::vector<uint64_t> latencies; // ns
+};
+
+void *receiver_thread(void *arg) {
+    ReceiverArg *rarg = static_cast<ReceiverArg *>(arg);
+
+    Connection conn;
+    connect_to_server(conn);
+    if (!client_login(conn, TAG_RLOGIN, "benchr" + std::to_string(rarg->index),
+                      config.binary, config.shm) ||
+        !request(conn, Message(TAG_JOIN, room_name(rarg->index)))) {
+        std::cerr << "receiver " << rarg->index << ": login failed\n";
+        std::exit(1);
+    }
+
+    // don't wait forever on deliveries the server dropped
+    timeval tv = { 2, 0 };
+    setsockopt(conn.get_fd(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    rarg->latencies.reserve(rarg->expected);
+    pthread_barrier_wait(&ready_barrier);
+
+    MessageView msg;
+    while (rarg->received < rarg->expected) {
+        errno = 0;  // an EOF leaves it alone
+        if (!conn.receive(msg)) {
+            // only a receive timeout (SO_RCVTIMEO) is worth retrying,
+            // and only while senders are still going; EOF, an error or
+            // a bad message means the connection is done for
+            bool timed_out = conn.get_last_result() == Connection::EOF_OR_ERROR &&
+                             (errno == EAGAIN || errno == EWOULDBLOCK);
+            if (!timed_out || senders_left.load() == 0) {
+                break;
+            }
+            continue;
+        }
+        if (msg.code != TAG_CODE_DELIVERY) {
+            continue;
+        }
+
+        // data is room:sender:<send time in ns> <padding>; the view
+        // isn't NUL-terminated, so no strtoull
+        size_t pos = msg.data.find(':');
+        pos = msg.data.find(':', pos + 1);
+        uint64_t sent = 0;
+        for (pos++; pos < msg.data.size() && std::isdigit(msg.data[pos]); pos++) {
+            sent = sent * 10 + (msg.data[pos] - '0');
+        }
+
+        rarg->latencies.push_back(now_ns() - sent);
+        rarg->received++;
+    }
+
+    return nullptr;
+}
+
+struct SenderArg {
+    int index;
+    long sent;
+};
+
+void *sender_thread(void *arg) {
+    SenderArg *sarg = static_cast<SenderArg *>(arg);
+
+    Connection conn;
+    connect_to_server(conn);
+    if (!client_login(conn, TAG_SLOGIN, "benchs" + std::to_string(sarg->index),
+                      config.binary) ||
+        !request(conn, Message(TAG_JOIN, room_name(sarg->index)))) {
+        std::cerr << "sender " << sarg->index << ": login failed\n";
+        std::exit(1);
+    }
+
+    // pace against a schedule rather than sleeping a fixed amount, so
+    // time spent sending doesn't lower the rate
+    uint64_t interval = config.rate > 0 ? uint64_t(1e9 * config.senders / config.rate) : 0;
+    std::string padding(config.msg_size > 20 ? config.msg_size - 20 : 0, 'x');
+
+    PipelinedSender out(conn, config.window);
+
+    pthread_barrier_wait(&ready_barrier);
+    uint64_t start = now_ns();
+
+    for (long i = 0; i < config.messages; i++) {
+        if (interval) {
+            uint64_t due = start + i * interval;
+            uint64_t now = now_ns();
+            if (due > now) {
+                timespec ts = { time_t((due - now) / 1000000000ull),
+                                long((due - now) % 1000000000ull) };
+                nanosleep(&ts, nullptr);
+            }
+        }
+
+        char stamp[24];
+        std::snprintf(stamp, sizeof(stamp), "%020llu",
+                      static_cast<unsigned long long>(now_ns()));
+        // paced messages go out on schedule, flat out they go out
+        // whenever the window fills up
+        if (!out.send(Message(TAG_SENDALL, std::string(stamp) + " " + padding)) ||
+            (interval && !out.flush())) {
+            std::cerr << "sender " << sarg->index << ": send failed\n";
+            break;
+        }
+        sarg->sent++;
+    }
+
+    if (!out.drain() || out.errors() > 0) {
+        std::cerr << "sender " << sarg->index << ": " << out.errors()
+                  << " sends failed\n";
+    }
+    senders_left--;
+    conn.send(Message(TAG_QUIT, "bye"));
+    return nullptr;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = size_t(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+void usage() {
+    std::cerr << "Usage: ./chatbench [-H host] [-p port] [-u unix_path] [-s senders]\n"
+                 "                   [-r receivers] [-R rooms] [-n msgs_per_sender]\n"
+                 "                   [-t total_rate] [-z msg_size] [-b] [-m] [-W window]\n";
+    std::exit(1);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:u:s:r:R:n:t:z:bmW:")) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = std::atoi(optarg); break;
+        case 'u': config.unix_path = optarg; break;
+        case 's': config.senders = std::atoi(optarg); break;
+        case 'r': config.receivers = std::atoi(optarg); break;
+        case 'R': config.rooms = std::atoi(optarg); break;
+        case 'n': config.messages = std::atol(optarg); break;
+        case 't': config.rate = std::atof(optarg); break;
+        case 'z': config.msg_size = std::atol(optarg); break;
+        case 'b': config.binary = true; break;
+        case 'm': config.shm = true; break;
+        case 'W': config.window = std::atol(optarg); break;
+        default: usage();
+        }
+    }
+    size_t max_len = config.binary ? Message::MAX_FRAME_LEN - 1024 : Message::MAX_LEN;
+    if (config.senders < 1 || config.receivers < 0 || config.rooms < 1 ||
+        config.messages < 0 || config.msg_size + 30 > max_len || config.window < 1 ||
+        (config.shm && config.unix_path.empty())) {
+        usage();
+    }
+
+    // each receiver expects every message sent into its room
+    std::vector<long> senders_in_room(config.rooms, 0);
+    for (int i = 0; i < config.senders; i++) {
+        senders_in_room[i % config.rooms]++;
+    }
+
+    pthread_barrier_init(&ready_barrier, nullptr,
+                         config.senders + config.receivers + 1);
+    senders_left = config.senders;
+
+    std::vector<ReceiverArg> rargs(config.receivers);
+    std::vector<pthread_t> rtids(config.receivers);
+    for (int i = 0; i < config.receivers; i++) {
+        rargs[i].index = i;
+        rargs[i].expected = senders_in_room[i % config.rooms] * config.messages;
+        rargs[i].received = 0;
+        pthread_create(&rtids[i], nullptr, receiver_thread, &rargs[i]);
+    }
+
+    std::vector<SenderArg> sargs(config.senders);
+    std::vector<pthread_t> stids(config.senders);
+    for (int i = 0; i < config.senders; i++) {
+        sargs[i].index = i;
+        sargs[i].sent = 0;
+        pthread_create(&stids[i], nullptr, sender_thread, &sargs[i]);
+    }
+
+    pthread_barrier_wait(&ready_barrier);
+    uint64_t start = now_ns();
+
+    long sent = 0;
+    for (int i = 0; i < config.senders; i++) {
+        pthread_join(stids[i], nullptr);
+        sent += sargs[i].sent;
+    }
+    uint64_t send_done = now_ns();
+
+    long expected = 0, received = 0;
+    std::vector<uint64_t> latencies;
+    for (int i = 0; i < config.receivers; i++) {
+        pthread_join(rtids[i], nullptr);
+        expected += rargs[i].expected;
+        received += rargs[i].received;
+        latencies.insert(latencies.end(), rargs[i].latencies.begin(),
+                         rargs[i].latencies.end());
+    }
+    uint64_t recv_done = now_ns();
+
+    std::sort(latencies.begin(), latencies.end());
+    double send_secs = (send_done - start) / 1e9;
+    double recv_secs = (recv_done - start) / 1e9;
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "sent:       " << sent << " msgs in " << send_secs << " s ("
+              << sent / send_secs << " msgs/sec)\n"
+              << "delivered:  " << received << " of " << expected << " in "
+              << recv_secs << " s (" << received / recv_secs << " msgs/sec)\n"
+              << "latency us: p50 " << percentile(latencies, 0.50) / 1e3
+              << "  p99 " << percentile(latencies, 0.99) / 1e3
+              << "  p999 " << percentile(latencies, 0.999) / 1e3
+              << "  max " << (latencies.empty() ? 0 : latencies.back()) / 1e3 << "\n";
+
+    pthread_barrier_destroy(&ready_barrier);
+    return received == expected ? 0 : 2;
+}
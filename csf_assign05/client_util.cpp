@@ -1,7 +1,15 @@
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
 #include "connection.h"
+#include "shm_ring.h"
 #include "message.h"
+#include "frame.h"
 #include "client_util.h"
 
 // string trim functions shamelessly stolen from
@@ -22,3 +30,211 @@ std::string rtrim(const std::string &s) {
 std::string trim(const std::string &s) {
   return rtrim(ltrim(s));
 }
+
+// room for plenty of deliveries, so a busy receiver rarely has to
+// ring the server for more
+const size_t SHM_RING_SIZE = 1024 * 1024;
+
+bool client_login(Connection &conn, const std::string &tag,
+                  const std::string &username, bool binary, bool shm) {
+  // the ring is ours, the server maps it by name while handling the
+  // login; the name goes away again once it has answered
+  std::unique_ptr<ShmRing> ring;
+  if (shm) {
+    ring.reset(ShmRing::create(SHM_RING_SIZE));
+    if (!ring) {
+      std::cerr << "Failed to create shared memory ring: "
+                << std::strerror(errno) << "\n";
+      return false;
+    }
+  }
+
+  // usernames can't contain ':', so anything after one is an option
+  std::string data = username;
+  if (binary) {
+    data += ":bin";
+  }
+  if (ring) {
+    data += ":shm=" + ring->get_name();
+  }
+  Message login(tag, data);
+  bool sent = conn.send(login);
+
+  Message reply;
+  bool replied = sent && conn.receive(reply);
+  if (ring) {
+    ring->unlink();
+  }
+
+  if (!sent) {
+    std::cerr << "Failed to send login message\n";
+    return false;
+  }
+
+  if (!replied) {
+    std::cerr << "No response after login\n";
+    return false;
+  }
+
+  if (reply.tag == TAG_ERR) {
+    std::cerr << reply.data << "\n";
+    return false;
+  }
+
+  if (reply.tag != TAG_OK) {
+    std::cerr << reply.tag << "\n";
+    return false;
+  }
+
+  // the reply lists the options the server agreed to, a server that
+  // doesn't know them just says "ok"
+  std::istringstream agreed(reply.data);
+  std::string option;
+  while (std::getline(agreed, option, ':')) {
+    if (option == "bin" && binary) {
+      conn.set_format(WIRE_BINARY);
+    } else if (option == "shm" && ring) {
+      conn.attach_shm(ring.release(), Connection::SHM_RECEIVE);
+    }
+  }
+  return true;
+}
+
+PipelinedSender::PipelinedSender(Connection &conn, size_t window)
+  : m_conn(conn), m_window(window > 0 ? window : 1), m_in_flight(0), m_errors(0) {
+}
+
+PipelinedSender::~PipelinedSender() {
+  for (Frame *frame : m_queued) {
+    frame->unref();
+  }
+}
+
+bool PipelinedSender::send(const Message &req) {
+  return send(req.tag, req.data);
+}
+
+bool PipelinedSender::send(std::string_view tag, std::string_view data) {
+  // window full: push out what's queued and wait for room. After the
+  // first ack, take whatever other acks came with it too, so the next
+  // batch we write isn't just a single request.
+  if (m_in_flight >= m_window) {
+    if (!flush() || !read_ack()) {
+      return false;
+    }
+    while (m_in_flight > 0 && m_conn.has_buffered_input()) {
+      if (!read_ack()) {
+        return false;
+      }
+    }
+  }
+
+  // a Frame encodes for whichever wire format the connection uses
+  m_queued.push_back(Frame::create(tag, data));
+  m_in_flight++;
+  return true;
+}
+
+bool PipelinedSender::flush() {
+  if (m_queued.empty()) {
+    return true;
+  }
+
+  bool ok = m_conn.send(m_queued.data(), m_queued.size());
+  for (Frame *frame : m_queued) {
+    frame->unref();
+  }
+  m_queued.clear();
+  return ok;
+}
+
+bool PipelinedSender::drain() {
+  if (!flush()) {
+    return false;
+  }
+  while (m_in_flight > 0) {
+    if (!read_ack()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PipelinedSender::read_ack() {
+  MessageView reply;
+  if (!m_conn.receive(reply)) {
+    return false;
+  }
+
+  m_in_flight--;
+  if (reply.code == TAG_CODE_ERR) {
+    m_errors++;
+    if (m_on_error) {
+      m_on_error(reply.data);
+    }
+  }
+  return true;
+}
+
+BufferedOutput::BufferedOutput(int fd, size_t flush_bytes, unsigned flush_ms)
+  : m_fd(fd), m_buf(flush_bytes > 0 ? flush_bytes : 1), m_len(0),
+    m_flush_ms(flush_ms), m_since(0) {
+}
+
+BufferedOutput::~BufferedOutput() {
+  flush();
+}
+
+uint64_t BufferedOutput::now_ms() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+int BufferedOutput::ms_left() const {
+  if (m_len == 0) {
+    return -1;
+  }
+  uint64_t waited = now_ms() - m_since;
+  return waited >= m_flush_ms ? 0 : int(m_flush_ms - waited);
+}
+
+void BufferedOutput::append_slow(std::string_view s) {
+  // doesn't fit: out with what's there, and anything bigger than the
+  // whole buffer goes straight out too
+  flush();
+  if (s.size() < m_buf.size()) {
+    append(s);
+  } else if (write_out(s.data(), s.size()) && m_on_flush) {
+    m_on_flush();
+  }
+}
+
+bool BufferedOutput::flush() {
+  if (m_len == 0) {
+    return true;
+  }
+
+  // if it fails the reader is gone, nothing more will get out anyway
+  bool ok = write_out(m_buf.data(), m_len);
+  m_len = 0;
+  if (ok && m_on_flush) {
+    m_on_flush();
+  }
+  return ok;
+}
+
+bool BufferedOutput::write_out(const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(m_fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
@@ -2,7 +2,13 @@
 #define CLIENT_UTIL_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstring>
+#include <cstdint>
 class Connection;
+class Frame;
 struct Message;
 
 // this header file is useful for any declarations for functions
@@ -14,4 +20,107 @@ std::string trim(const std::string &s);
 
 // you can add additional declarations here...
 
+// Log in with slogin or rlogin (tag), asking for binary framing if
+// binary is set and (receivers over a UNIX socket only) for
+// deliveries through a shared memory ring if shm is set; conn is
+// switched over to whatever the server agrees to. Prints the reason
+// and returns false if the login fails.
+bool client_login(Connection &conn, const std::string &tag,
+                  const std::string &username, bool binary, bool shm = false);
+
+// Sends requests over a logged-in sender connection without waiting
+// for each ack: up to `window` requests may be outstanding. The server
+// handles them in order and acks them in order, so all we have to do
+// is count. Requests are buffered and written together, either when
+// the window fills up (send then waits for acks to free up room) or
+// when flush is called; a window of 1 behaves just like sending a
+// request and waiting for its reply.
+class PipelinedSender {
+public:
+  PipelinedSender(Connection &conn, size_t window);
+  ~PipelinedSender();
+
+  // called with the text of every err reply, in request order
+  void on_error(std::function<void(std::string_view)> handler) {
+    m_on_error = handler;
+  }
+
+  // Queue a request. Returns false if the connection failed.
+  bool send(const Message &req);
+  bool send(std::string_view tag, std::string_view data);
+
+  // write out everything queued so far, without waiting for acks
+  bool flush();
+
+  // flush, then wait until every request has been acked
+  bool drain();
+
+  size_t in_flight() const { return m_in_flight; }
+  size_t errors() const { return m_errors; }
+
+private:
+  // prohibit value semantics
+  PipelinedSender(const PipelinedSender &);
+  PipelinedSender &operator=(const PipelinedSender &);
+
+  bool read_ack();
+
+  Connection &m_conn;
+  size_t m_window;
+  size_t m_in_flight;          // sent or queued, not acked yet
+  size_t m_errors;             // err replies so far
+  std::vector<Frame *> m_queued; // encoded requests not written yet
+  std::function<void(std::string_view)> m_on_error;
+};
+
+// Buffered output for a receiver printing a busy room: everything
+// appended collects in one big buffer that is written out with a
+// single write once it holds flush_bytes, or when flush is called. The
+// caller decides when to flush for time; ms_left says how long the
+// oldest byte in the buffer may still wait, going by flush_ms.
+class BufferedOutput {
+public:
+  BufferedOutput(int fd, size_t flush_bytes, unsigned flush_ms);
+  ~BufferedOutput(); // flushes
+
+  // called after every flush that wrote something out
+  void on_flush(std::function<void()> handler) { m_on_flush = handler; }
+
+  void append(std::string_view s) {
+    if (m_len + s.size() > m_buf.size()) {
+      append_slow(s);
+      return;
+    }
+    if (m_len == 0) {
+      m_since = now_ms();
+    }
+    memcpy(m_buf.data() + m_len, s.data(), s.size());
+    m_len += s.size();
+  }
+
+  bool empty() const { return m_len == 0; }
+
+  // -1 if there's nothing to flush, 0 if it's due now
+  int ms_left() const;
+
+  // write out everything buffered; false if the write failed
+  bool flush();
+
+private:
+  // prohibit value semantics
+  BufferedOutput(const BufferedOutput &);
+  BufferedOutput &operator=(const BufferedOutput &);
+
+  static uint64_t now_ms();
+  void append_slow(std::string_view s);
+  bool write_out(const char *data, size_t len);
+
+  int m_fd;
+  std::vector<char> m_buf;
+  size_t m_len;      // bytes buffered
+  unsigned m_flush_ms;
+  uint64_t m_since;  // now_ms() when the first buffered byte came in
+  std::function<void()> m_on_flush;
+};
+
 #endif // CLIENT_UTIL_H
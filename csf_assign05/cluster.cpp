@@ -0,0 +1,393 @@
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include "csapp.h"
+#include "message.h"
+#include "connection.h"
+#include "frame.h"
+#include "guard.h"
+#include "user.h"
+#include "room.h"
+#include "server.h"
+#include "cluster.h"
+
+// One link to a peer server. The reader (run_link) owns it; the writer
+// thread drains out, the queue rooms forward the peer's broadcasts to.
+struct Cluster::Link {
+    Cluster *cluster;
+    uint64_t node;   // the peer's node id
+    uint64_t dialer; // node id of the side that dialed
+    int fd;
+    std::shared_ptr<User> out;
+};
+
+namespace {
+
+// passed into the thread serving a link a peer dialed
+struct LinkArg {
+    Cluster *cluster;
+    int fd;
+};
+
+// how long to wait before dialing a peer again
+const unsigned REDIAL_SECONDS = 1;
+
+// and before accepting again after accept failed
+const useconds_t ACCEPT_BACKOFF_US = 100000;
+
+// how much a link's queue may hold before the link is dropped (every
+// room's broadcasts to that peer share it)
+const size_t PEER_QUEUE_MAX_BYTES = 64 * 1024 * 1024;
+
+// the handshake, "peer:<node id in hex>"
+Message peer_hello(uint64_t node) {
+    char id[17];
+    std::snprintf(id, sizeof(id), "%016lx", static_cast<unsigned long>(node));
+    return Message(TAG_PEER, id);
+}
+
+uint64_t parse_peer_hello(const MessageView &msg) {
+    if (msg.code != TAG_CODE_PEER) {
+        return 0;
+    }
+    std::string id(msg.data);
+    return strtoull(id.c_str(), nullptr, 16);
+}
+
+} // anonymous namespace
+
+Cluster::Cluster(Server *server)
+    : m_server(server), m_listenfd(-1) {
+    std::random_device rd;
+    do {
+        m_node = (uint64_t(rd()) << 32) | rd();
+    } while (m_node == 0);
+    m_peer_queues.max_bytes = PEER_QUEUE_MAX_BYTES;
+    m_peer_queues.policy = QueueControl::DISCONNECT;
+    pthread_mutex_init(&m_lock, nullptr);
+}
+
+Cluster::~Cluster() {
+    if (m_listenfd >= 0) {
+        ::close(m_listenfd);
+    }
+    pthread_mutex_destroy(&m_lock);
+}
+
+bool Cluster::listen(int port) {
+    m_listenfd = open_listenfd(std::to_string(port).c_str());
+    return m_listenfd >= 0;
+}
+
+void Cluster::add_peer(const std::string &host, int port) {
+    m_dialers.push_back(Dialer{ this, host, port });
+}
+
+void Cluster::start() {
+    pthread_t tid;
+    if (m_listenfd >= 0) {
+        Pthread_create(&tid, nullptr, accept_thread, this);
+    }
+    for (Dialer &d : m_dialers) {
+        Pthread_create(&tid, nullptr, dial_thread, &d);
+    }
+}
+
+void Cluster::local_join(const std::string &room_name) {
+    Guard g(m_lock);
+    if (m_rooms[room_name]++ == 0) {
+        gossip(TAG_JOIN, room_name);
+    }
+}
+
+void Cluster::local_leave(const std::string &room_name) {
+    Guard g(m_lock);
+    std::unordered_map<std::string, unsigned>::iterator it = m_rooms.find(room_name);
+    if (it != m_rooms.end() && --it->second == 0) {
+        m_rooms.erase(it);
+        gossip(TAG_LEAVE, room_name);
+    }
+}
+
+void Cluster::gossip(const char *tag, const std::string &room_name) {
+    // m_lock is held, so every link gets joins and leaves in the order
+    // they happened, and a new link can't miss one (see register_link)
+    Frame *frame = Frame::create(tag, room_name);
+    for (Link *link : m_links) {
+        frame->ref();
+        link->out->mqueue->enqueue(frame);
+    }
+    frame->unref();
+}
+
+void *Cluster::accept_thread(void *arg) {
+    pthread_detach(pthread_self());
+    Cluster *cluster = static_cast<Cluster *>(arg);
+
+    // a thread per link; peers are few
+    for (;;) {
+        int fd = accept(cluster->m_listenfd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(ACCEPT_BACKOFF_US);  // e.g. out of fds, don't spin
+            }
+            continue;
+        }
+
+        pthread_t tid;
+        Pthread_create(&tid, nullptr, link_thread, new LinkArg{ cluster, fd });
+    }
+    return nullptr;
+}
+
+void *Cluster::link_thread(void *arg) {
+    pthread_detach(pthread_self());
+    LinkArg *larg = static_cast<LinkArg *>(arg);
+    uint64_t remote;
+    larg->cluster->run_link(larg->fd, false, remote);
+    delete larg;
+    return nullptr;
+}
+
+void *Cluster::dial_thread(void *arg) {
+    pthread_detach(pthread_self());
+    Dialer *d = static_cast<Dialer *>(arg);
+    Cluster *cluster = d->cluster;
+    std::string port = std::to_string(d->port);
+    uint64_t remote = 0;
+
+    for (;;) {
+        // If the peer dialed us too, only one of the two links is kept
+        // (see register_link). When that's the peer's, there's no
+        // point dialing again until it goes down.
+        if (remote != 0 && cluster->is_linked(remote)) {
+            sleep(REDIAL_SECONDS);
+            continue;
+        }
+
+        int fd = open_clientfd(const_cast<char *>(d->host.c_str()),
+                               const_cast<char *>(port.c_str()));
+        if (fd < 0) {
+            sleep(REDIAL_SECONDS);  // not up (yet)
+            continue;
+        }
+
+        cluster->run_link(fd, true, remote);
+        if (remote == cluster->m_node) {
+            break;  // that was us
+        }
+        sleep(REDIAL_SECONDS);
+    }
+    return nullptr;
+}
+
+void Cluster::run_link(int fd, bool dialed, uint64_t &remote) {
+    Connection conn(fd);
+    conn.set_nodelay(true);
+    MessageView hello;
+    remote = 0;
+
+    // exchange node ids in text, the dialer going first
+    try {
+        if (dialed) {
+            if (conn.send(peer_hello(m_node)) && conn.receive(hello)) {
+                remote = parse_peer_hello(hello);
+            }
+        } else if (conn.receive(hello)) {
+            remote = parse_peer_hello(hello);
+            if (remote != 0 && !conn.send(peer_hello(m_node))) {
+                remote = 0;
+            }
+        }
+    } catch (const std::exception &) {
+        remote = 0;
+    }
+    if (remote == 0 || remote == m_node) {
+        return;
+    }
+    conn.set_format(WIRE_BINARY);
+
+    // dropping single frames from the peer's queue would lose them for
+    // every receiver over there without anyone noticing; past its limit
+    // the whole link goes instead, like a link that went down
+    Link link;
+    link.cluster = this;
+    link.node = remote;
+    link.dialer = dialed ? m_node : remote;
+    link.fd = fd;
+    link.out = std::make_shared<User>(std::string(peer_hello(remote).data),
+                                      m_server->get_options().queue_kind,
+                                      &m_peer_queues, WIRE_BINARY);
+    if (!register_link(&link)) {
+        return;
+    }
+
+    pthread_t writer;
+    Pthread_create(&writer, nullptr, writer_thread, &link);
+
+    // the rooms the peer has receivers in, with the peer among their
+    // peers
+    std::unordered_map<std::string, std::shared_ptr<Room> > joined;
+
+    for (;;) {
+        MessageView msg;
+        try {
+            if (!conn.receive(msg)) {
+                break;
+            }
+        } catch (const std::exception &) {
+            break;
+        }
+
+        if (msg.code == TAG_CODE_DELIVERY) {
+            // room:sender:text
+            size_t colon1 = msg.data.find(':');
+            size_t colon2 = colon1 == std::string_view::npos ?
+                            colon1 : msg.data.find(':', colon1 + 1);
+            if (colon2 == std::string_view::npos) {
+                continue;
+            }
+            std::shared_ptr<Room> room =
+                m_server->find_or_create_room(std::string(msg.data.substr(0, colon1)));
+            if (room) {
+                room->relay_message(msg.data.substr(colon1 + 1, colon2 - colon1 - 1),
+                                    msg.data.substr(colon2 + 1));
+            }
+
+        } else if (msg.code == TAG_CODE_JOIN) {
+            std::string room_name(msg.data);
+            if (joined.count(room_name) == 0) {
+                std::shared_ptr<Room> room = m_server->find_or_create_room(room_name);
+                if (room) {
+                    room->add_peer(link.out);
+                    joined[room_name] = room;
+                }
+            }
+
+        } else if (msg.code == TAG_CODE_LEAVE) {
+            std::unordered_map<std::string, std::shared_ptr<Room> >::iterator it =
+                joined.find(std::string(msg.data));
+            if (it != joined.end()) {
+                it->second->remove_peer(link.out.get());
+                joined.erase(it);
+            }
+        }
+    }
+
+    // down: stop forwarding to it, and get the writer to quit too
+    unregister_link(&link);
+    shutdown(fd, SHUT_RDWR);
+    pthread_join(writer, nullptr);
+    for (const std::pair<const std::string, std::shared_ptr<Room> > &entry : joined) {
+        entry.second->remove_peer(link.out.get());
+    }
+}
+
+void *Cluster::writer_thread(void *arg) {
+    Link *link = static_cast<Link *>(arg);
+    MessageQueue *queue = link->out->mqueue;
+
+    // its own Connection (on its own fd) so it never touches the
+    // reader's state
+    Connection conn(dup(link->fd));
+    conn.set_format(WIRE_BINARY);
+    std::vector<Frame *> batch(link->cluster->m_server->get_options().write_batch);
+
+    pollfd fds[2];
+    fds[0].fd = conn.get_fd();
+    fds[0].events = POLLRDHUP;
+    fds[1].fd = queue->get_notify_fd();
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            break;  // the reader is done with the link
+        }
+        if (queue->is_overflowed()) {
+            std::fprintf(stderr, "cluster: peer %016lx isn't keeping up, dropping the link\n",
+                         static_cast<unsigned long>(link->node));
+            break;
+        }
+
+        // drain in batches, each batch goes out in one writev
+        bool sent_ok = true;
+        size_t n;
+        do {
+            n = 0;
+            Frame *frame;
+            while (n < batch.size() && (frame = queue->dequeue())) {
+                batch[n++] = frame;
+            }
+            sent_ok = n == 0 || conn.send(batch.data(), n);
+            for (size_t i = 0; i < n; i++) {
+                batch[i]->unref();
+            }
+        } while (sent_ok && n > 0);
+        if (!sent_ok) {
+            break;
+        }
+    }
+
+    // wake up the reader, if it isn't already on its way out
+    shutdown(link->fd, SHUT_RDWR);
+    return nullptr;
+}
+
+bool Cluster::register_link(Link *link) {
+    Guard g(m_lock);
+
+    // Both sides may have dialed; then the two servers each keep the
+    // link dialed by the smaller node id and drop the other, so they
+    // end up agreeing on one.
+    for (size_t i = 0; i < m_links.size(); i++) {
+        Link *other = m_links[i];
+        if (other->node != link->node) {
+            continue;
+        }
+        if (other->dialer < link->dialer) {
+            return false;
+        }
+        shutdown(other->fd, SHUT_RDWR);  // its reader cleans up
+        m_links.erase(m_links.begin() + i);
+        break;
+    }
+
+    // the peer starts out knowing about every room we have receivers
+    // in; later changes follow in order through gossip
+    for (const std::pair<const std::string, unsigned> &entry : m_rooms) {
+        link->out->mqueue->enqueue(Frame::create(TAG_JOIN, entry.first));
+    }
+    m_links.push_back(link);
+    return true;
+}
+
+void Cluster::unregister_link(Link *link) {
+    Guard g(m_lock);
+    for (size_t i = 0; i < m_links.size(); i++) {
+        if (m_links[i] == link) {
+            m_links.erase(m_links.begin() + i);
+            break;
+        }
+    }
+}
+
+bool Cluster::is_linked(uint64_t node) {
+    Guard g(m_lock);
+    for (Link *link : m_links) {
+        if (link->node == node) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,95 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <pthread.h>
+#include "message_queue.h"
+class Server;
+
+// Several servers can run as one cluster, so a room's receivers can
+// be spread over more machines (or processes) than one server could
+// fan out to. Every server links to every other one over TCP (each
+// pair needs one link; it doesn't matter which side lists the other,
+// or if both do). A link starts with both sides sending
+// "peer:<node id>" in text, then carries binary frames (wire.h) of
+// the receiver protocol both ways:
+//
+//   join:<room>               the sending server has receivers in room
+//                             now, so it wants the room's broadcasts
+//   leave:<room>              it has none left
+//   delivery:<room>:<sender>:<text>
+//                             a broadcast into room
+//
+// A server passes on a room's broadcasts to the peers that have
+// joined it (see Room::add_peer), and a broadcast that came in from a
+// peer is only delivered locally, never passed on again. With every
+// pair of servers linked, a receiver on any of them gets each message
+// once. Joins and leaves are only sent when a room gets its first
+// local receiver or loses its last one, and a new link starts with a
+// join for every room the server has receivers in.
+//
+// Each link has a thread reading from it and one writing the peer's
+// queue to it. A link that goes down is redialed every second by the
+// side that dialed it; a peer misses the broadcasts sent meanwhile.
+// The same goes for a peer that can't keep up: once its queue holds
+// more than PEER_QUEUE_MAX_BYTES the link is dropped (and redialed,
+// starting afresh) rather than letting the queue grow without bound.
+// Direct messages (senduser) stay on the server they were sent to.
+class Cluster {
+public:
+  Cluster(Server *server);
+  ~Cluster();
+
+  // accept links from peers on port; false if it can't be listened on
+  bool listen(int port);
+
+  // keep a link to the server whose peers listen at host:port
+  void add_peer(const std::string &host, int port);
+
+  // start accepting and dialing
+  void start();
+
+  // a room got its first local receiver / lost its last one
+  void local_join(const std::string &room_name);
+  void local_leave(const std::string &room_name);
+
+private:
+  // prohibit value semantics
+  Cluster(const Cluster &);
+  Cluster &operator=(const Cluster &);
+
+  struct Link;
+  struct Dialer {
+    Cluster *cluster;
+    std::string host;
+    int port;
+  };
+
+  static void *accept_thread(void *arg);
+  static void *link_thread(void *arg);
+  static void *dial_thread(void *arg);
+  static void *writer_thread(void *arg);
+
+  // handshake on fd and serve the link until it goes down; remote is
+  // set to the peer's node id (0 if the handshake failed)
+  void run_link(int fd, bool dialed, uint64_t &remote);
+  bool register_link(Link *link);
+  void unregister_link(Link *link);
+  bool is_linked(uint64_t node);
+  void gossip(const char *tag, const std::string &room_name);
+
+  Server *m_server;
+  uint64_t m_node;   // random, tells the servers apart
+  int m_listenfd;    // -1 unless listen was called
+  std::vector<Dialer> m_dialers;
+  QueueControl m_peer_queues; // the limit on every link's queue
+
+  pthread_mutex_t m_lock; // must be held while accessing the members below
+  std::vector<Link *> m_links; // one per peer
+  std::unordered_map<std::string, unsigned> m_rooms; // with local receivers
+};
+
+#endif // CLUSTER_H
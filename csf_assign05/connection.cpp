@@ -2,20 +2,66 @@
 #include <string>
 #include <cctype>
 #include <cassert>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "csapp.h"
 #include "message.h"
+#include "frame.h"
+#include "metrics.h"
+#include "shm_ring.h"
 #include "connection.h"
 
+namespace {
+
+// the receive buffer starts small and grows (up to the largest
+// message we accept) only if a message doesn't fit
+const size_t INITIAL_INBUF_SIZE = 4096;
+
+// most iovecs one async writev takes, kept small since they live in
+// the coroutine frame (a blocking send can use IOV_MAX on the stack)
+const int ASYNC_IOV_MAX = 128;
+
+// skip over the first `done` bytes of an iovec array, resuming
+// mid-iovec if need be
+void skip_iov(iovec *&iov, int &n, size_t done) {
+    while (n > 0 && done >= iov->iov_len) {
+        done -= iov->iov_len;
+        iov++;
+        n--;
+    }
+    if (n > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+        iov->iov_len -= done;
+    }
+}
+
+} // anonymous namespace
+
 Connection::Connection()
     : m_fd(-1),
+      m_format(WIRE_TEXT),
+      m_inpos(0),
+      m_inend(0),
+      m_shm(nullptr),
+      m_shm_direction(SHM_SEND),
       m_last_result(SUCCESS) {
 }
 
 Connection::Connection(int fd)
     : m_fd(fd),
+      m_format(WIRE_TEXT),
+      m_inpos(0),
+      m_inend(0),
+      m_shm(nullptr),
+      m_shm_direction(SHM_SEND),
       m_last_result(SUCCESS) {
-    rio_readinitb(&m_fdbuf, m_fd);
 }
 
 void Connection::connect(const std::string &hostname, int port) {
@@ -31,16 +77,30 @@ void Connection::connect(const std::string &hostname, int port) {
     }
 
     m_fd = fd;
+}
+
+void Connection::connect_unix(const std::string &path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long" << std::endl;
+        std::exit(1);
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 ||
+        ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "Could not connect" << std::endl;
+        std::exit(1);
+    }
 
-    // initialize rio buffer
-    rio_readinitb(&m_fdbuf, m_fd);
+    m_fd = fd;
 }
 
 Connection::~Connection() {
-    if (m_fd >= 0) {
-        ::close(m_fd);
-        m_fd = -1;
-    }
+    close();
 }
 
 bool Connection::is_open() const {
@@ -48,60 +108,387 @@ bool Connection::is_open() const {
 }
 
 void Connection::close() {
+    m_watch.stop();
     if (m_fd >= 0) {
         ::close(m_fd);
         m_fd = -1;
     }
+    delete m_shm;
+    m_shm = nullptr;
+}
+
+void Connection::attach_shm(ShmRing *ring, ShmDirection direction) {
+    delete m_shm;
+    m_shm = ring;
+    m_shm_direction = direction;
 }
 
 /*
  * Send a message in protocol format:
  *     tag:data\n
+ * or as a binary frame, gathered straight from the message's strings
  */
 bool Connection::send(const Message &msg) {
-    std::string line = msg.tag + ":" + msg.data + "\n";
+    uint64_t start = Metrics::now();
+    iovec iov[4];
+    int n;
+    char header[WIRE_BINARY_HEADER_LEN];
 
-    ssize_t written = rio_writen(m_fd, line.c_str(), line.size());
-    if (written < 0 || static_cast<size_t>(written) != line.size()) {
-        m_last_result = EOF_OR_ERROR;
-        return false;
+    if (m_format == WIRE_BINARY) {
+        wire_put_header(header, wire_tag_code(msg.tag), msg.data.size());
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = const_cast<char *>(msg.data.data());
+        iov[1].iov_len = msg.data.size();
+        n = 2;
+    } else {
+        iov[0].iov_base = const_cast<char *>(msg.tag.data());
+        iov[0].iov_len = msg.tag.size();
+        iov[1].iov_base = const_cast<char *>(":");
+        iov[1].iov_len = 1;
+        iov[2].iov_base = const_cast<char *>(msg.data.data());
+        iov[2].iov_len = msg.data.size();
+        iov[3].iov_base = const_cast<char *>("\n");
+        iov[3].iov_len = 1;
+        n = 4;
     }
 
-    m_last_result = SUCCESS;
+    bool ok = writev_fully(iov, n);
+    m_last_result = ok ? SUCCESS : EOF_OR_ERROR;
+    count_sent(1, start);
+    return ok;
+}
+
+bool Connection::send(const Frame &frame) {
+    uint64_t start = Metrics::now();
+    iovec iov[2];
+    bool ok = writev_fully(iov, frame.wire_iov(m_format, 0, iov));
+    m_last_result = ok ? SUCCESS : EOF_OR_ERROR;
+    count_sent(1, start);
+    return ok;
+}
+
+bool Connection::send(Frame *const *frames, size_t count) {
+    uint64_t start = Metrics::now();
+
+    // a binary frame takes two iovecs (header, data)
+    int per_frame = m_format == WIRE_BINARY ? 2 : 1;
+
+    // more than one writev: cork so the chunk boundaries don't turn
+    // into short segments, the uncork at the end pushes the tail out
+    bool corked = count * per_frame > size_t(IOV_MAX);
+    if (corked) {
+        int on = 1;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+
+    iovec iov[IOV_MAX];
+    bool ok = true;
+    size_t i = 0;
+    while (ok && i < count) {
+        int n = 0;
+        for (; i < count && n + per_frame <= IOV_MAX; i++) {
+            n += frames[i]->wire_iov(m_format, 0, iov + n);
+        }
+        ok = writev_fully(iov, n);
+    }
+
+    if (corked) {
+        int off = 0;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    }
+
+    m_last_result = ok ? SUCCESS : EOF_OR_ERROR;
+    count_sent(count, start);
+    return ok;
+}
+
+void Connection::count_sent(size_t frames, uint64_t start) {
+    if (m_last_result == SUCCESS) {
+        Metrics::count(Metrics::FRAMES_SENT, frames);
+    }
+    Metrics::record_since(Metrics::SEND_TIME, start);
+}
+
+bool Connection::writev_fully(iovec *iov, int n) {
+    if (m_shm && m_shm_direction == SHM_SEND) {
+        return write_shm(iov, n);
+    }
+
+    while (n > 0) {
+        ssize_t written = writev(m_fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        Metrics::count(Metrics::BYTES_SENT, written);
+        skip_iov(iov, n, written);
+    }
+    return true;
+}
+
+bool Connection::write_shm(iovec *iov, int n) {
+    while (n > 0) {
+        size_t written = m_shm->write(iov, n);
+        if (written > 0) {
+            if (m_shm->reader_needs_wakeup()) {
+                ShmRing::ring_doorbell(m_fd);
+            }
+            Metrics::count(Metrics::BYTES_SENT, written);
+            skip_iov(iov, n, written);
+            continue;
+        }
+
+        // ring full, wait for the reader to make room
+        if (m_shm->writer_may_sleep() && !wait_for_doorbell()) {
+            return false;
+        }
+    }
     return true;
 }
 
+void Connection::set_nodelay(bool on) {
+    int val = on ? 1 : 0;
+    setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
 /*
- * Receive a message:
- * read a line "tag:data"
+ * Receive a message, either a line "tag:data" or a binary frame
  */
 bool Connection::receive(Message &msg) {
-    char buf[Message::MAX_LEN + 2];
+    MessageView view;
+    if (!receive(view)) {
+        return false;
+    }
+    msg.tag.assign(view.tag);
+    msg.data.assign(view.data);
+    return true;
+}
 
-    ssize_t n = rio_readlineb(&m_fdbuf, buf, sizeof(buf));
-    if (n <= 0) {
-        m_last_result = EOF_OR_ERROR;
+bool Connection::receive(MessageView &msg) {
+    for (;;) {
+        WireParse result = parse_buffered(msg);
+        if (result != WIRE_INCOMPLETE) {
+            return result == WIRE_PARSED;
+        }
+
+        if (!fill_buffer()) {
+            m_last_result = EOF_OR_ERROR;
+            return false;
+        }
+    }
+}
+
+WireParse Connection::parse_buffered(MessageView &msg) {
+    size_t used = 0;
+    WireParse result = WIRE_INCOMPLETE;
+    if (m_inend > m_inpos) {
+        result = wire_parse(m_inbuf.data() + m_inpos, m_inend - m_inpos,
+                            m_format, msg, &used);
+    }
+    if (result == WIRE_PARSED) {
+        m_inpos += used;
+        m_last_result = SUCCESS;
+        Metrics::count(Metrics::MSGS_RECEIVED);
+        Metrics::count(Metrics::BYTES_RECEIVED, used);
+    } else if (result == WIRE_INVALID) {
+        m_inpos += used;
+        m_last_result = INVALID_MSG;
+    }
+    return result;
+}
+
+void Connection::make_room() {
+    // move the partial message to the front (this is what makes
+    // earlier views invalid), then grow if it fills the buffer
+    if (m_inpos > 0) {
+        memmove(m_inbuf.data(), m_inbuf.data() + m_inpos, m_inend - m_inpos);
+        m_inend -= m_inpos;
+        m_inpos = 0;
+    }
+    if (m_inend == m_inbuf.size()) {
+        m_inbuf.resize(std::max(INITIAL_INBUF_SIZE, m_inbuf.size() * 2));
+    }
+}
+
+bool Connection::fill_buffer() {
+    make_room();
+
+    if (m_shm && m_shm_direction == SHM_RECEIVE) {
+        return fill_from_shm();
+    }
+
+    for (;;) {
+        ssize_t n = read(m_fd, m_inbuf.data() + m_inend, m_inbuf.size() - m_inend);
+        if (n > 0) {
+            m_inend += n;
+            return true;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
         return false;
     }
+}
+
+bool Connection::fill_from_shm() {
+    for (;;) {
+        size_t n = m_shm->read(m_inbuf.data() + m_inend, m_inbuf.size() - m_inend);
+        if (n > 0) {
+            m_inend += n;
+            if (m_shm->writer_needs_wakeup()) {
+                ShmRing::ring_doorbell(m_fd);
+            }
+            return true;
+        }
+
+        if (m_shm->reader_may_sleep() && !wait_for_doorbell()) {
+            return false;
+        }
+    }
+}
+
+bool Connection::wait_for_doorbell() {
+    // doorbells carry no information, take as many as are there
+    char buf[64];
+    for (;;) {
+        ssize_t n = read(m_fd, buf, sizeof(buf));
+        if (n > 0) {
+            return true;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return false; // EOF or error (or a receive timeout)
+    }
+}
 
-    std::string line(buf);
+////////////////////////////////////////////////////////////////////////
+// Coroutine I/O (coro mode)
+////////////////////////////////////////////////////////////////////////
+
+void Connection::attach_loop(CoroLoop *loop) {
+    int flags = fcntl(m_fd, F_GETFL, 0);
+    fcntl(m_fd, F_SETFL, flags | O_NONBLOCK);
+    m_watch.watch(loop, m_fd);
+}
 
-    // strip newline + CR characters
-    while (!line.empty() &&
-           (line.back() == '\n' || line.back() == '\r')) {
-        line.pop_back();
+Task<bool> Connection::async_receive(MessageView &msg) {
+    for (;;) {
+        WireParse result = parse_buffered(msg);
+        if (result != WIRE_INCOMPLETE) {
+            co_return result == WIRE_PARSED;
+        }
+
+        make_room();
+        ssize_t n = read(m_fd, m_inbuf.data() + m_inend, m_inbuf.size() - m_inend);
+        if (n > 0) {
+            m_inend += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            m_watch.readable = false;
+            co_await CoroLoop::readable(m_watch);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            m_last_result = EOF_OR_ERROR;
+            co_return false;
+        }
     }
+}
 
-    // find first colon
-    size_t pos = line.find(':');
-    if (pos == std::string::npos) {
-        m_last_result = EOF_OR_ERROR;
+bool Connection::input_ready() {
+    if (has_buffered_input()) {
+        return true;
+    }
+    if (!m_watch.readable) {
         return false;
     }
+    char ch;
+    ssize_t n = recv(m_fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        m_watch.readable = false;
+        return false;
+    }
+    return true; // data, EOF or an error, which the receive will report
+}
 
-    msg.tag  = line.substr(0, pos);
-    msg.data = line.substr(pos + 1);
+Task<bool> Connection::async_send(const Message &msg) {
+    uint64_t start = Metrics::now();
+    iovec iov[4];
+    int n;
+    char header[WIRE_BINARY_HEADER_LEN];
 
-    m_last_result = SUCCESS;
-    return true;
+    if (m_format == WIRE_BINARY) {
+        wire_put_header(header, wire_tag_code(msg.tag), msg.data.size());
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = const_cast<char *>(msg.data.data());
+        iov[1].iov_len = msg.data.size();
+        n = 2;
+    } else {
+        iov[0].iov_base = const_cast<char *>(msg.tag.data());
+        iov[0].iov_len = msg.tag.size();
+        iov[1].iov_base = const_cast<char *>(":");
+        iov[1].iov_len = 1;
+        iov[2].iov_base = const_cast<char *>(msg.data.data());
+        iov[2].iov_len = msg.data.size();
+        iov[3].iov_base = const_cast<char *>("\n");
+        iov[3].iov_len = 1;
+        n = 4;
+    }
+
+    bool ok = co_await async_writev(iov, n);
+    m_last_result = ok ? SUCCESS : EOF_OR_ERROR;
+    count_sent(1, start);
+    co_return ok;
+}
+
+Task<bool> Connection::async_send(Frame *const *frames, size_t count) {
+    uint64_t start = Metrics::now();
+    int per_frame = m_format == WIRE_BINARY ? 2 : 1;
+
+    // cork across chunks, as in send
+    bool corked = count * per_frame > size_t(ASYNC_IOV_MAX);
+    if (corked) {
+        int on = 1;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+
+    iovec iov[ASYNC_IOV_MAX];
+    bool ok = true;
+    size_t i = 0;
+    while (ok && i < count) {
+        int n = 0;
+        for (; i < count && n + per_frame <= ASYNC_IOV_MAX; i++) {
+            n += frames[i]->wire_iov(m_format, 0, iov + n);
+        }
+        ok = co_await async_writev(iov, n);
+    }
+
+    if (corked) {
+        int off = 0;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    }
+
+    m_last_result = ok ? SUCCESS : EOF_OR_ERROR;
+    count_sent(count, start);
+    co_return ok;
+}
+
+Task<bool> Connection::async_writev(iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t written = writev(m_fd, iov, n);
+        if (written >= 0) {
+            Metrics::count(Metrics::BYTES_SENT, written);
+            skip_iov(iov, n, written);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            m_watch.writable = false;
+            co_await CoroLoop::writable(m_watch);
+        } else if (errno != EINTR) {
+            co_return false;
+        }
+    }
+    co_return true;
 }
@@ -1,8 +1,16 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <string>
+#include <vector>
+#include <cstdint>
 #include "csapp.h"
+#include "wire.h"
+#include "coro.h"
 struct Message;
+struct MessageView;
+class Frame;
+class ShmRing;
 
 class Connection {
 public:
@@ -30,8 +38,13 @@ public:
   // Connect to a server via specified hostname and port number.
   void connect(const std::string &hostname, int port);
 
+  // Connect to a server listening on a UNIX domain socket.
+  void connect_unix(const std::string &path);
+
   bool is_open() const;
 
+  int get_fd() const { return m_fd; }
+
   void close();
 
   // send and receive should set m_last_result to indicate
@@ -41,18 +54,91 @@ public:
   bool send(const Message &msg);
   bool receive(Message &msg);
 
+  // Receive without copying: msg points into the connection's receive
+  // buffer and stays valid only until the next receive.
+  bool receive(MessageView &msg);
+
+  // send an already encoded frame, straight from its buffer
+  bool send(const Frame &frame);
+
+  // send several frames with as few writev calls as possible (one,
+  // unless there are more than IOV_MAX of them)
+  bool send(Frame *const *frames, size_t count);
+
+  // Coroutine versions of the above, for the server's coro mode (see
+  // coro.h): the socket is made non-blocking and watched by loop, and
+  // instead of blocking, receive and send suspend the calling
+  // coroutine until it's ready. (No shared-memory rings this way.)
+  void attach_loop(CoroLoop *loop);
+  Task<bool> async_receive(MessageView &msg);
+  Task<bool> async_send(const Message &msg);
+  Task<bool> async_send(Frame *const *frames, size_t count);
+
+  // the watch attach_loop set up, e.g. to wait for input alongside
+  // something else
+  CoroWatch &get_watch() { return m_watch; }
+
+  // After the watch said readable: whether the peer really has sent
+  // something (or hung up) that a receive can start on without
+  // waiting. The watch can still say readable after everything has
+  // been read; this finds out, and clears it if so.
+  bool input_ready();
+
+  // TCP_NODELAY: the server batches writes itself, so don't let
+  // Nagle hold back a lone small delivery. (No-op on non-TCP sockets.)
+  void set_nodelay(bool on);
+
   Result get_last_result() const { return m_last_result; }
 
+  // Whether received bytes are waiting to be parsed, i.e. the peer
+  // has sent more (at least the start of another message) that the
+  // next receive can get to without waiting for the network.
+  bool has_buffered_input() const { return m_inend > m_inpos; }
+
+  // Wire format for everything sent and received from now on (see
+  // wire.h). Bytes already buffered are parsed in the new format too,
+  // so switch right after the login reply, before the next receive.
+  void set_format(WireFormat format) { m_format = format; }
+  WireFormat get_format() const { return m_format; }
+
+  // which direction of a connection a shared-memory ring carries
+  enum ShmDirection {
+    SHM_SEND,    // everything sent goes into the ring (the server)
+    SHM_RECEIVE, // everything received comes out of it (a receiver)
+  };
+
+  // Switch one direction over to a shared-memory ring (see
+  // shm_ring.h), which the connection takes over. The other direction
+  // stays on the socket, which also carries the ring's doorbells.
+  void attach_shm(ShmRing *ring, ShmDirection direction);
+  bool has_shm() const { return m_shm != nullptr; }
+
 private:
   // prohibit value semantics
   Connection(const Connection &);
   Connection &operator=(const Connection &);
 
+  bool writev_fully(iovec *iov, int n);
+  Task<bool> async_writev(iovec *iov, int n);
+  WireParse parse_buffered(MessageView &msg);
+  void make_room();
+  void count_sent(size_t frames, uint64_t start); // metrics for a send
+  bool write_shm(iovec *iov, int n);
+  bool fill_buffer();
+  bool fill_from_shm();
+  bool wait_for_doorbell();
+
   // these are the recommended member variables for the
   // Connection class
   int m_fd;
-  rio_t m_fdbuf; // used to allow buffered input
+  WireFormat m_format;
+  std::vector<char> m_inbuf; // received bytes, parsed in place
+  size_t m_inpos;            // start of the unparsed bytes
+  size_t m_inend;            // end of the received bytes
+  ShmRing *m_shm;            // owned, null unless attach_shm was called
+  ShmDirection m_shm_direction;
   Result m_last_result;
+  CoroWatch m_watch;         // only used after attach_loop
 };
 
 #endif // CONNECTION_H
@@ -0,0 +1,129 @@
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cerrno>
+#include "csapp.h"
+#include "coro.h"
+
+namespace {
+
+const int MAX_EVENTS = 256;
+
+void fatal(const char *msg) {
+    unix_error(const_cast<char *>(msg));
+}
+
+// an epoll registration is the fd plus its watch's generation, so an
+// event that was already fetched for a watch that has since stopped
+// (and maybe given its fd number to a new one) can be told apart
+uint64_t watch_key(const CoroWatch *w) {
+    return uint64_t(w->gen) << 32 | uint32_t(w->fd);
+}
+
+// hangups and errors count as readable: the next read reports them
+const uint32_t READ_EVENTS = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+const uint32_t WRITE_EVENTS = EPOLLOUT | EPOLLHUP | EPOLLERR;
+
+} // anonymous namespace
+
+void CoroWatch::watch(CoroLoop *loop, int fd) {
+    stop();
+    this->loop = loop;
+    this->fd = fd;
+    readable = writable = false;
+    loop->add(this);
+}
+
+void CoroWatch::stop() {
+    if (loop) {
+        loop->remove(this);
+        loop = nullptr;
+    }
+}
+
+CoroLoop::CoroLoop()
+    : m_epfd(epoll_create1(EPOLL_CLOEXEC)), m_next_gen(0) {
+    if (m_epfd < 0) {
+        fatal("epoll_create1 error");
+    }
+}
+
+CoroLoop::~CoroLoop() {
+    close(m_epfd);
+}
+
+void CoroLoop::spawn(Task<> task) {
+    task.release().resume();
+}
+
+void CoroLoop::add(CoroWatch *w) {
+    w->gen = ++m_next_gen;
+    if (size_t(w->fd) >= m_watches.size()) {
+        m_watches.resize(w->fd + 1);
+    }
+    m_watches[w->fd] = w;
+
+    // registered once, edge-triggered: both directions are reported as
+    // they become ready, nobody has to re-arm anything
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = watch_key(w);
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
+        fatal("epoll_ctl error");
+    }
+}
+
+void CoroLoop::remove(CoroWatch *w) {
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, w->fd, nullptr);
+    m_watches[w->fd] = nullptr;
+}
+
+void CoroLoop::run() {
+    epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        // with coroutines waiting to go again, only check for events
+        int n = epoll_wait(m_epfd, events, MAX_EVENTS, m_ready.empty() ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fatal("epoll_wait error");
+        }
+
+        for (int i = 0; i < n; i++) {
+            // a coroutine resumed for an earlier event may have
+            // stopped this watch already
+            uint32_t fd = uint32_t(events[i].data.u64);
+            CoroWatch *w = fd < m_watches.size() ? m_watches[fd] : nullptr;
+            if (!w || watch_key(w) != events[i].data.u64) {
+                continue;
+            }
+
+            // a coroutine waits for one thing at a time, so at most
+            // one of these is set; after resuming it, w may be gone
+            std::coroutine_handle<> h;
+            if (events[i].events & READ_EVENTS) {
+                w->readable = true;
+                std::swap(h, w->reader);
+            }
+            if (events[i].events & WRITE_EVENTS) {
+                w->writable = true;
+                if (!h) {
+                    std::swap(h, w->writer);
+                }
+            }
+            if (h) {
+                h.resume();
+            }
+        }
+
+        // then everyone that yielded, once (those yielding again wait
+        // for the next round); the two vectors trade places and keep
+        // their capacity, so this doesn't allocate
+        m_running.swap(m_ready);
+        for (std::coroutine_handle<> h : m_running) {
+            h.resume();
+        }
+        m_running.clear();
+    }
+}
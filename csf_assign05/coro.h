@@ -0,0 +1,241 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include "pool.h"
+class CoroLoop;
+
+// Coroutines for the server's coro mode. A client is served by one
+// coroutine that reads like the thread-per-client code (receive,
+// handle, send, repeat), but where that code would block, the
+// coroutine suspends and the loop's thread goes on with other
+// clients. A connection costs a coroutine frame (a few hundred bytes,
+// from the pool) instead of a thread and its stack.
+//
+// Task<T> is a coroutine returning T. It starts suspended: either
+// another coroutine co_awaits it (which runs it there and then, and
+// gets its result once it finishes) or CoroLoop::spawn starts it
+// running on its own, freeing it when it's done. Waits on file
+// descriptors all bottom out in the CoroLoop awaitables below.
+
+template <typename T = void> class Task;
+
+namespace coro_detail {
+
+// what every Task's promise has: the frame is pool allocated, and
+// finishing resumes whoever awaited the task
+struct PromiseBase : PoolAllocated {
+  std::coroutine_handle<> continuation; // null if spawned
+  std::exception_ptr error;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      std::coroutine_handle<> next = h.promise().continuation;
+      if (next) {
+        return next;
+      }
+      // spawned: nobody is there to take the result (or an exception)
+      if (h.promise().error) {
+        std::terminate();
+      }
+      h.destroy();
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept { }
+  };
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+  T value;
+
+  Task<T> get_return_object();
+  void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void return_void() { }
+};
+
+} // namespace coro_detail
+
+template <typename T>
+class Task {
+public:
+  typedef coro_detail::Promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  explicit Task(Handle h) : m_handle(h) { }
+  Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) { }
+  ~Task() {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  // co_await runs the task, resuming the awaiter when it's done
+  // (symmetric transfer both ways, so deep chains don't grow the stack)
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    m_handle.promise().continuation = awaiter;
+    return m_handle;
+  }
+
+  T await_resume() {
+    if (m_handle.promise().error) {
+      std::rethrow_exception(m_handle.promise().error);
+    }
+    if constexpr (!std::is_void_v<T>) {
+      return std::move(m_handle.promise().value);
+    }
+  }
+
+  // give up the frame (to CoroLoop::spawn)
+  Handle release() { return std::exchange(m_handle, nullptr); }
+
+private:
+  // prohibit value semantics
+  Task(const Task &);
+  Task &operator=(const Task &);
+
+  Handle m_handle;
+};
+
+namespace coro_detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+
+} // namespace coro_detail
+
+// One file descriptor registered with a CoroLoop (edge-triggered),
+// and the coroutine waiting for it, if any. readable/writable say the
+// loop has seen the fd turn ready and nobody has found it not ready
+// since: whoever gets EAGAIN must clear the flag before waiting.
+struct CoroWatch {
+  CoroLoop *loop;   // null when not watching anything
+  int fd;
+  uint32_t gen;     // tells a reused fd from the one it replaced
+  bool readable;
+  bool writable;
+  std::coroutine_handle<> reader;
+  std::coroutine_handle<> writer;
+
+  CoroWatch()
+    : loop(nullptr), fd(-1), gen(0), readable(false), writable(false) { }
+  CoroWatch(CoroLoop *loop, int fd) : CoroWatch() { watch(loop, fd); }
+  ~CoroWatch() { stop(); }
+
+  // start watching fd on loop / stop (before fd is closed)
+  void watch(CoroLoop *loop, int fd);
+  void stop();
+
+private:
+  // prohibit value semantics
+  CoroWatch(const CoroWatch &);
+  CoroWatch &operator=(const CoroWatch &);
+};
+
+// A single-threaded epoll loop that runs coroutines. Everything
+// registered with a loop, and every coroutine waiting on it, belongs
+// to the thread that runs it.
+class CoroLoop {
+public:
+  CoroLoop();
+  ~CoroLoop();
+
+  // start task running; it's freed when it finishes (and must not
+  // let an exception escape)
+  void spawn(Task<> task);
+
+  // wait for events and resume whoever they're for (does not return)
+  void run();
+
+  // resumes once w's fd is readable (right away if it may be already)
+  struct ReadableAwaiter {
+    CoroWatch &w;
+    bool await_ready() const noexcept { return w.readable; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { w.reader = h; }
+    void await_resume() noexcept { }
+  };
+
+  struct WritableAwaiter {
+    CoroWatch &w;
+    bool await_ready() const noexcept { return w.writable; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { w.writer = h; }
+    void await_resume() noexcept { }
+  };
+
+  // resumes once either fd is readable, like a poll on both; the
+  // result is the one that is (a if both are)
+  struct EitherAwaiter {
+    CoroWatch &a;
+    CoroWatch &b;
+    bool await_ready() const noexcept { return a.readable || b.readable; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { a.reader = b.reader = h; }
+    CoroWatch &await_resume() noexcept {
+      a.reader = b.reader = nullptr;
+      return a.readable ? a : b;
+    }
+  };
+
+  // goes to the back of the line: resumes once every coroutine that
+  // is ready to run now has had a turn. A coroutine whose I/O never
+  // has to wait never suspends otherwise, so a busy client's would
+  // keep the loop to itself.
+  struct YieldAwaiter {
+    CoroLoop &loop;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { loop.m_ready.push_back(h); }
+    void await_resume() noexcept { }
+  };
+
+  YieldAwaiter yield() { return YieldAwaiter{ *this }; }
+
+  static ReadableAwaiter readable(CoroWatch &w) { return ReadableAwaiter{ w }; }
+  static WritableAwaiter writable(CoroWatch &w) { return WritableAwaiter{ w }; }
+  static EitherAwaiter either_readable(CoroWatch &a, CoroWatch &b) {
+    return EitherAwaiter{ a, b };
+  }
+
+private:
+  friend struct CoroWatch;
+
+  // prohibit value semantics
+  CoroLoop(const CoroLoop &);
+  CoroLoop &operator=(const CoroLoop &);
+
+  void add(CoroWatch *w);
+  void remove(CoroWatch *w);
+
+  int m_epfd;
+  uint32_t m_next_gen;
+  std::vector<CoroWatch *> m_watches; // by fd
+  std::vector<std::coroutine_handle<> > m_ready; // yielded, to resume
+  std::vector<std::coroutine_handle<> > m_running; // the round being resumed
+};
+
+#endif // CORO_H
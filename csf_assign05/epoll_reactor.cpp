@@ -0,0 +1,340 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "csapp.h"
+#include "user.h"
+#include "metrics.h"
+#include "epoll_reactor.h"
+
+namespace {
+
+const int MAX_EVENTS = 256;
+
+void fatal(const char *msg) {
+    unix_error(const_cast<char *>(msg));
+}
+
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fatal("fcntl error");
+    }
+}
+
+} // anonymous namespace
+
+////////////////////////////////////////////////////////////////////////
+// Per-connection state
+////////////////////////////////////////////////////////////////////////
+
+// Each connection has up to two epoll registrations, its socket and
+// (for receivers) its queue's eventfd; the epoll data points at one
+// of these so we know which of the two woke us up. Listening sockets
+// have one without a connection.
+struct EpollReactor::Watch {
+  EConn *conn;
+  bool is_queue;
+  int listenfd;
+};
+
+struct EpollReactor::EConn : Conn {
+  Watch sock_watch;
+  Watch queue_watch;
+  bool want_write;   // EPOLLOUT is registered on the socket
+  bool queue_armed;  // taking deliveries: EPOLLIN is registered on the
+                     // queue eventfd (edge-triggered while not, to
+                     // hear about an overflow)
+
+  EConn(int fd)
+    : Conn(fd), want_write(false), queue_armed(false) {
+    sock_watch.conn = this;
+    sock_watch.is_queue = false;
+    sock_watch.listenfd = -1;
+    queue_watch.conn = this;
+    queue_watch.is_queue = true;
+    queue_watch.listenfd = -1;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////
+// EpollReactor member functions
+////////////////////////////////////////////////////////////////////////
+
+EpollReactor::EpollReactor(Server *server, int listenfd)
+    : Reactor(server, listenfd), m_epfd(-1), m_iov(m_max_iov) {
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0) {
+        fatal("epoll_create1 error");
+    }
+
+    // the inbound eventfd is told apart by its data pointer
+    epoll_event iev{};
+    iev.events = EPOLLIN;
+    iev.data.ptr = &m_inbound_fd;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_inbound_fd, &iev) < 0) {
+        fatal("epoll_ctl error");
+    }
+}
+
+EpollReactor::~EpollReactor() {
+    close_all_conns();
+    free_dead_conns();
+    ::close(m_epfd);
+}
+
+void EpollReactor::event_loop() {
+    epoll_event events[MAX_EVENTS];
+
+    // all listeners are known by now
+    m_listen_watches.resize(m_listenfds.size());
+    for (size_t i = 0; i < m_listenfds.size(); i++) {
+        set_nonblocking(m_listenfds[i]);
+        m_listen_watches[i].conn = nullptr;
+        m_listen_watches[i].is_queue = false;
+        m_listen_watches[i].listenfd = m_listenfds[i];
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &m_listen_watches[i];
+        if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_listenfds[i], &ev) < 0) {
+            fatal("epoll_ctl error");
+        }
+    }
+
+    for (;;) {
+        int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fatal("epoll_wait error");
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &m_inbound_fd) {
+                drain_inbound();
+                continue;
+            }
+
+            Watch *watch = static_cast<Watch *>(events[i].data.ptr);
+            if (!watch->conn) {
+                accept_clients(watch->listenfd);
+                continue;
+            }
+
+            // an earlier event in this batch may have closed it
+            EConn *conn = watch->conn;
+            if (conn->dead) {
+                continue;
+            }
+
+            if (watch->is_queue) {
+                if (conn->queue_armed) {
+                    // the receiver's queue went non-empty
+                    deliver(conn);
+                } else if (conn->receiver.user->mqueue->is_overflowed()) {
+                    // not taking deliveries (e.g. stalled on output),
+                    // but it got too far behind meanwhile
+                    close_conn(conn);
+                }
+                continue;
+            }
+
+            uint32_t what = events[i].events;
+            if (conn->state == Conn::RECEIVER &&
+                (what & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                // receiver hung up, drop it now rather than finding
+                // out when the next delivery fails
+                close_conn(conn);
+                continue;
+            }
+            if (what & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                handle_readable(conn);
+            }
+            if (!conn->dead && (what & EPOLLOUT)) {
+                handle_writable(conn);
+            }
+        }
+
+        free_dead_conns();
+    }
+}
+
+void EpollReactor::accept_clients(int listenfd) {
+    for (;;) {
+        int fd = accept4(listenfd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            // EAGAIN means we've drained the backlog; anything else
+            // (e.g. out of fds) we just try again on the next event
+            return;
+        }
+
+        // we batch our own writes, don't let Nagle delay a lone one
+        // (fails harmlessly on a UNIX socket)
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        EConn *conn = new EConn(fd);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = &conn->sock_watch;
+        if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            ::close(fd);
+            delete conn;
+            continue;
+        }
+
+        add_conn(conn);
+    }
+}
+
+void EpollReactor::handle_readable(EConn *conn) {
+    char buf[4096];
+    bool gone = false;
+
+    // level-triggered, so cap how much one client can feed us per
+    // wakeup; anything left will be reported again
+    while (conn->in.size() < OUTPUT_HIGH_WATER) {
+        ssize_t n = read(conn->fd, buf, sizeof(buf));
+        if (n > 0) {
+            conn->in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        // EOF or a real error: the client is gone, but still act on
+        // whatever complete requests it sent before leaving
+        gone = true;
+        break;
+    }
+
+    handle_input(conn);
+    if (conn->dead) {
+        return;
+    }
+
+    if (gone) {
+        close_conn(conn);
+        return;
+    }
+
+    flush(conn);
+}
+
+void EpollReactor::handle_writable(EConn *conn) {
+    // once this drains, flush re-arms the queue eventfd and we get
+    // woken up again for whatever is still queued
+    flush(conn);
+}
+
+void EpollReactor::flush(Conn *c) {
+    EConn *conn = static_cast<EConn *>(c);
+
+    // a replaying receiver keeps going until the socket (or ring) is
+    // full, the rest of the log goes out once there's room again
+    do {
+        while (!conn->out.empty()) {
+            if (conn->output_via_shm()) {
+                // anything that doesn't fit waits for the receiver's
+                // doorbell, which shows up as the socket being readable
+                write_shm(conn);
+                if (!conn->out.empty()) {
+                    update_interest(conn);
+                    return;
+                }
+                break;
+            }
+
+            // gather up to a batch of frames into one writev
+            size_t count = gather_output(conn, m_iov.data(), m_iov.size());
+
+            uint64_t start = Metrics::now();
+            ssize_t n = writev(conn->fd, m_iov.data(), count);
+            Metrics::record_since(Metrics::SEND_TIME, start);
+            if (n > 0) {
+                retire_output(conn, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // socket buffer full, finish when it becomes writable
+                update_interest(conn);
+                return;
+            }
+
+            // sending failed → client gone
+            close_conn(conn);
+            return;
+        }
+    } while (top_up_replay(conn));
+
+    update_interest(conn);
+
+    if (conn->state == Conn::CLOSING) {
+        close_conn(conn);
+    }
+}
+
+void EpollReactor::watch_queue(Conn *c) {
+    EConn *conn = static_cast<EConn *>(c);
+
+    // not taking deliveries until the join succeeds, but every signal
+    // still gets to us, so an overflow is never missed
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &conn->queue_watch;
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, conn->receiver.user->mqueue->get_notify_fd(), &ev);
+}
+
+void EpollReactor::update_interest(EConn *conn) {
+    // socket: always readable (requests, hangups, doorbells),
+    // writable only while output for it is backed up
+    bool want_write = conn->pending_output() > 0 && !conn->output_via_shm();
+    if (want_write != conn->want_write) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+        ev.data.ptr = &conn->sock_watch;
+        epoll_ctl(m_epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->want_write = want_write;
+    }
+
+    // queue: only take deliveries while there is room for them, a slow
+    // (or still replaying) receiver's backlog stays in its queue in the
+    // meantime; edge-triggered, only the queue's signals (one when it
+    // goes non-empty, one when it overflows) get through then
+    bool queue_armed = conn->state == Conn::RECEIVER && !conn->replaying() &&
+                       conn->pending_output() < OUTPUT_HIGH_WATER;
+    if (queue_armed != conn->queue_armed) {
+        epoll_event ev{};
+        ev.events = queue_armed ? EPOLLIN : EPOLLIN | EPOLLET;
+        ev.data.ptr = &conn->queue_watch;
+        epoll_ctl(m_epfd, EPOLL_CTL_MOD,
+                  conn->receiver.user->mqueue->get_notify_fd(), &ev);
+        conn->queue_armed = queue_armed;
+    }
+}
+
+void EpollReactor::release_conn(Conn *conn) {
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    ::close(conn->fd);
+    if (conn->receiver.user) {
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL,
+                  conn->receiver.user->mqueue->get_notify_fd(), nullptr);
+    }
+    m_dead.push_back(conn);
+}
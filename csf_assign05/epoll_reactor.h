@@ -0,0 +1,38 @@
+#ifndef EPOLL_REACTOR_H
+#define EPOLL_REACTOR_H
+
+#include <vector>
+#include <sys/uio.h>
+#include "reactor.h"
+
+// The epoll flavor of the reactor. Sockets are non-blocking and
+// registered level-triggered: readable always, writable only while
+// output is backed up (on the socket, not in a receiver's ring). A
+// receiver's queue eventfd is registered too, with EPOLLIN only while
+// there is room to take more deliveries.
+class EpollReactor : public Reactor {
+public:
+  EpollReactor(Server *server, int listenfd);
+  ~EpollReactor() override;
+
+protected:
+  void event_loop() override;
+  void flush(Conn *conn) override;
+  void watch_queue(Conn *conn) override;
+  void release_conn(Conn *conn) override;
+
+private:
+  struct EConn;  // Conn plus its epoll registrations
+  struct Watch;  // what an epoll registration refers to
+
+  void accept_clients(int listenfd);
+  void handle_readable(EConn *conn);
+  void handle_writable(EConn *conn);
+  void update_interest(EConn *conn);
+
+  int m_epfd;
+  std::vector<Watch> m_listen_watches; // set up when the loop starts
+  std::vector<iovec> m_iov; // scratch space for flush's writev
+};
+
+#endif // EPOLL_REACTOR_H
@@ -0,0 +1,55 @@
+#include <cstring>
+#include <new>
+#include "message.h"
+#include "pool.h"
+#include "frame.h"
+
+Frame *Frame::alloc(std::string_view tag, size_t data_len) {
+    size_t size = tag.size() + 1 + data_len + 1;
+
+    // header and encoded bytes share one block from the pool
+    void *mem = Pool::alloc(sizeof(Frame) + WIRE_BINARY_HEADER_LEN + size);
+    Frame *frame = new (mem) Frame(size, data_len);
+
+    // everything but the data itself, which the caller fills in
+    char *p = frame->bytes();
+    wire_put_header(p, wire_tag_code(tag), data_len);
+    p += WIRE_BINARY_HEADER_LEN;
+    memcpy(p, tag.data(), tag.size());
+    p[tag.size()] = ':';
+    p[size - 1] = '\n';
+
+    return frame;
+}
+
+void Frame::destroy() {
+    size_t total = sizeof(Frame) + WIRE_BINARY_HEADER_LEN + m_size;
+    this->~Frame();
+    Pool::free(this, total);
+}
+
+Frame *Frame::create(std::string_view tag, std::string_view data) {
+    Frame *frame = alloc(tag, data.size());
+    memcpy(frame->bytes() + WIRE_BINARY_HEADER_LEN + tag.size() + 1,
+           data.data(), data.size());
+    return frame;
+}
+
+Frame *Frame::create_delivery(std::string_view room,
+                              std::string_view sender,
+                              std::string_view text) {
+    Frame *frame = alloc(TAG_DELIVERY, room.size() + 1 + sender.size() + 1 +
+                                       text.size());
+
+    // sizeof counts the NUL, which is where the ':' went
+    char *p = frame->bytes() + WIRE_BINARY_HEADER_LEN + sizeof(TAG_DELIVERY);
+    memcpy(p, room.data(), room.size());
+    p += room.size();
+    *p++ = ':';
+    memcpy(p, sender.data(), sender.size());
+    p += sender.size();
+    *p++ = ':';
+    memcpy(p, text.data(), text.size());
+
+    return frame;
+}
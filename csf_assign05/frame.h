@@ -0,0 +1,97 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <atomic>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+#include "wire.h"
+#include "metrics.h"
+
+// An immutable, fully encoded wire frame with an atomic reference
+// count. A broadcast encodes its delivery exactly once and every
+// member's MessageQueue holds a reference to the same Frame;
+// receivers write the bytes straight out of it and drop their
+// reference afterwards. The encoded bytes live in the same (pool)
+// block as the Frame itself, laid out as
+//
+//     binary header | tag | ':' | data | '\n'
+//
+// so the text encoding is everything after the binary header and the
+// binary encoding is the header plus the data. Receivers in either
+// wire format share the same frame.
+class Frame {
+public:
+  // Create a frame holding one reference (owned by the caller)
+  static Frame *create(std::string_view tag, std::string_view data);
+
+  // Create a "delivery:room:sender:text" frame
+  static Frame *create_delivery(std::string_view room,
+                                std::string_view sender,
+                                std::string_view text);
+
+  void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+
+  // drop a reference, the last one frees the frame
+  void unref() {
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      destroy();
+    }
+  }
+
+  // the text encoding ("tag:data\n")
+  const char *data() const { return bytes() + WIRE_BINARY_HEADER_LEN; }
+  size_t size() const { return m_size; }
+
+  // Metrics::now() when the frame was made
+  uint64_t created() const { return m_created; }
+
+  size_t wire_size(WireFormat format) const {
+    return format == WIRE_BINARY ? WIRE_BINARY_HEADER_LEN + m_data_len : m_size;
+  }
+
+  // Point iov at the frame's encoding in the given format, skipping
+  // the first offset bytes. The binary header and the data aren't
+  // adjacent, so this can take two iovecs; returns how many it used.
+  int wire_iov(WireFormat format, size_t offset, iovec *iov) const {
+    if (format == WIRE_TEXT) {
+      iov[0].iov_base = const_cast<char *>(data() + offset);
+      iov[0].iov_len = m_size - offset;
+      return 1;
+    }
+
+    const char *payload = data() + m_size - 1 - m_data_len;
+    if (offset >= WIRE_BINARY_HEADER_LEN) {
+      offset -= WIRE_BINARY_HEADER_LEN;
+      iov[0].iov_base = const_cast<char *>(payload + offset);
+      iov[0].iov_len = m_data_len - offset;
+      return 1;
+    }
+    iov[0].iov_base = const_cast<char *>(bytes() + offset);
+    iov[0].iov_len = WIRE_BINARY_HEADER_LEN - offset;
+    iov[1].iov_base = const_cast<char *>(payload);
+    iov[1].iov_len = m_data_len;
+    return 2;
+  }
+
+private:
+  // only create/destroy make and free frames
+  Frame(size_t size, size_t data_len)
+    : m_refs(1), m_size(size), m_data_len(data_len),
+      m_created(Metrics::now()) { }
+  Frame(const Frame &);
+  Frame &operator=(const Frame &);
+
+  static Frame *alloc(std::string_view tag, size_t data_len);
+  const char *bytes() const { return reinterpret_cast<const char *>(this + 1); }
+  char *bytes() { return reinterpret_cast<char *>(this + 1); }
+  void destroy();
+
+  std::atomic<int> m_refs;
+  size_t m_size;     // text encoding
+  size_t m_data_len; // data part only
+  uint64_t m_created;
+};
+
+#endif // FRAME_H
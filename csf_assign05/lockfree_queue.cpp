@@ -0,0 +1,146 @@
+#include "frame.h"
+#include "metrics.h"
+#include "lockfree_queue.h"
+
+LockFreeMessageQueue::LockFreeMessageQueue(QueueControl *control)
+    : MessageQueue(control), m_size(0), m_count(0), m_bytes(0) {
+    // the list always holds at least one node, starting with a stub
+    Node *stub = new Node;
+    stub->next.store(nullptr, std::memory_order_relaxed);
+    stub->frame = nullptr;
+    m_head.store(stub, std::memory_order_relaxed);
+    m_tail = stub;
+}
+
+LockFreeMessageQueue::~LockFreeMessageQueue() {
+    // no producers can be left by now
+    drop_all();
+    delete m_tail;
+}
+
+void LockFreeMessageQueue::drop_all() {
+    // consumer side: free every node linked in so far, leaving the
+    // last one as the stub
+    while (Node *next = m_tail->next.load(std::memory_order_acquire)) {
+        Frame *frame = next->frame;
+        next->frame = nullptr;
+        delete m_tail;
+        m_tail = next;
+        if (m_control) {
+            release(frame->size());
+        }
+        m_size.fetch_sub(1, std::memory_order_seq_cst);
+        frame->unref();
+    }
+}
+
+bool LockFreeMessageQueue::reserve(size_t bytes) {
+    // optimistically claim the space, give it back if that went over
+    size_t count = m_count.fetch_add(1, std::memory_order_relaxed) + 1;
+    size_t total = m_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    size_t global =
+        m_control->queued_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+    if ((m_control->max_messages != 0 && count > m_control->max_messages) ||
+        (m_control->max_bytes != 0 && total > m_control->max_bytes) ||
+        (m_control->memory_budget != 0 && global > m_control->memory_budget)) {
+        release(bytes);
+        return false;
+    }
+    return true;
+}
+
+void LockFreeMessageQueue::release(size_t bytes) {
+    m_count.fetch_sub(1, std::memory_order_relaxed);
+    m_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    m_control->queued_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void LockFreeMessageQueue::enqueue(Frame *frame) {
+    if (m_control) {
+        if (is_overflowed()) {
+            frame->unref();  // receiver is on its way out anyway
+            return;
+        }
+
+        if (!reserve(frame->size())) {
+            frame->unref();
+            if (m_control->policy == QueueControl::DISCONNECT) {
+                // only the consumer can free what's queued, it does on
+                // its next dequeue
+                mark_overflowed();
+            } else {
+                m_control->dropped_newest.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+
+        // another producer may have overflowed it meanwhile
+        if (is_overflowed()) {
+            release(frame->size());
+            frame->unref();
+            return;
+        }
+    }
+
+    Node *node = new Node;
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node->frame = frame;
+
+    // count first, so m_size is never less than what the consumer
+    // can see (and never goes negative)
+    bool was_empty = m_size.fetch_add(1, std::memory_order_seq_cst) == 0;
+
+    // link in: between the exchange and the store the consumer just
+    // sees the list end early, and picks the node up on its next try
+    Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+    Metrics::count(Metrics::ENQUEUED);
+
+    if (was_empty) {
+        signal_nonempty();
+    }
+}
+
+Frame *LockFreeMessageQueue::dequeue() {
+    if (m_control && is_overflowed()) {
+        // the receiver is being dropped: nothing more goes out, and
+        // the eventfd stays signaled until it's gone
+        drop_all();
+        return nullptr;
+    }
+
+    Node *tail = m_tail;
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (!next) {
+        return nullptr; // empty, or a producer is mid-enqueue
+    }
+
+    // next becomes the new stub once its frame is taken out
+    Frame *frame = next->frame;
+    next->frame = nullptr;
+    m_tail = next;
+    delete tail;
+
+    if (m_control) {
+        release(frame->size());
+    }
+
+    if (m_size.fetch_sub(1, std::memory_order_seq_cst) == 1) {
+        // went empty: reset the eventfd, then make sure no producer
+        // signaled in between (for a frame, or an overflow) only to
+        // have its signal eaten
+        clear_nonempty();
+        if (m_size.load(std::memory_order_seq_cst) > 0 || is_overflowed()) {
+            signal_nonempty();
+        }
+    }
+
+    Metrics::count(Metrics::DEQUEUED);
+    Metrics::record_since(Metrics::QUEUE_DELAY, frame->created());
+    return frame;
+}
+
+bool LockFreeMessageQueue::empty() const {
+    return m_size.load(std::memory_order_seq_cst) == 0;
+}
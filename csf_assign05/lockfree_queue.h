@@ -0,0 +1,62 @@
+#ifndef LOCKFREE_QUEUE_H
+#define LOCKFREE_QUEUE_H
+
+#include <atomic>
+#include "message_queue.h"
+
+// Lock-free multi-producer/single-consumer MessageQueue: a Vyukov
+// style linked list where producers append with a single atomic
+// exchange and the consumer pops from the other end without touching
+// anything the producers write to, so broadcasting senders never
+// contend with the receiver (or wait on each other for a lock).
+//
+// Parking: m_size counts enqueued frames. The producer that takes it
+// from 0 to 1 signals the eventfd; the consumer that takes it back to
+// 0 resets the eventfd and then re-checks m_size, re-signaling if a
+// producer slipped in meanwhile, so a wakeup is never lost. Producers
+// only make a syscall on the empty -> non-empty transition.
+//
+// Limits are enforced by reserving room in m_count/m_bytes before
+// linking a node in (and backing out on failure). Producers can't
+// remove other messages from the list, so DROP_OLDEST is not
+// supported here and behaves like DROP_NEWEST. For the same reason an
+// overflow under DISCONNECT only marks the queue (refusing every
+// enqueue after that): the consumer's next dequeue frees what's queued
+// and returns nothing, and the eventfd stays signaled from then on.
+class LockFreeMessageQueue : public MessageQueue {
+public:
+  LockFreeMessageQueue(QueueControl *control);
+  ~LockFreeMessageQueue() override;
+
+  void enqueue(Frame *frame) override;
+  Frame *dequeue() override;
+  bool empty() const override;
+
+private:
+  bool reserve(size_t bytes);
+  void release(size_t bytes);
+  void drop_all();
+
+  struct Node : PoolAllocated {
+    std::atomic<Node *> next;
+    Frame *frame;
+  };
+
+  // producers swap themselves in at m_head; the consumer owns m_tail,
+  // which always points at an already consumed (or stub) node. The
+  // padding keeps the three on separate cache lines (padding rather
+  // than alignas, since queues come from the pool, which doesn't hand
+  // out over-aligned blocks).
+  std::atomic<Node *> m_head;
+  char m_pad1[64];
+  std::atomic<long> m_size;
+  char m_pad2[64];
+  Node *m_tail;
+  char m_pad3[64];
+
+  // only used when there are limits to enforce
+  std::atomic<size_t> m_count;
+  std::atomic<size_t> m_bytes;
+};
+
+#endif // LOCKFREE_QUEUE_H
@@ -3,6 +3,8 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
+#include "wire.h"
 
 struct Message {
   // An encoded message may have at most this many characters,
@@ -11,6 +13,12 @@ struct Message {
   // temporarily store the encoded message.)
   static const unsigned MAX_LEN = 255;
 
+  // Longest encoded binary frame the server and Connection will
+  // accept. Text lines are still held to MAX_LEN (a delivery longer
+  // than that never goes to a text receiver); binary framing is how
+  // longer messages get through.
+  static const unsigned MAX_FRAME_LEN = 64 * 1024;
+
   std::string tag;
   std::string data;
 
@@ -22,6 +30,17 @@ struct Message {
   // TODO: you could add helper functions
 };
 
+// A message parsed in place: tag and data point straight into the
+// buffer it was received into, so they are only valid until the
+// next receive from the same place.
+// code is the tag as a TagCode (wire.h), worked out while parsing, so
+// handlers can switch on it instead of comparing strings.
+struct MessageView {
+  std::string_view tag;
+  std::string_view data;
+  TagCode code = TAG_CODE_NONE; // not a standard tag
+};
+
 // standard message tags (note that you don't need to worry about
 // "senduser" or "empty" messages)
 #define TAG_ERR       "err"       // protocol error
@@ -35,5 +54,6 @@ struct Message {
 #define TAG_QUIT      "quit"      // quit
 #define TAG_DELIVERY  "delivery"  // message delivered by server to receiving client
 #define TAG_EMPTY     "empty"     // sent by server to receiving client to indicate no msgs available
+#define TAG_PEER      "peer"      // opens a link between two cluster servers
 
 #endif // MESSAGE_H
@@ -1,51 +1,203 @@
-#include <ctime>
 #include <cassert>
+#include <cstdint>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include "guard.h"
+#include "frame.h"
+#include "metrics.h"
+#include "lockfree_queue.h"
 #include "message_queue.h"
 
-MessageQueue::MessageQueue() {
-    // initialize semaphore (0 initial count) and mutex
-    int r1 = pthread_mutex_init(&m_lock, nullptr);
-    int r2 = sem_init(&m_avail, 0, 0);
-    assert(r1 == 0 && r2 == 0);
+////////////////////////////////////////////////////////////////////////
+// MessageQueue (common part)
+////////////////////////////////////////////////////////////////////////
+
+MessageQueue *MessageQueue::create(Kind kind, QueueControl *control) {
+    if (kind == LOCK_FREE) {
+        return new LockFreeMessageQueue(control);
+    }
+    return new LockedMessageQueue(control);
+}
+
+MessageQueue::MessageQueue(QueueControl *control)
+    : m_control(control), m_overflowed(false) {
+    // the eventfd starts out unsignaled (queue is empty)
+    m_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(m_notify_fd >= 0);
 }
 
 MessageQueue::~MessageQueue() {
+    close(m_notify_fd);
+}
+
+void MessageQueue::signal_nonempty() {
+    uint64_t one = 1;
+    ssize_t rc = write(m_notify_fd, &one, sizeof(one));
+    (void) rc; // can only fail if the counter overflows
+}
+
+void MessageQueue::clear_nonempty() {
+    uint64_t count;
+    ssize_t rc = read(m_notify_fd, &count, sizeof(count));
+    (void) rc; // EAGAIN just means it was already clear
+}
+
+bool MessageQueue::mark_overflowed() {
+    if (m_overflowed.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+    }
+
+    m_control->disconnects.fetch_add(1, std::memory_order_relaxed);
+
+    // the consumer has to wake up to notice, even if it thinks the
+    // queue is empty (nothing resets this once we've overflowed)
+    signal_nonempty();
+    return true;
+}
+
+Task<Frame *> MessageQueue::async_dequeue(CoroWatch &notify, CoroWatch &interrupt) {
+    for (;;) {
+        // the client goes first, like POLLIN in the threaded mode, so
+        // a steady stream of deliveries can't hold up its requests
+        if (interrupt.readable) {
+            co_return nullptr;
+        }
+
+        // an enqueue that takes the queue from empty to non-empty
+        // signals the eventfd afresh, so clearing the flag first can't
+        // lose that wakeup
+        notify.readable = false;
+        Frame *frame = dequeue();
+        if (frame || is_overflowed()) {
+            co_return frame;
+        }
+        if (!empty()) {
+            // a producer is still linking its frame in (lock-free
+            // queue). It won't signal, and neither will anyone after
+            // it, since the queue wasn't empty for them: come back for
+            // it after the loop's other coroutines had a turn.
+            co_await notify.loop->yield();
+            continue;
+        }
+        co_await CoroLoop::either_readable(notify, interrupt);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// LockedMessageQueue
+////////////////////////////////////////////////////////////////////////
+
+LockedMessageQueue::LockedMessageQueue(QueueControl *control)
+    : MessageQueue(control), m_bytes(0) {
+    int rc = pthread_mutex_init(&m_lock, nullptr);
+    assert(rc == 0);
+    (void) rc;
+}
+
+LockedMessageQueue::~LockedMessageQueue() {
+    // anything never delivered is ours to free
+    drop_all();
+
     // cleanup synchronization primitives
     pthread_mutex_destroy(&m_lock);
-    sem_destroy(&m_avail);
 }
 
-void MessageQueue::enqueue(Message *msg) {
-    // critical section: modify queue
-    {
-        Guard lock_guard(m_lock);
-        m_messages.push_back(msg);
+bool LockedMessageQueue::over_limit(size_t bytes) const {
+    return (m_control->max_messages != 0 &&
+            m_messages.size() + 1 > m_control->max_messages) ||
+           (m_control->max_bytes != 0 &&
+            m_bytes + bytes > m_control->max_bytes) ||
+           m_control->over_budget(bytes);
+}
+
+void LockedMessageQueue::drop_all() {
+    for (Frame *frame : m_messages) {
+        frame->unref();
     }
+    m_messages.clear();
 
-    // one more message available → wake waiting consumers
-    sem_post(&m_avail);
+    if (m_control) {
+        m_control->queued_bytes.fetch_sub(m_bytes, std::memory_order_relaxed);
+    }
+    m_bytes = 0;
 }
 
-Message *MessageQueue::dequeue() {
-    // compute timeout = now + 1 second
-    timespec timeout_spec{};
-    clock_gettime(CLOCK_REALTIME, &timeout_spec);
-    timeout_spec.tv_sec += 1;
+void LockedMessageQueue::enqueue(Frame *frame) {
+    size_t bytes = frame->size();
+
+    // critical section: modify queue
+    Guard lock_guard(m_lock);
+
+    if (m_control) {
+        if (is_overflowed()) {
+            frame->unref();  // receiver is on its way out anyway
+            return;
+        }
+
+        while (over_limit(bytes)) {
+            if (m_control->policy == QueueControl::DROP_OLDEST &&
+                !m_messages.empty()) {
+                // make room at the front and try again
+                Frame *oldest = m_messages.front();
+                m_messages.pop_front();
+                m_bytes -= oldest->size();
+                m_control->queued_bytes.fetch_sub(oldest->size(),
+                                                  std::memory_order_relaxed);
+                m_control->dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+                oldest->unref();
+                continue;
+            }
 
-    // wait up to 1 second for an available message
-    if (sem_timedwait(&m_avail, &timeout_spec) != 0) {
-        return nullptr;   // nothing ready
+            frame->unref();
+            if (m_control->policy == QueueControl::DISCONNECT) {
+                drop_all();
+                mark_overflowed();
+            } else {
+                // DROP_NEWEST (or DROP_OLDEST with nothing left of
+                // ours to drop, i.e. the global budget is used up)
+                m_control->dropped_newest.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+
+        m_control->queued_bytes.fetch_add(bytes, std::memory_order_relaxed);
     }
 
+    m_messages.push_back(frame);
+    m_bytes += bytes;
+    Metrics::count(Metrics::ENQUEUED);
+
+    // empty → non-empty: wake whoever is polling the eventfd
+    if (m_messages.size() == 1) {
+        signal_nonempty();
+    }
+}
+
+bool LockedMessageQueue::empty() const {
+    Guard lock_guard(m_lock);
+    return m_messages.empty();
+}
+
+Frame *LockedMessageQueue::dequeue() {
     // remove next message (protected by mutex)
     Guard lock_guard(m_lock);
     if (m_messages.empty()) {
         return nullptr;
     }
 
-    Message *next = m_messages.front();
+    Frame *next = m_messages.front();
     m_messages.pop_front();
+    m_bytes -= next->size();
+    if (m_control) {
+        m_control->queued_bytes.fetch_sub(next->size(), std::memory_order_relaxed);
+    }
+
+    // non-empty → empty: reset the eventfd so pollers go back to sleep
+    if (m_messages.empty()) {
+        clear_nonempty();
+    }
+
+    Metrics::count(Metrics::DEQUEUED);
+    Metrics::record_since(Metrics::QUEUE_DELAY, next->created());
     return next;
 }
-
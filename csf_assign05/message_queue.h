@@ -1,33 +1,139 @@
 #ifndef MESSAGE_QUEUE_H
 #define MESSAGE_QUEUE_H
 
+#include <atomic>
 #include <deque>
+#include "pool.h"
+#include "coro.h"
+#include <cstddef>
 #include <pthread.h>
-#include <semaphore.h>
-struct Message;
+class Frame;
 
-// This data type represents a queue of Messages waiting to
-// be delivered to a receiver
-class MessageQueue {
+// Limits applied to every receiver queue, plus the server-wide memory
+// budget and the counters shared by all of them. Byte counts are the
+// encoded size of each queued frame (a frame shared by N queues
+// counts N times, since each receiver still has to be sent it).
+struct QueueControl {
+  // what to do with a message that doesn't fit
+  enum Policy {
+    DROP_OLDEST, // make room by dropping the oldest queued messages
+    DROP_NEWEST, // drop the message being enqueued
+    DISCONNECT,  // drop everything and disconnect the receiver
+  };
+
+  size_t max_messages;  // per queue, 0 = no limit
+  size_t max_bytes;     // per queue, 0 = no limit
+  size_t memory_budget; // all queues together, 0 = no limit
+  Policy policy;
+
+  std::atomic<size_t> queued_bytes;  // currently queued, all queues
+  std::atomic<unsigned long> dropped_oldest;
+  std::atomic<unsigned long> dropped_newest;
+  std::atomic<unsigned long> disconnects;
+
+  QueueControl()
+    : max_messages(0), max_bytes(0), memory_budget(0), policy(DROP_NEWEST),
+      queued_bytes(0), dropped_oldest(0), dropped_newest(0), disconnects(0) { }
+
+  bool over_budget(size_t bytes) const {
+    return memory_budget != 0 &&
+           queued_bytes.load(std::memory_order_relaxed) + bytes > memory_budget;
+  }
+};
+
+// This data type represents a queue of (encoded) messages waiting
+// to be delivered to a receiver. Frames are refcounted: enqueue takes
+// over one reference from the caller, and whoever dequeues a frame
+// owns that reference and must unref it once it's been sent.
+//
+// Any number of threads may enqueue; only one thread (the receiver's)
+// may dequeue. There are two implementations, picked at startup: the
+// mutex-protected deque (LockedMessageQueue) and a lock-free linked
+// list (LockFreeMessageQueue, see lockfree_queue.h).
+//
+// With a QueueControl, enqueue enforces its limits. Under the
+// DISCONNECT policy an overflowing queue frees its contents, refuses
+// anything further and wakes the consumer, which should check
+// is_overflowed() and drop the client.
+class MessageQueue : public PoolAllocated {
 public:
-  MessageQueue();
-  ~MessageQueue();
+  enum Kind {
+    LOCKED,
+    LOCK_FREE,
+  };
+
+  // control may be null for an unbounded queue
+  static MessageQueue *create(Kind kind, QueueControl *control = nullptr);
+
+  virtual ~MessageQueue();
+
+  virtual void enqueue(Frame *frame) = 0; // will not block
+  virtual Frame *dequeue() = 0;           // will not block, nullptr if empty
+
+  // true if nothing has been enqueued that hasn't been dequeued; a
+  // dequeue can still come back empty while this is false (see
+  // get_notify_fd)
+  virtual bool empty() const = 0;
+
+  // Coroutine version for the server's coro mode (coro.h): waits for a
+  // frame instead of returning nullptr. notify must watch this queue's
+  // notify fd on the caller's loop. Returns nullptr once the queue has
+  // overflowed, or when interrupt (another fd on that loop, e.g. the
+  // receiver's socket) turns readable first, so a receiver can wait
+  // for deliveries and requests at once.
+  Task<Frame *> async_dequeue(CoroWatch &notify, CoroWatch &interrupt);
 
-  void enqueue(Message *msg); // will not block
-  Message *dequeue();         // blocks for at most a finite amount of time
+  bool is_overflowed() const { return m_overflowed.load(std::memory_order_acquire); }
+
+  // An eventfd that polls readable while the queue is non-empty (or
+  // has overflowed). Consumers wait on it with poll/epoll instead of
+  // waking up periodically to check, so idle receivers cost nothing.
+  // (It can occasionally be readable with nothing to dequeue yet, so
+  // consumers must tolerate an empty dequeue after a wakeup.)
+  int get_notify_fd() const { return m_notify_fd; }
+
+protected:
+  MessageQueue(QueueControl *control);
+
+  // set/reset the eventfd; implementations call these on the
+  // empty -> non-empty and non-empty -> empty transitions
+  void signal_nonempty();
+  void clear_nonempty();
+
+  // flag the queue as overflowed (DISCONNECT policy) and wake the
+  // consumer; returns false if it already was
+  bool mark_overflowed();
+
+  QueueControl *m_control;
 
 private:
   // value semantics prohibited
   MessageQueue(const MessageQueue &);
   MessageQueue &operator=(const MessageQueue &);
 
-  // these data members are sufficient to implement the
-  // enqueue and dequeue operations: the idea is that the semaphore
-  // keeps a count of how many messages are currently in the queue
+  int m_notify_fd;
+  std::atomic<bool> m_overflowed;
+};
+
+// The original queue: a deque protected by a mutex. The eventfd is
+// signaled and reset under the lock, so its readiness always matches
+// whether messages are waiting.
+class LockedMessageQueue : public MessageQueue {
+public:
+  LockedMessageQueue(QueueControl *control);
+  ~LockedMessageQueue() override;
+
+  void enqueue(Frame *frame) override;
+  Frame *dequeue() override;
+  bool empty() const override;
+
+private:
+  bool over_limit(size_t bytes) const;
+  void drop_all();
 
-  pthread_mutex_t m_lock; // must be held while accessing queue
-  sem_t m_avail;
-  std::deque<Message *> m_messages;
+  mutable pthread_mutex_t m_lock; // must be held while accessing queue
+  std::deque<Frame *, PoolAllocator<Frame *> > m_messages;
+  size_t m_bytes;         // encoded size of everything in m_messages
 };
 
 #endif // MESSAGE_QUEUE_H
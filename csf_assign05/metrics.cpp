@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <vector>
+#include <pthread.h>
+#include "guard.h"
+#include "metrics.h"
+
+// the build doesn't optimize, so whatever runs per event is forced
+// inline to stay down to a handful of instructions
+#define HOT inline __attribute__((always_inline))
+
+namespace {
+
+// values below this get a bucket each
+const uint64_t LINEAR = 32;
+
+// buckets per power of two above that
+const unsigned SUB_BITS = 4;
+const uint64_t SUB = 1 << SUB_BITS;
+
+// anything from 2^(MAX_EXP+1) ticks up (minutes) lands in the last bucket
+const unsigned MAX_EXP = 40;
+const uint64_t MAX_VALUE = (uint64_t(1) << (MAX_EXP + 1)) - 1;
+
+// LINEAR is 2^(SUB_BITS+1), so the first split power of two is 2^5
+const size_t NUM_BUCKETS = LINEAR + (MAX_EXP - SUB_BITS) * SUB;
+
+HOT size_t bucket_index(uint64_t v) {
+    if (v < LINEAR) {
+        return v;
+    }
+    if (v > MAX_VALUE) {
+        v = MAX_VALUE;
+    }
+    unsigned e = 63 - __builtin_clzll(v);
+    return LINEAR + (e - SUB_BITS - 1) * SUB + ((v >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+// largest value that lands in bucket i
+uint64_t bucket_high(size_t i) {
+    if (i < LINEAR) {
+        return i;
+    }
+    size_t k = i - LINEAR;
+    unsigned e = SUB_BITS + 1 + k / SUB;
+    return ((SUB + k % SUB + 1) << (e - SUB_BITS)) - 1;
+}
+
+// Only the owning thread writes these, so an update is a load and a
+// store, no locked instruction. They're accessed atomically just so
+// get_stats can read them while that happens. Builtins rather than
+// std::atomic, whose members would each be a function call without
+// optimization.
+typedef uint64_t Cell;
+
+HOT uint64_t get(const Cell &cell) {
+    return __atomic_load_n(&cell, __ATOMIC_RELAXED);
+}
+
+HOT void set(Cell &cell, uint64_t v) {
+    __atomic_store_n(&cell, v, __ATOMIC_RELAXED);
+}
+
+HOT void bump(Cell &cell, uint64_t n) {
+    set(cell, get(cell) + n);
+}
+
+struct HistogramCells {
+    Cell count;
+    Cell sum;
+    Cell min;
+    Cell max;
+    Cell buckets[NUM_BUCKETS];
+};
+
+struct Cells {
+    Cell counters[Metrics::NUM_COUNTERS];
+    HistogramCells histograms[Metrics::NUM_HISTOGRAMS];
+
+    Cells() {
+        for (Cell &c : counters) {
+            set(c, 0);
+        }
+        for (HistogramCells &h : histograms) {
+            set(h.count, 0);
+            set(h.sum, 0);
+            set(h.min, UINT64_MAX);
+            set(h.max, 0);
+            for (Cell &b : h.buckets) {
+                set(b, 0);
+            }
+        }
+    }
+
+    // add other's numbers to ours (registry_lock held)
+    void add(const Cells &other) {
+        for (size_t i = 0; i < Metrics::NUM_COUNTERS; i++) {
+            bump(counters[i], get(other.counters[i]));
+        }
+        for (size_t i = 0; i < Metrics::NUM_HISTOGRAMS; i++) {
+            HistogramCells &h = histograms[i];
+            const HistogramCells &o = other.histograms[i];
+            bump(h.count, get(o.count));
+            bump(h.sum, get(o.sum));
+            set(h.min, std::min(get(h.min), get(o.min)));
+            set(h.max, std::max(get(h.max), get(o.max)));
+            for (size_t j = 0; j < NUM_BUCKETS; j++) {
+                bump(h.buckets[j], get(o.buckets[j]));
+            }
+        }
+    }
+};
+
+// every live thread's cells, and what exited threads left behind
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<Cells *> registry;
+Cells retired;
+
+struct ThreadCells : Cells {
+    ThreadCells() {
+        Guard g(registry_lock);
+        registry.push_back(this);
+    }
+
+    ~ThreadCells() {
+        Guard g(registry_lock);
+        retired.add(*this);
+        registry.erase(std::find(registry.begin(), registry.end(), this));
+    }
+};
+
+// made on a thread's first event, so threads that never count
+// anything (e.g. the log's sync thread) don't get a set
+thread_local ThreadCells cells;
+
+// ticks and nanoseconds at startup, to work out how long a tick is
+uint64_t start_ticks = Metrics::now();
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t start_ns = monotonic_ns();
+
+const char *const counter_names[Metrics::NUM_COUNTERS] = {
+    "broadcasts", "fanout", "enqueued", "dequeued", "msgs_received",
+    "bytes_received", "frames_sent", "bytes_sent", "conns_opened",
+    "conns_closed", "rate_limited", "relayed_out", "relayed_in",
+    "too_long",
+};
+
+const char *const histogram_names[Metrics::NUM_HISTOGRAMS] = {
+    "broadcast_ns", "queue_delay_ns", "send_ns",
+};
+
+} // anonymous namespace
+
+const char *Metrics::counter_name(Counter c) {
+    return counter_names[c];
+}
+
+const char *Metrics::histogram_name(Histogram h) {
+    return histogram_names[h];
+}
+
+void Metrics::count(Counter c, uint64_t n) {
+    bump(cells.counters[c], n);
+}
+
+void Metrics::record(Histogram h, uint64_t ticks) {
+    HistogramCells &hc = cells.histograms[h];
+    bump(hc.count, 1);
+    bump(hc.sum, ticks);
+    bump(hc.buckets[bucket_index(ticks)], 1);
+    if (ticks < get(hc.min)) {
+        set(hc.min, ticks);
+    }
+    if (ticks > get(hc.max)) {
+        set(hc.max, ticks);
+    }
+}
+
+uint64_t Metrics::HistogramStats::percentile(double p) const {
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(p * count + 0.5));
+    uint64_t seen = 0;
+    for (const std::pair<uint64_t, uint64_t> &b : buckets) {
+        seen += b.second;
+        if (seen >= rank) {
+            return std::min(b.first, max_ns);
+        }
+    }
+    return max_ns;
+}
+
+Metrics::Stats Metrics::get_stats() {
+    // tick length, measured over at least 10ms
+    uint64_t ns = monotonic_ns();
+    if (ns - start_ns < 10000000) {
+        timespec wait = { 0, long(10000000 - (ns - start_ns)) };
+        nanosleep(&wait, nullptr);
+        ns = monotonic_ns();
+    }
+    double ns_per_tick = double(ns - start_ns) / double(now() - start_ticks);
+
+    Cells total;
+    Stats stats;
+    {
+        Guard g(registry_lock);
+        total.add(retired);
+        for (Cells *c : registry) {
+            total.add(*c);
+        }
+        stats.threads = registry.size();
+    }
+
+    stats.uptime_ns = ns - start_ns;
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+        stats.counters[i] = get(total.counters[i]);
+    }
+    for (size_t i = 0; i < NUM_HISTOGRAMS; i++) {
+        const HistogramCells &h = total.histograms[i];
+        HistogramStats &hs = stats.histograms[i];
+        hs.count = get(h.count);
+        hs.sum_ns = uint64_t(get(h.sum) * ns_per_tick);
+        hs.min_ns = hs.count ? uint64_t(get(h.min) * ns_per_tick) : 0;
+        hs.max_ns = uint64_t(get(h.max) * ns_per_tick);
+        for (size_t j = 0; j < NUM_BUCKETS; j++) {
+            uint64_t n = get(h.buckets[j]);
+            if (n > 0) {
+                hs.buckets.emplace_back(uint64_t(bucket_high(j) * ns_per_tick), n);
+            }
+        }
+    }
+    return stats;
+}
@@ -0,0 +1,103 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Event counters and latency histograms for the hot path. Every thread
+// updates a set of its own (no lock, no shared cache line, no atomic
+// read-modify-write), so counting an event is a couple of plain loads
+// and stores; get_stats adds up all the threads' sets when someone
+// asks. A thread that exits folds its numbers into a retired set, so
+// nothing is lost when a client's worker goes away.
+//
+// Latencies are measured in CPU timestamp ticks (rdtsc, no system
+// call) and only turned into nanoseconds in get_stats. Histograms are
+// log-linear, like HdrHistogram: values below 32 ticks get a bucket
+// each, above that every power of two is split into 16 buckets, so a
+// percentile is off by at most 1/16 of its value whatever the scale.
+class Metrics {
+public:
+  enum Counter {
+    BROADCASTS,      // messages broadcast into a room
+    FANOUT,          // receivers those broadcasts were for
+    ENQUEUED,        // deliveries that made it into a queue
+    DEQUEUED,        // deliveries taken out of one
+    MSGS_RECEIVED,   // messages parsed from clients
+    BYTES_RECEIVED,
+    FRAMES_SENT,     // frames written to clients
+    BYTES_SENT,
+    CONNS_OPENED,
+    CONNS_CLOSED,
+    RATE_LIMITED,    // messages refused for going over a rate limit
+    RELAYED_OUT,     // broadcasts forwarded to cluster peers (per peer)
+    RELAYED_IN,      // broadcasts relayed in from cluster peers
+    TOO_LONG,        // deliveries too long for a text receiver, not sent
+    NUM_COUNTERS
+  };
+
+  enum Histogram {
+    BROADCAST_TIME,  // broadcast_message: encoding, logging, fan-out
+    QUEUE_DELAY,     // from a frame's creation to its dequeue
+    SEND_TIME,       // one Connection::send, or one epoll reactor writev
+                     // (io_uring sends finish asynchronously, not counted)
+    NUM_HISTOGRAMS
+  };
+
+  static const char *counter_name(Counter c);
+  static const char *histogram_name(Histogram h);
+
+  // current timestamp, in ticks
+  static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+  }
+
+  static void count(Counter c, uint64_t n = 1);
+
+  // one event that took ticks (a difference of now() values)
+  static void record(Histogram h, uint64_t ticks);
+
+  // the same, ending now
+  static void record_since(Histogram h, uint64_t start) {
+    record(h, now() - start);
+  }
+
+  struct HistogramStats {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    // (upper bound in ns, events) for every bucket that has any
+    std::vector<std::pair<uint64_t, uint64_t> > buckets;
+
+    // the value p (0..1) of all events are at or below, rounded up
+    // to the end of its bucket
+    uint64_t percentile(double p) const;
+  };
+
+  struct Stats {
+    uint64_t uptime_ns;
+    size_t threads; // threads that have counted anything and are still alive
+    uint64_t counters[NUM_COUNTERS];
+    HistogramStats histograms[NUM_HISTOGRAMS];
+  };
+
+  static Stats get_stats();
+
+private:
+  Metrics();
+};
+
+#endif // METRICS_H
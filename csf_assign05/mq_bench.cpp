@@ -0,0 +1,112 @@
+// Microbenchmark for the MessageQueue implementations: P producer
+// threads enqueue into one queue while a single consumer waits on
+// the queue's eventfd and drains it, the same way a receiver does.
+// Reports end-to-end throughput for each implementation at 1, 4, 16
+// and 64 producers.
+//
+// Usage: ./mq_bench [total_messages_per_run]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <pthread.h>
+#include <poll.h>
+#include "frame.h"
+#include "message_queue.h"
+
+namespace {
+
+struct ProducerArg {
+    MessageQueue *queue;
+    Frame *frame;
+    long count;
+    pthread_barrier_t *start;
+};
+
+void *producer(void *arg) {
+    ProducerArg *parg = static_cast<ProducerArg *>(arg);
+    pthread_barrier_wait(parg->start);
+
+    for (long i = 0; i < parg->count; i++) {
+        parg->frame->ref(); // this reference now belongs to the queue
+        parg->queue->enqueue(parg->frame);
+    }
+    return nullptr;
+}
+
+// returns messages per second
+double run(MessageQueue::Kind kind, int nproducers, long total) {
+    MessageQueue *queue = MessageQueue::create(kind);
+    long per_producer = total / nproducers;
+    total = per_producer * nproducers;
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, nullptr, nproducers + 1);
+
+    std::vector<ProducerArg> args(nproducers);
+    std::vector<pthread_t> tids(nproducers);
+    for (int i = 0; i < nproducers; i++) {
+        // one frame per producer so they don't share a refcount
+        args[i].queue = queue;
+        args[i].frame = Frame::create("delivery", "bench:producer:payload");
+        args[i].count = per_producer;
+        args[i].start = &start;
+        pthread_create(&tids[i], nullptr, producer, &args[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    auto t0 = std::chrono::steady_clock::now();
+
+    pollfd pfd;
+    pfd.fd = queue->get_notify_fd();
+    pfd.events = POLLIN;
+
+    long received = 0;
+    while (received < total) {
+        poll(&pfd, 1, -1);
+        while (Frame *frame = queue->dequeue()) {
+            frame->unref();
+            received++;
+        }
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < nproducers; i++) {
+        pthread_join(tids[i], nullptr);
+        args[i].frame->unref();
+    }
+    pthread_barrier_destroy(&start);
+    delete queue;
+
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    return total / secs;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    long total = 2000000;
+    if (argc > 1) {
+        total = std::stol(argv[1]);
+    }
+
+    const int producer_counts[] = { 1, 4, 16, 64 };
+
+    std::cout << std::setw(10) << "producers"
+              << std::setw(16) << "locked Mmsg/s"
+              << std::setw(16) << "lockfree Mmsg/s" << "\n";
+
+    for (int nproducers : producer_counts) {
+        double locked = run(MessageQueue::LOCKED, nproducers, total);
+        double lockfree = run(MessageQueue::LOCK_FREE, nproducers, total);
+        std::cout << std::setw(10) << nproducers
+                  << std::fixed << std::setprecision(2)
+                  << std::setw(16) << locked / 1e6
+                  << std::setw(16) << lockfree / 1e6 << "\n";
+    }
+
+    return 0;
+}
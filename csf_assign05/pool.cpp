@@ -0,0 +1,182 @@
+#include <atomic>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include "guard.h"
+#include "pool.h"
+
+namespace {
+
+const size_t MIN_BLOCK = 32;
+
+// blocks moved between a thread cache and the central list at a time,
+// also the number of blocks in a slab
+const size_t BATCH = 32;
+
+// a thread cache holding more than this many bytes of one class (but
+// at least two batches) gives a batch back
+const size_t CACHE_MAX_BYTES = 32 * 1024;
+
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+// a chain of free blocks and its length
+typedef std::pair<FreeBlock *, size_t> Batch;
+
+size_t block_size(size_t cls) {
+    return MIN_BLOCK << cls;
+}
+
+size_t cache_max(size_t cls) {
+    return std::max(2 * BATCH, CACHE_MAX_BYTES / block_size(cls));
+}
+
+size_t class_index(size_t size) {
+    size_t cls = 0;
+    while (block_size(cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+struct Central {
+    pthread_mutex_t lock;
+    std::vector<Batch> batches;
+    std::atomic<uint64_t> slabs;
+    std::atomic<uint64_t> gets;
+    std::atomic<uint64_t> puts;
+    char pad[64]; // keep the classes' locks on separate cache lines
+
+    Central() : slabs(0), gets(0), puts(0) {
+        pthread_mutex_init(&lock, nullptr);
+    }
+};
+
+Central central[Pool::NUM_CLASSES];
+std::atomic<uint64_t> slab_bytes(0);
+std::atomic<uint64_t> oversize_allocs(0);
+
+void put_batch(size_t cls, Batch batch) {
+    Central &c = central[cls];
+    {
+        Guard g(c.lock);
+        c.batches.push_back(batch);
+    }
+    c.puts.fetch_add(1, std::memory_order_relaxed);
+}
+
+// a batch of free blocks, from the central list if it has any,
+// otherwise a freshly carved slab
+Batch get_batch(size_t cls) {
+    Central &c = central[cls];
+    {
+        Guard g(c.lock);
+        if (!c.batches.empty()) {
+            Batch batch = c.batches.back();
+            c.batches.pop_back();
+            c.gets.fetch_add(1, std::memory_order_relaxed);
+            return batch;
+        }
+    }
+
+    size_t size = block_size(cls);
+    char *slab = static_cast<char *>(::operator new(BATCH * size));
+    c.slabs.fetch_add(1, std::memory_order_relaxed);
+    slab_bytes.fetch_add(BATCH * size, std::memory_order_relaxed);
+
+    FreeBlock *head = nullptr;
+    for (size_t i = BATCH; i > 0; i--) {
+        FreeBlock *block = reinterpret_cast<FreeBlock *>(slab + (i - 1) * size);
+        block->next = head;
+        head = block;
+    }
+    return Batch(head, BATCH);
+}
+
+struct ThreadCache {
+    FreeBlock *head[Pool::NUM_CLASSES];
+    size_t count[Pool::NUM_CLASSES];
+
+    ThreadCache() {
+        for (size_t i = 0; i < Pool::NUM_CLASSES; i++) {
+            head[i] = nullptr;
+            count[i] = 0;
+        }
+    }
+
+    // a thread going away (e.g. a client's worker) hands its blocks
+    // to the threads that are still around
+    ~ThreadCache() {
+        for (size_t i = 0; i < Pool::NUM_CLASSES; i++) {
+            if (head[i]) {
+                put_batch(i, Batch(head[i], count[i]));
+            }
+        }
+    }
+};
+
+thread_local ThreadCache cache;
+
+} // anonymous namespace
+
+void *Pool::alloc(size_t size) {
+    if (size > MAX_BLOCK) {
+        oversize_allocs.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+
+    size_t cls = class_index(size);
+    ThreadCache &tc = cache;
+    if (!tc.head[cls]) {
+        Batch batch = get_batch(cls);
+        tc.head[cls] = batch.first;
+        tc.count[cls] = batch.second;
+    }
+
+    FreeBlock *block = tc.head[cls];
+    tc.head[cls] = block->next;
+    tc.count[cls]--;
+    return block;
+}
+
+void Pool::free(void *p, size_t size) {
+    if (size > MAX_BLOCK) {
+        ::operator delete(p);
+        return;
+    }
+
+    size_t cls = class_index(size);
+    ThreadCache &tc = cache;
+    FreeBlock *block = static_cast<FreeBlock *>(p);
+    block->next = tc.head[cls];
+    tc.head[cls] = block;
+    tc.count[cls]++;
+
+    if (tc.count[cls] > cache_max(cls)) {
+        // split off the first BATCH blocks and give them back
+        FreeBlock *last = tc.head[cls];
+        for (size_t i = 1; i < BATCH; i++) {
+            last = last->next;
+        }
+        Batch batch(tc.head[cls], BATCH);
+        tc.head[cls] = last->next;
+        tc.count[cls] -= BATCH;
+        last->next = nullptr;
+        put_batch(cls, batch);
+    }
+}
+
+Pool::Stats Pool::get_stats() {
+    Stats stats;
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        stats.classes[i].block_size = block_size(i);
+        stats.classes[i].slabs = central[i].slabs.load(std::memory_order_relaxed);
+        stats.classes[i].central_gets = central[i].gets.load(std::memory_order_relaxed);
+        stats.classes[i].central_puts = central[i].puts.load(std::memory_order_relaxed);
+    }
+    stats.slab_bytes = slab_bytes.load(std::memory_order_relaxed);
+    stats.oversize_allocs = oversize_allocs.load(std::memory_order_relaxed);
+    return stats;
+}
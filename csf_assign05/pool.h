@@ -0,0 +1,73 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Fixed-size block allocator for the server's hot path (frames, queue
+// nodes, users, ...). Requests are rounded up to a size class and
+// served from a per-thread cache of free blocks, so the common case is
+// a couple of pointer moves with no lock and no malloc. Frames are
+// usually freed by a different thread than the one that made them, so
+// blocks migrate: a cache that gets too full hands a batch of blocks
+// to a central per-class list, and an empty cache takes a batch from
+// there. Only when the central list is empty too does the pool carve a
+// new slab out of the system allocator, which means in steady state
+// nothing is malloc'ed at all. Slabs are never given back.
+//
+// Requests bigger than the largest size class go straight to operator
+// new and are counted as oversize.
+class Pool {
+public:
+  static const size_t NUM_CLASSES = 8;
+  static const size_t MAX_BLOCK = 4096;
+
+  static void *alloc(size_t size);
+  static void free(void *p, size_t size);
+
+  struct ClassStats {
+    size_t block_size;
+    uint64_t slabs;         // slabs carved from the system allocator
+    uint64_t central_gets;  // batches a thread cache took from the central list
+    uint64_t central_puts;  // batches a thread cache gave back
+  };
+
+  struct Stats {
+    ClassStats classes[NUM_CLASSES];
+    uint64_t slab_bytes;      // total bytes in slabs
+    uint64_t oversize_allocs; // requests too big for any size class
+  };
+
+  static Stats get_stats();
+
+private:
+  Pool();
+};
+
+// Standard allocator on top of the pool, for containers and
+// std::allocate_shared
+template <typename T>
+struct PoolAllocator {
+  typedef T value_type;
+
+  PoolAllocator() { }
+  template <typename U> PoolAllocator(const PoolAllocator<U> &) { }
+
+  T *allocate(size_t n) { return static_cast<T *>(Pool::alloc(n * sizeof(T))); }
+  void deallocate(T *p, size_t n) { Pool::free(p, n * sizeof(T)); }
+
+  template <typename U> bool operator==(const PoolAllocator<U> &) const { return true; }
+  template <typename U> bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+// Base class that makes new/delete of a class (and everything derived
+// from it) go through the pool. Sized delete gets the real size even
+// for a derived object, as long as the destructor is virtual.
+struct PoolAllocated {
+  static void *operator new(size_t size) { return Pool::alloc(size); }
+  static void operator delete(void *p, size_t size) { Pool::free(p, size); }
+};
+
+#endif // POOL_H
@@ -0,0 +1,46 @@
+#include <time.h>
+#include "rate_limiter.h"
+
+namespace {
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+} // anonymous namespace
+
+RateLimiter::RateLimiter(const RateLimit &limit)
+    : m_interval(0), m_tolerance(0), m_full_at(0) {
+    if (limit.rate > 0) {
+        m_interval = uint64_t(1e9 / limit.rate);
+        if (m_interval == 0) {
+            m_interval = 1;
+        }
+        m_tolerance = m_interval * (limit.burst > 0 ? limit.burst - 1 : 0);
+    }
+}
+
+RateLimiter &RateLimiter::operator=(const RateLimiter &other) {
+    m_interval = other.m_interval;
+    m_tolerance = other.m_tolerance;
+    m_full_at.store(0, std::memory_order_relaxed);
+    return *this;
+}
+
+bool RateLimiter::take_slow() {
+    uint64_t now = monotonic_ns();
+    uint64_t full_at = m_full_at.load(std::memory_order_relaxed);
+    for (;;) {
+        // a bucket that's been full for a while is just full
+        uint64_t from = full_at > now ? full_at : now;
+        if (from - now > m_tolerance) {
+            return false;
+        }
+        if (m_full_at.compare_exchange_weak(full_at, from + m_interval,
+                                            std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <cstdint>
+
+// A rate, and how many messages may go over it in one burst
+struct RateLimit {
+  double rate;    // messages per second, 0 = unlimited
+  unsigned burst; // at least 1
+
+  RateLimit() : rate(0), burst(1) { }
+  RateLimit(double rate, unsigned burst) : rate(rate), burst(burst) { }
+};
+
+// Token bucket: refills at limit.rate tokens per second up to
+// limit.burst, every message takes one. Kept as a single timestamp
+// (the "generic cell rate algorithm" form of a token bucket): the time
+// at which the bucket would be full again. Taking a token moves it one
+// interval further, which is refused if it would end up more than a
+// burst's worth of intervals ahead of now. That is one compare-and-swap,
+// so a room's limiter can be shared by all the threads sending into
+// it without a lock.
+class RateLimiter {
+public:
+  RateLimiter() : m_interval(0), m_tolerance(0), m_full_at(0) { }
+  explicit RateLimiter(const RateLimit &limit);
+
+  // copies start out full
+  RateLimiter(const RateLimiter &other)
+    : m_interval(other.m_interval), m_tolerance(other.m_tolerance), m_full_at(0) { }
+  RateLimiter &operator=(const RateLimiter &other);
+
+  bool limited() const { return m_interval != 0; }
+
+  // take a token; false if the bucket is empty
+  bool take() { return !limited() || take_slow(); }
+
+  // undo a take whose message didn't go out after all
+  void give_back() {
+    if (limited()) {
+      m_full_at.fetch_sub(m_interval, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  bool take_slow();
+
+  uint64_t m_interval;  // ns per token
+  uint64_t m_tolerance; // how far ahead of now m_full_at may get
+  std::atomic<uint64_t> m_full_at; // monotonic ns
+};
+
+#endif // RATE_LIMITER_H
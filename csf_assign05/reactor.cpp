@@ -0,0 +1,456 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <algorithm>
+#include <climits>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "csapp.h"
+#include "message.h"
+#include "pool.h"
+#include "metrics.h"
+#include "frame.h"
+#include "wire.h"
+#include "user.h"
+#include "room.h"
+#include "session.h"
+#include "server.h"
+#include "reactor.h"
+#include "epoll_reactor.h"
+#include "uring_reactor.h"
+
+namespace {
+
+void fatal(const char *msg) {
+    unix_error(const_cast<char *>(msg));
+}
+
+// set by run(), see Reactor::current()
+thread_local Reactor *current_reactor = nullptr;
+
+} // anonymous namespace
+
+// a broadcast handed over to a reactor (by its own thread too)
+struct Reactor::Handoff : PoolAllocated {
+  Handoff *next;
+  const Room *room;                          // only to tell rooms apart
+  std::shared_ptr<const MemberList> members; // snapshot at broadcast time
+  size_t begin, end;                         // the ones living here
+  Frame *frame;                              // we own a ref
+};
+
+////////////////////////////////////////////////////////////////////////
+// Reactor member functions
+////////////////////////////////////////////////////////////////////////
+
+Reactor *Reactor::create(Server *server, int listenfd) {
+    if (server->get_options().io_backend == ServerOptions::IO_URING) {
+        Reactor *reactor = UringReactor::create(server, listenfd);
+        if (reactor) {
+            return reactor;
+        }
+
+        // only worth saying once when there are several reactors
+        static bool warned = false;
+        if (!warned) {
+            std::fprintf(stderr, "io_uring not usable (%s), using epoll\n",
+                         std::strerror(errno));
+            warned = true;
+        }
+    }
+    return new EpollReactor(server, listenfd);
+}
+
+Reactor::Reactor(Server *server, int listenfd)
+    : m_server(server), m_listenfds(1, listenfd),
+      m_max_iov(std::min(2 * server->get_options().write_batch, size_t(IOV_MAX))),
+      m_shm_iov(m_max_iov), m_inbound_fd(-1), m_inbound(nullptr) {
+    m_inbound_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_inbound_fd < 0) {
+        fatal("eventfd error");
+    }
+}
+
+Reactor::~Reactor() {
+    // the backend's destructor has closed and freed the connections
+
+    // drop whatever was posted but never delivered
+    Handoff *h = m_inbound.exchange(nullptr, std::memory_order_acquire);
+    while (h) {
+        Handoff *next = h->next;
+        h->frame->unref();
+        delete h;
+        h = next;
+    }
+    for (BacklogMap::value_type &entry : m_backlog) {
+        for (h = entry.second.head; h; ) {
+            Handoff *next = h->next;
+            h->frame->unref();
+            delete h;
+            h = next;
+        }
+    }
+    ::close(m_inbound_fd);
+}
+
+void Reactor::run() {
+    current_reactor = this;
+    event_loop();
+}
+
+Reactor *Reactor::current() {
+    return current_reactor;
+}
+
+void Reactor::post_delivery(const Room *room,
+                            const std::shared_ptr<const MemberList> &members,
+                            size_t begin, size_t end, Frame *frame) {
+    Handoff *h = new Handoff;
+    h->room = room;
+    h->members = members;
+    h->begin = begin;
+    h->end = end;
+    h->frame = frame;
+
+    Handoff *head = m_inbound.load(std::memory_order_relaxed);
+    do {
+        h->next = head;
+    } while (!m_inbound.compare_exchange_weak(head, h, std::memory_order_release,
+                                              std::memory_order_relaxed));
+
+    // only the push that finds the stack empty needs to wake us up
+    if (!head) {
+        uint64_t one = 1;
+        ssize_t rc = write(m_inbound_fd, &one, sizeof(one));
+        (void) rc; // can only fail if the counter is saturated
+    }
+}
+
+void Reactor::drain_inbound() {
+    // reset the eventfd *before* taking the stack: a push that lands
+    // after the exchange finds it empty and signals again
+    uint64_t count;
+    ssize_t rc = read(m_inbound_fd, &count, sizeof(count));
+    (void) rc;
+
+    Handoff *h = m_inbound.exchange(nullptr, std::memory_order_acquire);
+
+    // the stack is newest first, reverse it to keep broadcast order
+    Handoff *oldest = nullptr;
+    while (h) {
+        Handoff *next = h->next;
+        h->next = oldest;
+        oldest = h;
+        h = next;
+    }
+
+    // add them to their rooms' backlogs, each still in broadcast order
+    for (h = oldest; h; ) {
+        Handoff *next = h->next;
+        h->next = nullptr;
+        Backlog &backlog = m_backlog[h->room];
+        if (backlog.head) {
+            backlog.tail->next = h;
+        } else {
+            backlog.head = h;
+            m_backlog_turns.push_back(h->room);
+        }
+        backlog.tail = h;
+        h = next;
+    }
+
+    // one handoff per room per turn, until the budget is used up
+    size_t budget = DRAIN_BUDGET;
+    while (!m_backlog_turns.empty() && budget > 0) {
+        BacklogMap::iterator it = m_backlog.find(m_backlog_turns.front());
+        m_backlog_turns.pop_front();
+
+        h = it->second.head;
+        for (size_t i = h->begin; i < h->end; i++) {
+            h->frame->ref();  // this reference now belongs to the queue
+            (*h->members)[i]->deliver(h->frame);
+        }
+        h->frame->unref();
+        budget -= std::min(budget, h->end - h->begin);
+
+        it->second.head = h->next;
+        delete h;
+        if (it->second.head) {
+            m_backlog_turns.push_back(it->first);
+        } else {
+            m_backlog.erase(it);
+        }
+    }
+
+    // more left: let everything else that's ready go first, then come
+    // back for it
+    if (!m_backlog_turns.empty()) {
+        uint64_t one = 1;
+        rc = write(m_inbound_fd, &one, sizeof(one));
+        (void) rc;
+    }
+}
+
+void Reactor::handle_input(Conn *conn) {
+    if (conn->shm && conn->state == Conn::RECEIVER) {
+        // all a ring receiver sends from now on is doorbells
+        conn->in.clear();
+        return;
+    }
+
+    // handle every complete message, replies pile up in conn->out
+    // and go out together when the caller flushes. The format is
+    // looked up each time round since a login can switch it
+    // mid-buffer.
+    size_t start = 0;
+    while (conn->state != Conn::CLOSING) {
+        MessageView msg;
+        size_t used = 0;
+        WireParse result = wire_parse(conn->in.data() + start,
+                                      conn->in.size() - start,
+                                      conn->format, msg, &used);
+        if (result == WIRE_INCOMPLETE) {
+            break;
+        }
+        if (result == WIRE_INVALID && used == 0) {
+            // oversized, and no telling where the next message starts
+            start = conn->in.size();
+            queue_reply(conn, TAG_ERR, "Message too long");
+            conn->state = Conn::CLOSING;
+            break;
+        }
+
+        if (result == WIRE_PARSED) {
+            Metrics::count(Metrics::MSGS_RECEIVED);
+        }
+        Metrics::count(Metrics::BYTES_RECEIVED, used);
+        process_message(conn, result == WIRE_PARSED ? &msg : nullptr);
+        start += used;
+        if (conn->dead) {
+            return;
+        }
+    }
+    conn->in.erase(0, start);
+}
+
+void Reactor::process_message(Conn *conn, const MessageView *msg) {
+    // null msg means it was malformed
+    bool valid = msg != nullptr;
+
+    switch (conn->state) {
+    case Conn::AWAIT_LOGIN:
+        // first message MUST be slogin or rlogin
+        if (!valid) {
+            queue_reply(conn, TAG_ERR, "Invalid login");
+            conn->state = Conn::CLOSING;
+        } else if (msg->code == TAG_CODE_SLOGIN || msg->code == TAG_CODE_RLOGIN) {
+            LoginRequest login = parse_login(msg->data);
+            if (msg->code == TAG_CODE_SLOGIN) {
+                conn->session = SenderSession(login.username,
+                                              m_server->get_options().sender_limit);
+                conn->state = Conn::SENDER;
+            } else {
+                conn->receiver = ReceiverSession(m_server->create_user(
+                    login.username, login.binary ? WIRE_BINARY : WIRE_TEXT));
+                conn->receiver.user->home = this;
+                conn->state = Conn::AWAIT_JOIN;
+                conn->shm.reset(open_login_shm(conn->fd, login));
+                watch_queue(conn);
+            }
+
+            Message reply = login_reply(login);
+            queue_reply(conn, reply.tag, reply.data);
+            if (login.binary) {
+                conn->format = WIRE_BINARY;
+            }
+            if (conn->shm) {
+                // the ok itself still goes over the socket
+                conn->socket_bytes = conn->pending_output();
+            }
+        } else {
+            queue_reply(conn, TAG_ERR, "Expected slogin or rlogin");
+            conn->state = Conn::CLOSING;
+        }
+        break;
+
+    case Conn::SENDER:
+        if (!valid) {
+            // same as a failed receive in the threaded server, but
+            // replies to the requests before it still go out
+            conn->state = Conn::CLOSING;
+        } else {
+            Message reply;
+            bool keep_going =
+                handle_sender_request(m_server, conn->session, *msg, reply);
+            queue_reply(conn, reply.tag, reply.data);
+            if (!keep_going) {
+                conn->state = Conn::CLOSING;
+            }
+        }
+        break;
+
+    case Conn::AWAIT_JOIN:
+        if (!valid) {
+            queue_reply(conn, TAG_ERR, "Expected join");
+            conn->state = Conn::CLOSING;
+        } else {
+            Message reply;
+            bool joined = handle_receiver_join(m_server, conn->receiver, *msg, reply);
+            queue_reply(conn, reply.tag, reply.data);
+            conn->state = joined ? Conn::RECEIVER : Conn::CLOSING;
+            top_up_replay(conn);
+        }
+        break;
+
+    case Conn::RECEIVER:
+        if (!valid) {
+            conn->state = Conn::CLOSING;
+        } else {
+            // join/leave more rooms; the reply goes out behind whatever
+            // deliveries are ahead of it, a replay right after it
+            Message reply;
+            handle_receiver_request(m_server, conn->receiver, *msg, reply);
+            queue_reply(conn, reply.tag, reply.data);
+            top_up_replay(conn);
+        }
+        break;
+
+    case Conn::CLOSING:
+        // nothing more to say, ignore it
+        break;
+    }
+}
+
+void Reactor::queue_reply(Conn *conn, const std::string &tag,
+                          const std::string &data) {
+    conn->push_output(Frame::create(tag, data));
+}
+
+void Reactor::deliver(Conn *conn) {
+    if (conn->receiver.user->mqueue->is_overflowed()) {
+        // too slow to keep up (DISCONNECT policy)
+        close_conn(conn);
+        return;
+    }
+
+    if (conn->replaying()) {
+        top_up_replay(conn);
+        flush(conn);
+        return;
+    }
+
+    while (conn->pending_output() < OUTPUT_HIGH_WATER) {
+        Frame *delivery = conn->receiver.user->mqueue->dequeue();
+        if (!delivery) {
+            break;
+        }
+        // shared with the other members, sent straight from its buffer
+        conn->push_output(delivery);
+    }
+
+    flush(conn);
+}
+
+bool Reactor::top_up_replay(Conn *conn) {
+    ReceiverSession &receiver = conn->receiver;
+    RoomLog *log = receiver.replaying() ? receiver.replay_room->get_log() : nullptr;
+    std::string_view sender, text;
+    bool added = false;
+    while (receiver.replaying() && conn->pending_output() < OUTPUT_HIGH_WATER &&
+           log->read(receiver.replay, sender, text)) {
+        conn->push_output(Frame::create_delivery(log->get_room_name(), sender, text));
+        added = true;
+    }
+    if (log && receiver.replay.done()) {
+        log->finish(receiver.replay);  // the frames have copies
+    }
+    return added;
+}
+
+size_t Reactor::gather_output(Conn *conn, iovec *iov, size_t max_iov) const {
+    // before switching to a ring, stop where the socket's part ends
+    // (always at a frame boundary)
+    size_t limit = conn->socket_bytes > 0 ? conn->socket_bytes : SIZE_MAX;
+
+    // binary frames take two iovecs each
+    size_t count = 0, bytes = 0;
+    for (size_t i = 0; i < conn->out.size() && count + 2 <= max_iov && bytes < limit; i++) {
+        const Conn::Output &o = conn->out[i];
+        size_t skip = i == 0 ? conn->out_pos : 0;
+        count += o.frame->wire_iov(o.format, skip, &iov[count]);
+        bytes += o.size() - skip;
+    }
+    return count;
+}
+
+void Reactor::retire_output(Conn *conn, size_t n) {
+    // retire every frame that went out completely
+    conn->out_bytes -= n;
+    size_t left = n + conn->out_pos;
+    size_t frames = 0;
+    while (!conn->out.empty() && left >= conn->out.front().size()) {
+        left -= conn->out.front().size();
+        conn->out.front().frame->unref();
+        conn->out.pop_front();
+        frames++;
+    }
+    Metrics::count(Metrics::FRAMES_SENT, frames);
+    Metrics::count(Metrics::BYTES_SENT, n);
+    conn->out_pos = left;
+    conn->socket_bytes -= std::min(conn->socket_bytes, n);
+}
+
+void Reactor::write_shm(Conn *conn) {
+    bool wrote = false;
+    while (!conn->out.empty()) {
+        size_t count = gather_output(conn, m_shm_iov.data(), m_shm_iov.size());
+        size_t n = conn->shm->write(m_shm_iov.data(), count);
+        if (n > 0) {
+            retire_output(conn, n);
+            wrote = true;
+        } else if (conn->shm->writer_may_sleep()) {
+            break; // full, the doorbell will bring us back
+        }
+    }
+
+    if (wrote && conn->shm->reader_needs_wakeup()) {
+        ShmRing::ring_doorbell(conn->fd);
+    }
+}
+
+void Reactor::close_conn(Conn *conn) {
+    if (conn->dead) {
+        return;
+    }
+    conn->dead = true;
+    Metrics::count(Metrics::CONNS_CLOSED);
+
+    release_conn(conn);
+
+    // kick the receiver out of its room before freeing it
+    if (conn->receiver.user) {
+        conn->receiver.leave_all();
+        m_server->remove_user(conn->receiver.user.get());
+        // freed once no room snapshot refers to it either
+        conn->receiver.user.reset();
+    }
+
+    m_conns.erase(conn);
+}
+
+void Reactor::close_all_conns() {
+    // close_conn erases from m_conns, so work from a copy
+    std::vector<Conn *> open_conns(m_conns.begin(), m_conns.end());
+    for (Conn *conn : open_conns) {
+        close_conn(conn);
+    }
+}
+
+void Reactor::free_dead_conns() {
+    for (Conn *conn : m_dead) {
+        delete conn;
+    }
+    m_dead.clear();
+}
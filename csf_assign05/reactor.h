@@ -0,0 +1,240 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/uio.h>
+#include "pool.h"
+#include "frame.h"
+#include "metrics.h"
+#include "wire.h"
+#include "session.h"
+#include "shm_ring.h"
+#include "room_log.h"
+class Server;
+class Room;
+struct User;
+struct MessageView;
+
+// Single-threaded event loop that services every client connection
+// with non-blocking I/O. Each connection carries a small state machine
+// (login -> sender, or login -> join -> receiver) plus its own input
+// and output buffers, so no client ever needs a thread of its own.
+// Used when the server runs in REACTOR mode.
+//
+// This class holds everything that doesn't depend on how the I/O is
+// done: the per-connection state machine, parsing, queueing replies
+// and deliveries, and handoffs between reactors. Getting bytes in and
+// out is up to a backend, EpollReactor (epoll_reactor.h) or
+// UringReactor (uring_reactor.h). A receiver's queue eventfd is
+// watched next to its socket, so the reactor only hears about a
+// receiver when deliveries are waiting (or the client hangs up); idle
+// receivers cost nothing.
+//
+// The server can run several reactors, one per thread, each with its
+// own SO_REUSEPORT listener. Receivers belong to the reactor that
+// accepted them (User::home). A broadcast reaches them through this
+// reactor's inbound queue: a lock-free stack of handoffs plus one
+// eventfd, so the sender pays for one push per reactor instead of
+// touching every remote queue. Its own senders' broadcasts go the same
+// way, so every room's deliveries take turns (see drain_inbound), with
+// one reactor as with several.
+class Reactor {
+public:
+  typedef std::vector<std::shared_ptr<User> > MemberList;
+
+  // Make the kind of reactor the server's options ask for. listenfd
+  // is the server's listening socket, which the reactor accepts from.
+  // An io_uring reactor falls back to epoll if the kernel can't do
+  // everything it needs.
+  static Reactor *create(Server *server, int listenfd);
+
+  virtual ~Reactor();
+
+  // accept from another listening socket too (before run)
+  void add_listener(int listenfd) { m_listenfds.push_back(listenfd); }
+
+  // run the event loop (does not return)
+  void run();
+
+  // the reactor running on the calling thread, if any
+  static Reactor *current();
+
+  // Deliver frame, broadcast into room, to (*members)[begin, end),
+  // which all live on this reactor. Takes over one reference to frame.
+  // Can be called from any thread; the enqueues happen on this
+  // reactor's thread, taking turns with other rooms' deliveries.
+  void post_delivery(const Room *room,
+                     const std::shared_ptr<const MemberList> &members,
+                     size_t begin, size_t end, Frame *frame);
+
+protected:
+  // per-connection state; backends derive their own to add whatever
+  // their I/O needs
+  struct Conn {
+    enum State {
+      AWAIT_LOGIN, // nothing received yet
+      SENDER,      // slogin done, processing sender commands
+      AWAIT_JOIN,  // rlogin done, waiting for the join
+      RECEIVER,    // in a room, getting deliveries
+      CLOSING,     // close as soon as pending output is written
+    };
+
+    // a frame waiting to be written, in the format it was queued in
+    // (the login ok still goes out as text after switching to binary)
+    struct Output {
+      Frame *frame; // we own a ref
+      WireFormat format;
+
+      size_t size() const { return frame->wire_size(format); }
+    };
+
+    int fd;
+    State state;
+    WireFormat format;
+
+    std::string in;          // bytes received but not yet parsed
+    std::deque<Output, PoolAllocator<Output> > out; // frames waiting to be written
+    size_t out_pos;          // how much of out.front() is written already
+    size_t out_bytes;        // unwritten bytes across all of out
+
+    SenderSession session;    // valid in SENDER state
+    ReceiverSession receiver; // user valid in AWAIT_JOIN/RECEIVER states
+
+    // a local receiver's ring; output goes there once the first
+    // socket_bytes of it (the login ok) went out over the socket
+    std::unique_ptr<ShmRing> shm;
+    size_t socket_bytes;
+
+    bool dead; // closed, waiting to be freed
+
+    Conn(int fd)
+      : fd(fd), state(AWAIT_LOGIN), format(WIRE_TEXT),
+        out_pos(0), out_bytes(0), session(""), socket_bytes(0), dead(false) { }
+
+    virtual ~Conn() {
+      for (const Output &o : out) {
+        o.frame->unref();
+      }
+    }
+
+    size_t pending_output() const { return out_bytes; }
+
+    bool output_via_shm() const { return shm && socket_bytes == 0; }
+
+    // live deliveries wait in the queue until the replay is done
+    bool replaying() const { return receiver.replaying(); }
+
+    // takes over the caller's reference
+    void push_output(Frame *frame) {
+      Output o = { frame, format };
+      out.push_back(o);
+      out_bytes += o.size();
+    }
+  };
+
+  // stop pulling deliveries out of a receiver's queue once this much
+  // output is waiting on a slow socket (the rest stays queued)
+  static const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+  Reactor(Server *server, int listenfd);
+
+  //
+  // backend hooks
+  //
+
+  virtual void event_loop() = 0;
+
+  // write out (or start writing out) conn's pending output
+  virtual void flush(Conn *conn) = 0;
+
+  // conn just became a receiver-to-be, its user's queue exists now
+  virtual void watch_queue(Conn *) { }
+
+  // stop all I/O on a connection close_conn gave up on; the backend
+  // puts it on m_dead once nothing refers to it anymore
+  virtual void release_conn(Conn *conn) = 0;
+
+  //
+  // shared by the backends
+  //
+
+  void add_conn(Conn *conn) {
+    m_conns.insert(conn);
+    Metrics::count(Metrics::CONNS_OPENED);
+  }
+
+  // act on every complete message in conn->in; replies pile up in
+  // conn->out for the caller to flush
+  void handle_input(Conn *conn);
+
+  // move what fits of a receiver's queue into its output and flush
+  void deliver(Conn *conn);
+
+  // move what fits of a replaying receiver's log into its output;
+  // false if there was nothing to move
+  bool top_up_replay(Conn *conn);
+
+  // point iov (room for max_iov entries) at conn's pending output,
+  // returns the number of entries used
+  size_t gather_output(Conn *conn, iovec *iov, size_t max_iov) const;
+
+  // n more bytes of conn's output were written, drop finished frames
+  void retire_output(Conn *conn, size_t n);
+
+  // move what fits of conn's output into its ring (output_via_shm);
+  // the rest waits for the receiver's doorbell on the socket
+  void write_shm(Conn *conn);
+
+  void close_conn(Conn *conn);
+  void close_all_conns();
+  void free_dead_conns();
+  void drain_inbound();
+
+  Server *m_server;
+  std::vector<int> m_listenfds;
+  std::unordered_set<Conn *> m_conns;
+  std::vector<Conn *> m_dead; // closed, freed at end of loop iteration
+  size_t m_max_iov;           // most iovecs in one write
+  std::vector<iovec> m_shm_iov; // scratch space for write_shm
+  int m_inbound_fd;           // readable while handoffs are waiting
+
+private:
+  // prohibit value semantics
+  Reactor(const Reactor &);
+  Reactor &operator=(const Reactor &);
+
+  struct Handoff; // a delivery posted to this reactor
+
+  void process_message(Conn *conn, const MessageView *msg);
+  void queue_reply(Conn *conn, const std::string &tag, const std::string &data);
+
+  // inbound handoffs, newest first; the thread that pushes onto an
+  // empty stack signals m_inbound_fd
+  std::atomic<Handoff *> m_inbound;
+
+  // Handoffs taken off m_inbound but not delivered yet, a queue per
+  // room. drain_inbound serves the rooms round-robin, one handoff at a
+  // time, and stops after DRAIN_BUDGET enqueues (signaling
+  // m_inbound_fd to come back for the rest), so a hot room can't hold
+  // up the other rooms, or this reactor's I/O, for long.
+  static const size_t DRAIN_BUDGET = 4096;
+
+  struct Backlog {
+    Handoff *head, *tail;
+  };
+  typedef std::unordered_map<const Room *, Backlog, std::hash<const Room *>,
+                             std::equal_to<const Room *>,
+                             PoolAllocator<std::pair<const Room *const, Backlog> > >
+    BacklogMap;
+
+  BacklogMap m_backlog;
+  std::deque<const Room *> m_backlog_turns; // rooms with a backlog, next first
+};
+
+#endif // REACTOR_H
@@ -1,50 +1,163 @@
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <deque>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include "message.h"
 #include "connection.h"
 #include "client_util.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        std::cerr << "Usage: ./receiver [server_address] [port] [username] [room]\n";
-        return 1;
+static void usage() {
+    std::cerr << "Usage: ./receiver [-b] [-o offset_file] [bulk options] [server_address] [port] [username] [room...]\n"
+                 "       ./receiver [-b] [-o offset_file] [bulk options] [-s] -u [socket_path] [username] [room...]\n"
+                 "Bulk options:\n"
+                 "  -f text|raw   buffer the output, text as usual or raw deliveries\n"
+                 "                (room:sender:text, untouched)\n"
+                 "  -F <bytes>    write it out once this much is buffered (default 256K)\n"
+                 "  -T <ms>       or once it has waited this long (default 100)\n";
+    std::exit(1);
+}
+
+// set by SIGINT/SIGTERM/SIGHUP in bulk mode, so what's buffered still
+// gets written before we go
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+    stop_requested = 1;
+}
+
+// Bulk mode, before a receive that would have to wait: write out the
+// buffer once it's due, waiting for input no longer than that. Returns
+// false once we've been asked to stop.
+static bool wait_for_input(Connection &c, BufferedOutput &out) {
+    if (c.has_shm()) {
+        // the ring has no fd to wait on with a timeout: flush before
+        // every wait instead
+        out.flush();
+        return !stop_requested;
     }
 
-    std::string host   = argv[1];
-    int port           = std::stoi(argv[2]);
-    std::string user   = argv[3];
-    std::string room   = argv[4];
+    for (;;) {
+        int timeout = out.ms_left();
+        if (timeout == 0) {
+            out.flush();
+            timeout = -1;
+        }
 
-    Connection c;
+        pollfd pfd;
+        pfd.fd = c.get_fd();
+        pfd.events = POLLIN;
+        int n = poll(&pfd, 1, timeout);
+        if (stop_requested) {
+            return false;
+        }
+        if (n > 0 || (n < 0 && errno != EINTR)) {
+            return true;  // input, or an error the receive will report
+        }
+    }
+}
 
-    // connect
-    c.connect(host, port);
+// the offset of the next delivery, as kept in the offset file
+static void save_offset(int fd, unsigned long long offset) {
+    char buf[24];
+    int len = std::snprintf(buf, sizeof(buf), "%020llu\n", offset);
+    if (pwrite(fd, buf, len, 0) != len) {
+        std::cerr << "Failed to save offset\n";
+    }
+}
 
-    // --- rlogin ---
-    Message loginMsg(TAG_RLOGIN, user);
-    if (!c.send(loginMsg)) {
-        std::cerr << "Failed to send rlogin";
-        return 1;
+int main(int argc, char *argv[]) {
+    // -b: ask for binary framing
+    // -u: connect to the server's UNIX domain socket instead of TCP
+    // -s: take deliveries through shared memory (needs -u)
+    // -o: keep track of where we are in the room's log in this file,
+    //     and pick up from there when started again
+    // -f: bulk output (see usage), -F/-T: when it's written out
+    bool binary = false;
+    bool shm = false;
+    bool bulk = false;
+    bool raw = false;
+    size_t flush_bytes = 256 * 1024;
+    unsigned flush_ms = 100;
+    std::string unix_path;
+    std::string offset_path;
+    int opt;
+    while ((opt = getopt(argc, argv, "bsu:o:f:F:T:")) != -1) {
+        if (opt == 'f') {
+            bulk = true;
+            if (strcmp(optarg, "raw") == 0) {
+                raw = true;
+            } else if (strcmp(optarg, "text") != 0) {
+                usage();
+            }
+        } else if (opt == 'F') {
+            flush_bytes = std::strtoul(optarg, nullptr, 10);
+        } else if (opt == 'T') {
+            flush_ms = std::strtoul(optarg, nullptr, 10);
+        } else if (opt == 'b') {
+            binary = true;
+        } else if (opt == 's') {
+            shm = true;
+        } else if (opt == 'u') {
+            unix_path = optarg;
+        } else if (opt == 'o') {
+            offset_path = optarg;
+        } else {
+            usage();
+        }
     }
 
-    Message loginResp;
-    if (!c.receive(loginResp)) {
-        std::cerr << "No response after rlogin";
-        return 1;
+    // the first room is the one -o keeps track of; a ring receiver
+    // can't join more than one
+    int first_room = optind + (unix_path.empty() ? 3 : 1);
+    if (argc <= first_room || (shm && unix_path.empty()) || (shm && argc > first_room + 1)) {
+        usage();
     }
 
-    if (loginResp.tag == TAG_ERR) {
-        std::cerr << loginResp.data << std::endl;
-        return 1;
+    std::string user   = argv[first_room - 1];
+    std::string room   = argv[first_room];
+    bool many_rooms    = argc > first_room + 1;
+
+    Connection c;
+
+    // connect
+    if (unix_path.empty()) {
+        c.connect(argv[optind], std::stoi(argv[optind + 1]));
+    } else {
+        c.connect_unix(unix_path);
     }
 
-    if (loginResp.tag != TAG_OK) {
-        std::cerr << loginResp.tag << std::endl;
+    // --- rlogin ---
+    if (!client_login(c, TAG_RLOGIN, user, binary, shm)) {
         return 1;
     }
 
     // --- join room ---
-    Message joinMsg(TAG_JOIN, room);
+    // (resuming from the saved offset, if there is one)
+    int offset_fd = -1;
+    std::string join_data = room;
+    if (!offset_path.empty()) {
+        offset_fd = open(offset_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (offset_fd < 0) {
+            std::cerr << "Could not open " << offset_path << "\n";
+            return 1;
+        }
+        // no offset saved yet: from the start of the log
+        char buf[24] = "";
+        if (pread(offset_fd, buf, sizeof(buf) - 1, 0) < 0) {
+            buf[0] = '\0';
+        }
+        join_data += ":from=" + std::to_string(std::strtoull(buf, nullptr, 10));
+    }
+
+    Message joinMsg(TAG_JOIN, join_data);
     if (!c.send(joinMsg)) {
         std::cerr << "Failed to send join";
         return 1;
@@ -66,21 +179,152 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // a logged room says which offset our first delivery has, every
+    // delivery after that is the next one (no offset: nothing to save)
+    unsigned long long next_offset = std::strtoull(joinResp.data.c_str(), nullptr, 10);
+    if (joinResp.data.empty() && offset_fd >= 0) {
+        close(offset_fd);
+        offset_fd = -1;
+    }
+
+    // --- join the other rooms ---
+    // the replies come back in order, mixed in with deliveries
+    std::deque<std::string> pending_joins;
+    for (int i = first_room + 1; i < argc; i++) {
+        if (!c.send(Message(TAG_JOIN, argv[i]))) {
+            std::cerr << "Failed to send join";
+            return 1;
+        }
+        pending_joins.push_back(argv[i]);
+    }
+
     // --- receive loop ---
-    Message incoming;
+    // views into the connection's buffer, nothing gets copied
+    MessageView incoming;
+
+    if (bulk) {
+        // the offset file only ever says how far the output got
+        BufferedOutput out(STDOUT_FILENO, flush_bytes, flush_ms);
+        unsigned long long saved_offset = next_offset;
+        out.on_flush([&]() {
+            if (offset_fd >= 0 && next_offset != saved_offset) {
+                save_offset(offset_fd, next_offset);
+                saved_offset = next_offset;
+            }
+        });
+
+        if (!shm) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = request_stop;  // no SA_RESTART: poll returns
+            sigaction(SIGINT, &sa, nullptr);
+            sigaction(SIGTERM, &sa, nullptr);
+            sigaction(SIGHUP, &sa, nullptr);
+        }
+
+        for (;;) {
+            if (!c.has_buffered_input() && !wait_for_input(c, out)) {
+                break;
+            }
+            if (!c.receive(incoming)) {
+                break;
+            }
+
+            if (incoming.code == TAG_CODE_DELIVERY) {
+                // raw: the delivery as it came, only looking as far as
+                // the room name, and only when keeping an offset
+                if (raw) {
+                    out.append(incoming.data);
+                    out.append("\n");
+                    if (offset_fd >= 0 &&
+                        incoming.data.substr(0, incoming.data.find(':')) == room) {
+                        ++next_offset;
+                    }
+                    continue;
+                }
+
+                size_t a = incoming.data.find(':');
+                size_t b = incoming.data.find(':', a + 1);
+                std::string_view rm = incoming.data.substr(0, a);
+                std::string_view snd = incoming.data.substr(a + 1, b - a - 1);
+                std::string_view text = incoming.data.substr(b + 1);
+
+                if (a == 0) {
+                    out.append(snd);
+                    out.append(" (private): ");
+                } else {
+                    if (many_rooms) {
+                        out.append("[");
+                        out.append(rm);
+                        out.append("] ");
+                    }
+                    out.append(snd);
+                    out.append(": ");
+                }
+                out.append(text);
+                out.append("\n");
+
+                // counted once the whole line is in, so a flush never
+                // saves an offset past what it wrote
+                if (offset_fd >= 0 && a != 0 && rm == room) {
+                    ++next_offset;
+                }
+            }
+            else if (!pending_joins.empty() &&
+                     (incoming.code == TAG_CODE_OK || incoming.code == TAG_CODE_ERR)) {
+                if (incoming.code == TAG_CODE_ERR) {
+                    std::cerr << "Could not join " << pending_joins.front() << ": "
+                              << incoming.data << std::endl;
+                }
+                pending_joins.pop_front();
+            }
+            else if (incoming.code == TAG_CODE_ERR) {
+                out.flush();
+                std::cerr << "Server message error: " << incoming.data;
+                return 1;
+            }
+        }
+
+        out.flush();
+        return 0;
+    }
+
     while (c.receive(incoming)) {
 
-        if (incoming.tag == TAG_DELIVERY) {
+        if (incoming.code == TAG_CODE_DELIVERY) {
             // expected format: room:sender:message
             size_t a = incoming.data.find(':');
             size_t b = incoming.data.find(':', a + 1);
 
-            std::string snd = incoming.data.substr(a + 1, b - a - 1);
-            std::string text = incoming.data.substr(b + 1);
+            std::string_view rm = incoming.data.substr(0, a);
+            std::string_view snd = incoming.data.substr(a + 1, b - a - 1);
+            std::string_view text = incoming.data.substr(b + 1);
 
+            // no room: a direct message (senduser), which isn't logged
+            if (a == 0) {
+                std::cout << snd << " (private): " << text << std::endl;
+                continue;
+            }
+
+            if (many_rooms) {
+                std::cout << "[" << rm << "] ";
+            }
             std::cout << snd << ": " << text << std::endl;
+
+            if (offset_fd >= 0 && rm == room) {
+                save_offset(offset_fd, ++next_offset);
+            }
+        }
+        else if (!pending_joins.empty() &&
+                 (incoming.code == TAG_CODE_OK || incoming.code == TAG_CODE_ERR)) {
+            // a failed join only costs us that room
+            if (incoming.code == TAG_CODE_ERR) {
+                std::cerr << "Could not join " << pending_joins.front() << ": "
+                          << incoming.data << std::endl;
+            }
+            pending_joins.pop_front();
         }
-        else if (incoming.tag == TAG_ERR) {
+        else if (incoming.code == TAG_CODE_ERR) {
             std::cerr << "Server message error: " << incoming.data;
             return 1;
         }
@@ -1,41 +1,209 @@
 #include "room.h"
 #include "user.h"
 #include "guard.h"
-#include "message.h"
+#include "frame.h"
+#include "reactor.h"
+#include "room_log.h"
+#include "metrics.h"
+#include "cluster.h"
+#include "room_directory.h"
 
-Room::Room(const std::string &nm)
-    : room_name(nm)
+Room::Room(const std::string &nm, RoomLog *room_log, const RateLimit &limit,
+           Cluster *room_cluster, RoomDirectory *room_directory)
+    : room_name(nm),
+      log(room_log),
+      limiter(limit),
+      cluster(room_cluster),
+      directory(room_directory),
+      members(std::make_shared<const MemberList>()),
+      peers(std::make_shared<const MemberList>())
 {
-    // initialize mutex for protecting member set
+    // initialize mutex for serializing membership changes
     pthread_mutex_init(&lock, nullptr);
 }
 
 Room::~Room() {
     // release mutex resources
     pthread_mutex_destroy(&lock);
+    delete log;
 }
 
-void Room::add_member(User *u) {
-    // add a User* into the membership set
+uint64_t Room::add_member(const std::shared_ptr<User> &u) {
+    // copy the current snapshot, add the User, publish the copy
     Guard acquire(lock);
-    members.insert(u);
+    uint64_t next_offset = log ? log->next_offset() : 0;
+    std::shared_ptr<const MemberList> cur = std::atomic_load(&members);
+    for (const std::shared_ptr<User> &member : *cur) {
+        if (member == u) {
+            return next_offset;  // already in here
+        }
+    }
+
+    // insert after the last member with the same home, so each
+    // reactor's members stay together
+    std::shared_ptr<MemberList> next = std::make_shared<MemberList>(*cur);
+    MemberList::iterator pos = next->end();
+    for (MemberList::iterator i = next->begin(); i != next->end(); ++i) {
+        if ((*i)->home == u->home) {
+            pos = i + 1;
+        }
+    }
+    next->insert(pos, u);
+    std::atomic_store(&members, std::shared_ptr<const MemberList>(next));
+
+    // the first receiver here: the other servers should send us this
+    // room's broadcasts from now on
+    if (cluster && cur->empty()) {
+        cluster->local_join(room_name);
+    }
+    return next_offset;
 }
 
 void Room::remove_member(User *u) {
-    // erase a User* from the membership set
+    // copy the current snapshot minus the User, publish the copy
     Guard acquire(lock);
-    members.erase(u);
+    std::shared_ptr<const MemberList> cur = std::atomic_load(&members);
+
+    std::shared_ptr<MemberList> next = std::make_shared<MemberList>();
+    next->reserve(cur->size());
+    for (const std::shared_ptr<User> &member : *cur) {
+        if (member.get() != u) {
+            next->push_back(member);
+        }
+    }
+    std::atomic_store(&members, std::shared_ptr<const MemberList>(next));
+
+    // and the last one: they can stop
+    if (cluster && !cur->empty() && next->empty()) {
+        cluster->local_leave(room_name);
+    }
 }
 
-void Room::broadcast_message(const std::string &sender, const std::string &text) {
-    std::string combined = room_name;
-    combined.append(":").append(sender).append(":").append(text);
+void Room::add_peer(const std::shared_ptr<User> &peer) {
+    // same as for members, the order doesn't matter here
+    Guard acquire(lock);
+    std::shared_ptr<const MemberList> cur = std::atomic_load(&peers);
+    for (const std::shared_ptr<User> &p : *cur) {
+        if (p == peer) {
+            return;
+        }
+    }
+
+    std::shared_ptr<MemberList> next = std::make_shared<MemberList>(*cur);
+    next->push_back(peer);
+    std::atomic_store(&peers, std::shared_ptr<const MemberList>(next));
+}
 
-    // iterate safely over receivers and enqueue messages
+void Room::remove_peer(User *peer) {
     Guard acquire(lock);
-    for (User *usr : members) {
-        // allocate a delivery packet for each receiver
-        Message *m = new Message(TAG_DELIVERY, combined);
-        usr->mqueue.enqueue(m);
+    std::shared_ptr<const MemberList> cur = std::atomic_load(&peers);
+
+    std::shared_ptr<MemberList> next = std::make_shared<MemberList>();
+    next->reserve(cur->size());
+    for (const std::shared_ptr<User> &p : *cur) {
+        if (p.get() != peer) {
+            next->push_back(p);
+        }
+    }
+    std::atomic_store(&peers, std::shared_ptr<const MemberList>(next));
+}
+
+bool Room::broadcast_message(const std::string &sender, std::string_view text,
+                             size_t *reached) {
+    uint64_t start = Metrics::now();
+
+    // encode the delivery once, every receiver shares the same bytes
+    Frame *frame = Frame::create_delivery(room_name, sender, text);
+    if (!publish(frame, sender, text, reached)) {
+        return false;
+    }
+
+    // other servers with receivers in here get the same frame
+    if (cluster) {
+        forward(frame);
+    }
+
+    frame->unref();
+    Metrics::count(Metrics::BROADCASTS);
+    Metrics::record_since(Metrics::BROADCAST_TIME, start);
+    return true;
+}
+
+bool Room::relay_message(std::string_view sender, std::string_view text) {
+    // already rate limited and passed on by the server it was sent to
+    Frame *frame = Frame::create_delivery(room_name, sender, text);
+    if (!publish(frame, sender, text, nullptr)) {
+        return false;
+    }
+
+    frame->unref();
+    Metrics::count(Metrics::RELAYED_IN);
+    return true;
+}
+
+bool Room::publish(Frame *frame, std::string_view sender, std::string_view text,
+                   size_t *reached) {
+    size_t n;
+    if (log) {
+        // log order is delivery order, and no join slips in between
+        Guard acquire(lock);
+        bool first = log->next_offset() == 0;
+        if (!log->append(sender, text)) {
+            frame->unref();
+            return false;
+        }
+        if (first && directory) {
+            directory->keep(this);
+        }
+        n = fan_out(frame);
+    } else {
+        n = fan_out(frame);
+    }
+    if (reached) {
+        *reached = n;
+    }
+    return true;
+}
+
+size_t Room::fan_out(Frame *frame) {
+    // fan out over whatever the membership was when we started; unless
+    // the room is logged no lock is held (queues are safe to enqueue
+    // into concurrently)
+    std::shared_ptr<const MemberList> snapshot = std::atomic_load(&members);
+    size_t n = snapshot->size();
+    Metrics::count(Metrics::FANOUT, n);
+
+    for (size_t begin = 0; begin < n; ) {
+        // the run of members sharing a home reactor
+        Reactor *home = (*snapshot)[begin]->home;
+        size_t end = begin + 1;
+        while (end < n && (*snapshot)[end]->home == home) {
+            end++;
+        }
+
+        if (home) {
+            // a reactor's members (this thread's own reactor's too) get
+            // their enqueues from it, taking turns with other rooms
+            frame->ref();  // this reference now belongs to that reactor
+            home->post_delivery(this, snapshot, begin, end, frame);
+        } else {
+            for (size_t i = begin; i < end; i++) {
+                frame->ref();  // this reference now belongs to the queue
+                (*snapshot)[i]->deliver(frame);
+            }
+        }
+        begin = end;
+    }
+    return n;
+}
+
+void Room::forward(Frame *frame) {
+    // the links' writer threads take it from there; a peer's queue is
+    // filled from any thread, like a threaded-mode receiver's
+    std::shared_ptr<const MemberList> snapshot = std::atomic_load(&peers);
+    for (const std::shared_ptr<User> &peer : *snapshot) {
+        frame->ref();
+        peer->mqueue->enqueue(frame);
     }
+    Metrics::count(Metrics::RELAYED_OUT, snapshot->size());
 }
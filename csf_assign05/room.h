@@ -2,32 +2,101 @@
 #define ROOM_H
 
 #include <string>
-#include <set>
+#include <string_view>
+#include <vector>
+#include <memory>
 #include <pthread.h>
+#include "rate_limiter.h"
 
 struct User;
+class RoomLog;
+class Frame;
+class Cluster;
+class RoomDirectory;
 
 // A Room object is a representation of a chat room.
 // At a minimum, it should keep track of the User objects representing
 // receivers who have joined the room.
+//
+// Membership is read-mostly, so it's kept as an immutable snapshot
+// (a contiguous vector) behind a shared_ptr. Broadcasts grab the
+// current snapshot and fan out with no lock held, so any number of
+// senders can broadcast into the same room in parallel. Joins and
+// leaves copy the snapshot, modify the copy and publish it; the lock
+// only serializes those writers. A snapshot keeps its Users alive, so
+// a receiver that leaves mid-broadcast is never freed under a sender.
+//
+// With several reactor threads, a broadcast only enqueues directly to
+// members on its own thread's reactor; each other reactor gets the
+// frame once through its inbound queue and fans it out to its own
+// members (Reactor::post_delivery), so receiver queues are only ever
+// filled by the thread that drains them.
+//
+// A room can also have a durable log (room_log.h). Then a broadcast
+// appends to the log and fans out under the lock, so deliveries reach
+// every member in log order and a join sees exactly where in the log
+// its live deliveries begin. The first record logged tells the
+// directory the room came from, which keeps it from then on (see
+// room_directory.h).
+//
+// In a cluster (cluster.h), peer servers with receivers in the room
+// are kept in a second snapshot, peers, with one User each whose queue
+// feeds the link to that server. A broadcast goes to the peers as well
+// as the members; a message relayed in from a peer only goes to the
+// members, so it is never passed on a second time. The room tells the
+// cluster when its first member joins and its last one leaves.
 class Room {
 public:
-  Room(const std::string &room_name);
+  // members are kept grouped by home reactor (see User::home)
+  typedef std::vector<std::shared_ptr<User> > MemberList;
+
+  // takes over log, if any; cluster is null unless the server has peers,
+  // directory unless the room is logged
+  Room(const std::string &room_name, RoomLog *log = nullptr,
+       const RateLimit &limit = RateLimit(), Cluster *cluster = nullptr,
+       RoomDirectory *directory = nullptr);
   ~Room();
 
-  std::string get_room_name() const { return room_name; }
+  const std::string &get_room_name() const { return room_name; }
+  RoomLog *get_log() const { return log; }
+
+  // shared by everyone sending into the room, taken before a broadcast
+  RateLimiter &get_limiter() { return limiter; }
 
-  void add_member(User *user);
+  // returns the log offset of the first broadcast the new member gets
+  // (0 if the room has no log)
+  uint64_t add_member(const std::shared_ptr<User> &user);
   void remove_member(User *user);
 
-  void broadcast_message(const std::string &sender_username, const std::string &message_text);
+  // peer servers that want the room's broadcasts (see above)
+  void add_peer(const std::shared_ptr<User> &peer);
+  void remove_peer(User *peer);
+
+  // false if the message couldn't be logged (and so wasn't sent);
+  // reached, if given, is set to how many members it went to
+  bool broadcast_message(const std::string &sender_username, std::string_view message_text,
+                         size_t *reached = nullptr);
+
+  // a broadcast a peer server passed on: to the members only
+  bool relay_message(std::string_view sender_username, std::string_view message_text);
 
 private:
+  bool publish(Frame *frame, std::string_view sender, std::string_view text,
+               size_t *reached);
+  size_t fan_out(Frame *frame);
+  void forward(Frame *frame);
+
   std::string room_name;
-  pthread_mutex_t lock;
+  RoomLog *log;         // owned, null unless the server keeps logs
+  RateLimiter limiter;
+  Cluster *cluster;     // null unless the server has peers
+  RoomDirectory *directory; // told about the first record logged
+  pthread_mutex_t lock; // held by writers while they replace members
+                        // or peers (and by broadcasts into a logged room)
 
-  typedef std::set<User *> UserSet;
-  UserSet members;
+  // only accessed through std::atomic_load/std::atomic_store
+  std::shared_ptr<const MemberList> members;
+  std::shared_ptr<const MemberList> peers;
 };
 
 #endif // ROOM_H
@@ -0,0 +1,96 @@
+#include <functional>
+#include "guard.h"
+#include "room.h"
+#include "room_log.h"
+#include "room_directory.h"
+
+struct RoomDirectory::Reclaimer {
+    RoomDirectory *directory;
+
+    void operator()(Room *room) const {
+        directory->reclaim(room);
+    }
+};
+
+RoomDirectory::RoomDirectory() : m_cluster(nullptr) {
+    for (Shard &shard : m_shards) {
+        pthread_mutex_init(&shard.lock, nullptr);
+    }
+}
+
+RoomDirectory::~RoomDirectory() {
+    // logged rooms go through reclaim too, which needs the locks
+    for (Shard &shard : m_shards) {
+        shard.logged.clear();
+    }
+    for (Shard &shard : m_shards) {
+        pthread_mutex_destroy(&shard.lock);
+    }
+}
+
+RoomDirectory::Shard &RoomDirectory::shard_for(const std::string &room_name) {
+    size_t h = std::hash<std::string>()(room_name);
+    return m_shards[h & (NUM_SHARDS - 1)];
+}
+
+std::shared_ptr<Room> RoomDirectory::find_or_create(const std::string &room_name) {
+    Shard &shard = shard_for(room_name);
+    Guard g(shard.lock);
+
+    // check if it already exists (and hasn't emptied out meanwhile)
+    RoomMap::iterator it = shard.rooms.find(room_name);
+    if (it != shard.rooms.end()) {
+        std::shared_ptr<Room> room = it->second.lock();
+        if (room) {
+            return room;
+        }
+    }
+
+    RoomLog *log = nullptr;
+    if (!m_log_dir.empty()) {
+        log = RoomLog::open(m_log_dir, room_name);
+        if (!log) {
+            return std::shared_ptr<Room>();
+        }
+    }
+
+    // otherwise make a new room (replacing any expired entry)
+    std::shared_ptr<Room> room(new Room(room_name, log, m_rate_limit, m_cluster,
+                                        log ? this : nullptr),
+                               Reclaimer{ this });
+    shard.rooms[room_name] = room;
+    if (log && log->next_offset() > 0) {
+        shard.logged.push_back(room);
+    }
+    return room;
+}
+
+void RoomDirectory::keep(Room *room) {
+    Shard &shard = shard_for(room->get_room_name());
+    Guard g(shard.lock);
+
+    // whoever is logging into it holds it, so its entry is still there
+    RoomMap::iterator it = shard.rooms.find(room->get_room_name());
+    if (it != shard.rooms.end()) {
+        std::shared_ptr<Room> kept = it->second.lock();
+        if (kept.get() == room) {
+            shard.logged.push_back(kept);
+        }
+    }
+}
+
+void RoomDirectory::reclaim(Room *room) {
+    {
+        Shard &shard = shard_for(room->get_room_name());
+        Guard g(shard.lock);
+
+        // a join may already have replaced our expired entry with a
+        // new room of the same name, leave that one alone
+        RoomMap::iterator it = shard.rooms.find(room->get_room_name());
+        if (it != shard.rooms.end() && it->second.expired()) {
+            shard.rooms.erase(it);
+        }
+    }
+
+    delete room;
+}
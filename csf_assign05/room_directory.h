@@ -0,0 +1,75 @@
+#ifndef ROOM_DIRECTORY_H
+#define ROOM_DIRECTORY_H
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include "rate_limiter.h"
+class Room;
+class Cluster;
+
+// Concurrent map from room name to Room, split into independently
+// locked shards so joins to different rooms don't contend on one
+// global lock. A join only locks the shard its room name hashes to.
+//
+// Rooms are handed out as shared_ptrs (held by receivers in the room
+// and senders that joined it); the directory itself only keeps a
+// weak_ptr. When the last holder lets go, the room's deleter removes
+// its entry from the shard and frees it, so empty rooms don't pile up.
+// A later join to the same name just creates a fresh room.
+//
+// With a log directory set, every room gets a durable log (see
+// room_log.h). Once something has been logged, the room stays in the
+// directory for good, so its log stays open, isn't recovered again on
+// the next join and is only ever written by the one RoomLog. Until
+// then the log has no files, and the room comes and goes like any.
+class RoomDirectory {
+public:
+  RoomDirectory();
+  ~RoomDirectory();
+
+  // give rooms created from now on a log under dir
+  void set_log_dir(const std::string &dir) { m_log_dir = dir; }
+
+  // and a limit on how fast messages may be broadcast into them
+  void set_rate_limit(const RateLimit &limit) { m_rate_limit = limit; }
+
+  // and tell cluster about their receivers coming and going
+  void set_cluster(Cluster *cluster) { m_cluster = cluster; }
+
+  // null (with errno set) if the room's log couldn't be opened
+  std::shared_ptr<Room> find_or_create(const std::string &room_name);
+
+  // hold on to room from now on, its log has records (see above)
+  void keep(Room *room);
+
+private:
+  // value semantics prohibited
+  RoomDirectory(const RoomDirectory &);
+  RoomDirectory &operator=(const RoomDirectory &);
+
+  static const unsigned NUM_SHARDS = 64; // must be a power of 2
+
+  typedef std::unordered_map<std::string, std::weak_ptr<Room> > RoomMap;
+
+  struct Shard {
+    pthread_mutex_t lock; // must be held while accessing rooms
+    RoomMap rooms;
+    std::vector<std::shared_ptr<Room> > logged; // kept, never reclaimed
+    char pad[64];         // keep neighbouring shard locks apart
+  };
+
+  struct Reclaimer; // shared_ptr deleter for rooms, see room_directory.cpp
+
+  Shard &shard_for(const std::string &room_name);
+  void reclaim(Room *room);
+
+  Shard m_shards[NUM_SHARDS];
+  std::string m_log_dir; // empty = rooms aren't logged
+  RateLimit m_rate_limit;
+  Cluster *m_cluster;    // null = no peers
+};
+
+#endif // ROOM_DIRECTORY_H
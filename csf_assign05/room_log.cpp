@@ -0,0 +1,665 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "csapp.h"
+#include "guard.h"
+#include "room_log.h"
+
+namespace {
+
+// the first segment of a log is small, and each one after it twice
+// the size of the last, up to the max: a quiet room takes up little
+// disk, and a busy one soon rolls over rarely
+const size_t FIRST_SEGMENT_SIZE = 64 * 1024;
+const size_t MAX_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+// every record starts with one of these, and is padded to a multiple
+// of its alignment; size 0 (preallocated space) marks the end
+struct RecordHeader {
+    uint32_t size;       // whole record, header and padding included
+    uint32_t sender_len;
+    uint32_t text_len;
+    uint32_t check;      // over the lengths and the data
+};
+
+size_t record_size(size_t sender_len, size_t text_len) {
+    size_t align = alignof(RecordHeader);
+    return (sizeof(RecordHeader) + sender_len + text_len + align - 1) & ~(align - 1);
+}
+
+// FNV-1a, enough to tell a torn or stale record from a real one
+uint32_t checksum(uint32_t sender_len, uint32_t text_len, const char *data) {
+    uint32_t h = 2166136261u;
+    const uint32_t lens[2] = { sender_len, text_len };
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(lens);
+    for (size_t i = 0; i < sizeof(lens); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    p = reinterpret_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size_t(sender_len) + text_len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+bool valid_record(const RecordHeader *h, size_t room) {
+    return h->size != 0 && h->size <= room &&
+           h->size == record_size(h->sender_len, h->text_len) &&
+           h->check == checksum(h->sender_len, h->text_len,
+                                reinterpret_cast<const char *>(h + 1));
+}
+
+// the size of the segment after one of prev bytes (0 = the first),
+// made bigger if need be to fit a record of need bytes
+size_t segment_size(size_t prev, size_t need) {
+    size_t size = prev == 0 ? FIRST_SEGMENT_SIZE : std::min(prev * 2, MAX_SEGMENT_SIZE);
+    while (size < need) {
+        size += FIRST_SEGMENT_SIZE;
+    }
+    return size;
+}
+
+// a room name as a directory name: anything that could be a path
+// separator, hidden or otherwise awkward becomes %xx
+std::string dir_name(const std::string &room_name) {
+    std::string name;
+    for (unsigned char ch : room_name) {
+        if (std::isalnum(ch) || ch == '-' || ch == '_' || (ch == '.' && !name.empty())) {
+            name += ch;
+        } else {
+            char hex[4];
+            std::snprintf(hex, sizeof(hex), "%%%02x", ch);
+            name += hex;
+        }
+    }
+    return name.empty() ? "%" : name;
+}
+
+std::string segment_path(const std::string &dir, uint64_t base) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%020llu.log",
+                  static_cast<unsigned long long>(base));
+    return dir + name;
+}
+
+// where the next segment waits until the tail fills up; not named like
+// a segment, so recovery never takes it for one
+std::string spare_path(const std::string &dir) {
+    return dir + "/spare";
+}
+
+// every open log, for the log thread; it pins the ones it's working
+// on, and a log being closed waits for that (rather than the thread
+// holding the lock, and so keeping logs from opening, through a whole
+// pass of fsyncs)
+struct Registered {
+    bool pinned;   // the log thread is working on it
+    bool closing;  // being closed, the log thread leaves it alone
+};
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t registry_cond = PTHREAD_COND_INITIALIZER;
+std::unordered_map<RoomLog *, Registered> registry;
+unsigned sync_interval_ms;
+
+// set when a log has rolling over for the log thread to do, so it
+// doesn't wait for the next sync (or, with no syncs, forever)
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+bool work_pending;
+
+void wake_log_thread() {
+    Guard g(work_lock);
+    work_pending = true;
+    pthread_cond_signal(&work_cond);
+}
+
+void *log_thread(void *) {
+    pthread_detach(pthread_self());
+
+    for (;;) {
+        {
+            Guard g(work_lock);
+            if (sync_interval_ms == 0) {
+                while (!work_pending) {
+                    pthread_cond_wait(&work_cond, &work_lock);
+                }
+            } else if (!work_pending) {
+                timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_sec += sync_interval_ms / 1000;
+                until.tv_nsec += long(sync_interval_ms % 1000) * 1000000;
+                if (until.tv_nsec >= 1000000000) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&work_cond, &work_lock, &until);
+            }
+            work_pending = false;
+        }
+
+        std::vector<RoomLog *> logs;
+        {
+            Guard g(registry_lock);
+            for (auto &entry : registry) {
+                if (!entry.second.closing) {
+                    entry.second.pinned = true;
+                    logs.push_back(entry.first);
+                }
+            }
+        }
+
+        // pinned logs can't go away, and logs can open (and others
+        // close) meanwhile
+        for (RoomLog *log : logs) {
+            log->prepare_roll();
+            if (sync_interval_ms > 0) {
+                log->sync();
+            }
+            Guard g(registry_lock);
+            registry.at(log).pinned = false;
+            pthread_cond_broadcast(&registry_cond);
+        }
+    }
+    return nullptr;
+}
+
+} // anonymous namespace
+
+struct RoomLog::Segment {
+    uint64_t base;   // offset of its first record
+    int fd;
+    size_t size;     // of the file
+    char *map;       // all of it, while it's the tail or being read
+    size_t used;     // bytes taken by records
+    std::vector<uint32_t> index; // where each record starts
+    unsigned readers; // cursors that have it pinned
+    bool sealed;     // rolled away from and written out
+
+    Segment()
+        : base(0), fd(-1), size(0), map(nullptr), used(0), readers(0), sealed(false) { }
+
+    ~Segment() {
+        unmap();
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    bool create(const std::string &path, size_t file_size);
+    bool load(const std::string &path);
+
+    void unmap() {
+        if (map) {
+            munmap(map, size);
+            map = nullptr;
+        }
+    }
+};
+
+// a new, empty segment file of file_size bytes at path, mapped
+bool RoomLog::Segment::create(const std::string &path, size_t file_size) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    // reserve the blocks now, so running out of disk shows up here
+    // and not as a SIGBUS in the middle of an append
+    int rc = posix_fallocate(fd, 0, file_size);
+    if (rc == 0) {
+        void *p = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            map = static_cast<char *>(p);
+            size = file_size;
+            return true;
+        }
+        rc = errno;
+    }
+    unlink(path.c_str());
+    errno = rc;
+    return false;
+}
+
+// an existing segment file, mapped and indexed up to the first record
+// that isn't whole; one too short to hold any is left unmapped
+bool RoomLog::Segment::load(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        return false;
+    }
+    if (size_t(st.st_size) < sizeof(RecordHeader)) {
+        return true;
+    }
+
+    void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    map = static_cast<char *>(p);
+    size = st.st_size;
+
+    while (used + sizeof(RecordHeader) <= size) {
+        const RecordHeader *h = reinterpret_cast<const RecordHeader *>(map + used);
+        if (!valid_record(h, size - used)) {
+            break;
+        }
+        index.push_back(used);
+        used += h->size;
+    }
+    return true;
+}
+
+RoomLog *RoomLog::open(const std::string &dir, const std::string &room_name) {
+    // the directories are only made for the first append
+    RoomLog *log = new RoomLog(dir + "/" + dir_name(room_name), room_name);
+    if (!log->recover()) {
+        int saved = errno;
+        delete log;
+        errno = saved;
+        return nullptr;
+    }
+
+    Guard g(registry_lock);
+    registry[log] = Registered{ false, false };
+    return log;
+}
+
+void RoomLog::start_log_thread(unsigned interval_ms) {
+    sync_interval_ms = interval_ms;
+    pthread_t tid;
+    Pthread_create(&tid, nullptr, log_thread, nullptr);
+}
+
+RoomLog::RoomLog(const std::string &dir, const std::string &room_name)
+    : m_dir(dir), m_room_name(room_name), m_spare(nullptr), m_want_spare(false),
+      m_next(0), m_dirty(false) {
+    pthread_mutex_init(&m_lock, nullptr);
+}
+
+RoomLog::~RoomLog() {
+    {
+        // (one that failed to open never got registered)
+        Guard g(registry_lock);
+        if (registry.count(this)) {
+            registry.at(this).closing = true;
+            while (registry.at(this).pinned) {
+                pthread_cond_wait(&registry_cond, &registry_lock);
+            }
+            registry.erase(this);
+        }
+    }
+
+    // whatever the log thread didn't get to
+    sync();
+    for (Segment *seg : m_full) {
+        fdatasync(seg->fd);
+    }
+    if (m_spare) {
+        delete m_spare;
+        unlink(spare_path(m_dir).c_str());
+    }
+    for (Segment *seg : m_segments) {
+        delete seg;
+    }
+    pthread_mutex_destroy(&m_lock);
+}
+
+bool RoomLog::recover() {
+    DIR *d = opendir(m_dir.c_str());
+    if (!d) {
+        return errno == ENOENT;  // nothing logged yet
+    }
+
+    // segment files are <20-digit base offset>.log
+    std::vector<uint64_t> bases;
+    while (dirent *ent = readdir(d)) {
+        unsigned long long base;
+        char rest[8];
+        if (strlen(ent->d_name) == 24 &&
+            sscanf(ent->d_name, "%20llu%7s", &base, rest) == 2 &&
+            strcmp(rest, ".log") == 0) {
+            bases.push_back(base);
+        }
+    }
+    closedir(d);
+    std::sort(bases.begin(), bases.end());
+
+    // left over from before a crash
+    unlink(spare_path(m_dir).c_str());
+
+    for (size_t i = 0; i < bases.size(); i++) {
+        Segment *seg = nullptr;
+        if (bases[i] == m_next) {
+            seg = new Segment;
+            seg->base = bases[i];
+            if (!seg->load(segment_path(m_dir, bases[i]))) {
+                int saved = errno;
+                delete seg;
+                errno = saved;
+                return false;
+            }
+        }
+        if (!seg || !seg->map) {
+            // a segment ended early (torn write) or was never filled
+            // in, the ones after it no longer follow on from it
+            delete seg;
+            std::fprintf(stderr, "room log %s: discarding records from offset %llu on\n",
+                         m_dir.c_str(), static_cast<unsigned long long>(bases[i]));
+            for (; i < bases.size(); i++) {
+                unlink(segment_path(m_dir, bases[i]).c_str());
+            }
+            break;
+        }
+
+        // only the tail stays mapped
+        if (!m_segments.empty()) {
+            m_segments.back()->unmap();
+            m_segments.back()->sealed = true;
+        }
+        m_segments.push_back(seg);
+        m_next = seg->base + seg->index.size();
+    }
+    return true;
+}
+
+bool RoomLog::roll(size_t need) {
+    // m_lock is held
+    Segment *tail = m_segments.empty() ? nullptr : m_segments.back();
+    if (!tail) {
+        // the first record: only now does the log get a directory
+        std::string parent = m_dir.substr(0, m_dir.rfind('/'));
+        if ((mkdir(parent.c_str(), 0755) < 0 && errno != EEXIST) ||
+            (mkdir(m_dir.c_str(), 0755) < 0 && errno != EEXIST)) {
+            return false;
+        }
+    }
+
+    // normally the log thread has the next segment ready by now
+    std::string path = segment_path(m_dir, m_next);
+    Segment *next = m_spare;
+    m_spare = nullptr;
+    if (next && (next->size < need || rename(spare_path(m_dir).c_str(), path.c_str()) < 0)) {
+        delete next;
+        unlink(spare_path(m_dir).c_str());
+        next = nullptr;
+    }
+    if (!next) {
+        next = new Segment;
+        if (!next->create(path, segment_size(tail ? tail->size : 0, need))) {
+            int saved = errno;
+            delete next;
+            errno = saved;
+            return false;
+        }
+    }
+    next->base = m_next;
+
+    if (tail && tail->index.empty()) {
+        // nothing in it (a message too big for it came first), the new
+        // segment has the same name and takes its place
+        m_segments.pop_back();
+        delete tail;
+    } else if (tail) {
+        // never appended to again: the log thread writes it out
+        m_full.push_back(tail);
+        wake_log_thread();
+    }
+    m_segments.push_back(next);
+    m_want_spare = false;
+    return true;
+}
+
+void RoomLog::prepare_roll() {
+    std::vector<Segment *> full;
+    size_t spare_size = 0;
+    {
+        Guard g(m_lock);
+        full.swap(m_full);
+        if (m_want_spare && !m_spare) {
+            spare_size = segment_size(m_segments.back()->size, 0);
+        }
+    }
+
+    // segments stay open until the log closes, and nothing appends to
+    // these any more; replays still reading one keep it mapped, but
+    // only for reading now, and the last of them unmaps it
+    for (Segment *seg : full) {
+        fdatasync(seg->fd);
+    }
+    std::vector<std::pair<char *, size_t> > unmap;
+    {
+        Guard g(m_lock);
+        for (Segment *seg : full) {
+            seg->sealed = true;
+            if (seg->readers == 0) {
+                unmap.emplace_back(seg->map, seg->size);
+                seg->map = nullptr;
+            } else {
+                mprotect(seg->map, seg->size, PROT_READ);
+            }
+        }
+    }
+    for (const auto &m : unmap) {
+        munmap(m.first, m.second);
+    }
+
+    if (spare_size != 0) {
+        Segment *spare = new Segment;
+        if (!spare->create(spare_path(m_dir), spare_size)) {
+            delete spare;  // the append that needs it will try itself
+            return;
+        }
+        Guard g(m_lock);
+        m_spare = spare;
+        m_want_spare = false;
+    }
+}
+
+uint64_t RoomLog::next_offset() {
+    Guard g(m_lock);
+    return m_next;
+}
+
+bool RoomLog::append(std::string_view sender, std::string_view text) {
+    size_t size = record_size(sender.size(), text.size());
+
+    Guard g(m_lock);
+    if (m_segments.empty() || m_segments.back()->used + size > m_segments.back()->size) {
+        if (!roll(size)) {
+            return false;
+        }
+    }
+
+    Segment *seg = m_segments.back();
+    char *p = seg->map + seg->used;
+    RecordHeader h;
+    h.size = size;
+    h.sender_len = sender.size();
+    h.text_len = text.size();
+    memcpy(p + sizeof(h), sender.data(), sender.size());
+    memcpy(p + sizeof(h) + sender.size(), text.data(), text.size());
+    h.check = checksum(h.sender_len, h.text_len, p + sizeof(h));
+    memcpy(p, &h, sizeof(h));
+
+    seg->index.push_back(seg->used);
+    seg->used += size;
+    m_next++;
+    m_dirty = true;
+
+    // half full: time to get the next segment ready
+    if (!m_spare && !m_want_spare && seg->used > seg->size / 2) {
+        m_want_spare = true;
+        wake_log_thread();
+    }
+    return true;
+}
+
+RoomLog::Cursor::Cursor(Cursor &&other)
+    : offset(other.offset), end(other.end), segment(other.segment), pos(other.pos),
+      seg_end(other.seg_end), log(other.log), data(other.data), size(other.size) {
+    other.data = nullptr;
+}
+
+RoomLog::Cursor &RoomLog::Cursor::operator=(Cursor &&other) {
+    if (this != &other) {
+        if (data) {
+            log->finish(*this);
+        }
+        offset = other.offset;
+        end = other.end;
+        segment = other.segment;
+        pos = other.pos;
+        seg_end = other.seg_end;
+        log = other.log;
+        data = other.data;
+        size = other.size;
+        other.data = nullptr;
+    }
+    return *this;
+}
+
+RoomLog::Cursor::~Cursor() {
+    if (data) {
+        log->finish(*this);
+    }
+}
+
+RoomLog::Cursor RoomLog::cursor(uint64_t from, uint64_t end) {
+    Guard g(m_lock);
+    Cursor c;
+    c.log = this;
+    c.end = std::min(end, m_next);
+    c.offset = std::min(from, c.end);
+    if (m_segments.empty()) {
+        return c;  // nothing logged, so done already
+    }
+
+    // the last segment starting at or before offset (pinned by the
+    // first read)
+    size_t i = m_segments.size() - 1;
+    while (i > 0 && m_segments[i]->base > c.offset) {
+        i--;
+    }
+    seek(c, i);
+    return c;
+}
+
+void RoomLog::seek(Cursor &c, size_t segment) {
+    // m_lock is held
+    const Segment *seg = m_segments[segment];
+    size_t i = c.offset - seg->base;
+    c.segment = segment;
+    c.pos = i < seg->index.size() ? seg->index[i] : seg->used;
+    c.seg_end = segment + 1 < m_segments.size() ? m_segments[segment + 1]->base : UINT64_MAX;
+}
+
+bool RoomLog::pin(Cursor &c) {
+    // m_lock is held
+    Segment *seg = m_segments[c.segment];
+    if (!seg->map) {
+        // sealed, and no one else is reading it
+        void *p = mmap(nullptr, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        seg->map = static_cast<char *>(p);
+    }
+    seg->readers++;
+    c.data = seg->map;
+    c.size = seg->size;
+    return true;
+}
+
+char *RoomLog::unpin(Cursor &c) {
+    // m_lock is held; returns the mapping for the caller to munmap (of
+    // c.size bytes) once it's let go of the lock, if c was the last
+    // reader of a sealed segment
+    Segment *seg = m_segments[c.segment];
+    c.data = nullptr;
+    if (--seg->readers > 0 || !seg->sealed) {
+        return nullptr;
+    }
+    char *map = seg->map;
+    seg->map = nullptr;
+    return map;
+}
+
+void RoomLog::finish(Cursor &c) {
+    if (!c.data) {
+        return;
+    }
+    char *unmap;
+    {
+        Guard g(m_lock);
+        unmap = unpin(c);
+    }
+    if (unmap) {
+        munmap(unmap, c.size);
+    }
+}
+
+bool RoomLog::read(Cursor &c, std::string_view &sender, std::string_view &text) {
+    if (c.done()) {
+        return false;
+    }
+    if (!c.data || c.offset >= c.seg_end) {
+        char *unmap = nullptr;
+        size_t unmap_size = c.size;
+        bool pinned;
+        {
+            Guard g(m_lock);
+            if (c.data) {
+                unmap = unpin(c);
+            }
+            if (c.offset >= c.seg_end) {
+                seek(c, c.segment + 1);
+            }
+            pinned = pin(c);
+        }
+        if (unmap) {
+            munmap(unmap, unmap_size);
+        }
+        if (!pinned) {
+            std::fprintf(stderr, "room log %s: can't map the segment of offset %llu, "
+                         "replay cut short\n",
+                         m_dir.c_str(), static_cast<unsigned long long>(c.offset));
+            c.end = c.offset;
+            return false;
+        }
+    }
+
+    // below end, so written in full before the cursor was made
+    const RecordHeader *h = reinterpret_cast<const RecordHeader *>(c.data + c.pos);
+    const char *data = reinterpret_cast<const char *>(h + 1);
+    sender = std::string_view(data, h->sender_len);
+    text = std::string_view(data + h->sender_len, h->text_len);
+    c.pos += h->size;
+    c.offset++;
+    return true;
+}
+
+void RoomLog::sync() {
+    int fd;
+    {
+        Guard g(m_lock);
+        if (!m_dirty) {
+            return;
+        }
+        m_dirty = false;
+        fd = m_segments.back()->fd;
+    }
+
+    // segments are only closed when the log is, so fd stays good
+    fdatasync(fd);
+}
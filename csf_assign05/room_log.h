@@ -0,0 +1,135 @@
+#ifndef ROOM_LOG_H
+#define ROOM_LOG_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+
+// Durable, append-only log of everything broadcast into one room, so
+// a receiver can catch up on what it missed. Every message gets an
+// offset (0, 1, 2, ... in broadcast order), and a receiver that
+// rejoins with the offset it got to is replayed the rest before going
+// live.
+//
+// The log is a directory of segment files, each named after the
+// offset of its first record. Nothing is created until the first
+// append, and segments start small and double in size from one to the
+// next (up to a cap), so a room that sees little traffic takes up
+// little disk. A segment is allocated in full up front, and the one
+// being appended to (the tail) is mapped shared: an append is a
+// memcpy into the mapping. Replays read records straight out of the
+// mappings too: a segment the log has moved on from gets mapped again,
+// read-only, while any replay is in it. Nothing is fsync'ed per message: one background thread
+// fdatasyncs every log that changed once per sync interval, so all
+// the appends of that interval share one disk flush (group commit). A
+// crash loses at most the last interval; on reopen every record is
+// checked and the log ends at the first torn one.
+//
+// Rolling over to a new segment is kept off the append path too: once
+// the tail is half full the background thread makes the next segment
+// ready, and when the tail fills up it syncs and unmaps it (or, if a
+// replay is reading it, leaves it mapped read-only). An append only
+// creates a segment itself for the first record, or when the thread
+// hasn't caught up.
+//
+// Appends must be serialized by the caller (Room does, under its
+// lock). Readers may run concurrently with appends, from any thread.
+class RoomLog {
+public:
+  // A reader's position. Only records below end get read, and those
+  // were complete when the cursor was made. A cursor pins the segment
+  // it's reading (keeps it mapped) until it moves on or is finished,
+  // so it can be moved but not copied.
+  struct Cursor {
+    uint64_t offset;   // next record to read
+    uint64_t end;      // stop here
+    size_t segment;    // index of the segment offset is in
+    size_t pos;        // where in it the record starts
+    uint64_t seg_end;  // first offset past that segment
+    RoomLog *log;      // the log it reads
+    const char *data;  // the segment's mapping, while pinned
+    size_t size;       // of the mapping
+
+    Cursor()
+      : offset(0), end(0), segment(0), pos(0), seg_end(0), log(nullptr),
+        data(nullptr), size(0) { }
+    Cursor(Cursor &&other);
+    Cursor &operator=(Cursor &&other);
+    ~Cursor();
+
+    bool done() const { return offset >= end; }
+  };
+
+  // Open (and recover) the log of room_name under dir, if it has one
+  // yet. Returns nullptr with errno set on failure.
+  static RoomLog *open(const std::string &dir, const std::string &room_name);
+
+  // Start the thread that rolls segments over and syncs every open
+  // log every sync_interval_ms (covering logs opened before the call
+  // too). With an interval of 0, the tail is only synced when it fills
+  // up and when the log is closed.
+  static void start_log_thread(unsigned sync_interval_ms);
+
+  ~RoomLog();
+
+  const std::string &get_room_name() const { return m_room_name; }
+
+  // offset the next append gets
+  uint64_t next_offset();
+
+  // Append a message. Returns false (with errno set) if it couldn't
+  // be written, e.g. no room for a new segment.
+  bool append(std::string_view sender, std::string_view text);
+
+  // a cursor over [from, end), from clamped to what the log has
+  Cursor cursor(uint64_t from, uint64_t end);
+
+  // next record at c (false once c is done, or if the log couldn't
+  // be read, which ends c); the views point into the segment's mapping
+  // and stay valid until the next read or finish of c
+  bool read(Cursor &c, std::string_view &sender, std::string_view &text);
+
+  // unpin the segment c is on (a done cursor keeps it pinned for the
+  // views its last read gave out, until this or until it goes away)
+  void finish(Cursor &c);
+
+  // write out everything appended to the tail so far (full segments
+  // are prepare_roll's)
+  void sync();
+
+  // the log thread's part in rolling over: write out and unmap
+  // segments that filled up, and get the next one ready
+  void prepare_roll();
+
+private:
+  struct Segment;
+
+  RoomLog(const std::string &dir, const std::string &room_name);
+
+  // prohibit value semantics
+  RoomLog(const RoomLog &);
+  RoomLog &operator=(const RoomLog &);
+
+  bool recover();
+  bool roll(size_t record_size);
+  void seek(Cursor &c, size_t segment);
+  bool pin(Cursor &c);
+  char *unpin(Cursor &c);
+
+  std::string m_dir;
+  std::string m_room_name;
+
+  // held while segments, their indexes or the members below change
+  pthread_mutex_t m_lock;
+  std::vector<Segment *> m_segments; // by base offset, last one is the tail
+  std::vector<Segment *> m_full;     // rolled away from, not yet written out
+  Segment *m_spare;                  // the next segment, if made ready
+  bool m_want_spare;                 // the log thread should make one
+  uint64_t m_next;                   // offset of the next append
+  bool m_dirty;                      // appended to since the last sync
+};
+
+#endif // ROOM_LOG_H
@@ -1,6 +1,16 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "message.h"
 #include "connection.h"
 #include "client_util.h"
@@ -13,7 +23,7 @@ using std::getline;
 using std::istringstream;
 using std::stoi;
 
-static Message interpret(const string &line, bool &ok) {
+static Message interpret(const string &line, size_t max_len, bool &ok) {
     Message m;
     ok = true;
 
@@ -42,6 +52,26 @@ static Message interpret(const string &line, bool &ok) {
             return m;
         }
 
+        if (c == 's' && cmd == "/senduser") {
+            // the rest of the line after the username is the message
+            string to, text;
+            ss >> to;
+            getline(ss >> std::ws, text);
+            if (to.empty() || to.find(':') != string::npos || text.empty()) {
+                cerr << "Usage: /senduser <username> <message>\n";
+                ok = false;
+                return m;
+            }
+            if (text.size() > max_len) {
+                cerr << "Message exceeds max length\n";
+                ok = false;
+                return m;
+            }
+            m.tag = TAG_SENDUSER;
+            m.data = to + ":" + text;
+            return m;
+        }
+
         if (c == 'l' && cmd == "/leave") {
             m.tag = TAG_LEAVE;
             m.data = "";
@@ -54,7 +84,7 @@ static Message interpret(const string &line, bool &ok) {
     }
 
     // normal message
-    if (line.size() > Message::MAX_LEN) {
+    if (line.size() > max_len) {
         cerr << "Message exceeds max length\n";
         ok = false;
     } else {
@@ -65,18 +95,221 @@ static Message interpret(const string &line, bool &ok) {
     return m;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        cerr << "Usage: ./sender [server_address] [port] [username]\n";
+static void usage() {
+    cerr << "Usage: ./sender [-b] [-w window] [replay options] [server_address] [port] [username]\n"
+            "       ./sender [-b] [-w window] [replay options] -u [socket_path] [username]\n"
+            "Replay options:\n"
+            "  -r <file>     send the commands in file (one per line, like stdin)\n"
+            "                instead of reading stdin, pipelined (-w defaults to\n"
+            "                256), and report the throughput\n"
+            "  -t            every line starts with a timestamp in seconds (e.g.\n"
+            "                \"17.250 hello\"): send it that long after the first\n"
+            "  -x <speed>    with -t, replay this many times faster (0 = as fast as\n"
+            "                possible; default 1)\n";
+    exit(1);
+}
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Split a "<seconds> <rest>" line. The file is mapped, not a C string,
+// so this doesn't go past the end of line (strtod could).
+static bool parse_timestamp(std::string_view &line, double &seconds) {
+    size_t i = 0;
+    double whole = 0, scale = 1, frac = 0;
+    bool digits = false;
+    while (i < line.size() && line[i] >= '0' && line[i] <= '9') {
+        whole = whole * 10 + (line[i++] - '0');
+        digits = true;
+    }
+    if (i < line.size() && line[i] == '.') {
+        i++;
+        while (i < line.size() && line[i] >= '0' && line[i] <= '9') {
+            scale /= 10;
+            frac += (line[i++] - '0') * scale;
+            digits = true;
+        }
+    }
+    if (!digits || (i < line.size() && line[i] != ' ' && line[i] != '\t')) {
+        return false;
+    }
+
+    seconds = whole + frac;
+    line.remove_prefix(i < line.size() ? i + 1 : i);
+    return true;
+}
+
+// Replay mode: send every line of the file at path through out, at
+// full speed or (timed) on the file's own schedule, then report how
+// fast it went. Message lines go out straight from the mapping, only
+// commands are parsed like stdin's.
+static int replay(PipelinedSender &out, const char *path, bool timed, double speed,
+                  size_t max_len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        cerr << "Could not open " << path << "\n";
         return 1;
     }
+    size_t size = st.st_size;
+    const char *file = nullptr;
+    if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            cerr << "Could not map " << path << "\n";
+            return 1;
+        }
+        madvise(p, size, MADV_SEQUENTIAL);
+        file = static_cast<const char *>(p);
+    }
+    close(fd);
+
+    uint64_t start = now_ns();
+    uint64_t max_lag = 0;    // furthest behind schedule, in ns
+    double first_ts = -1;
+    size_t sent = 0, bytes = 0, skipped = 0;
+    bool quit = false;
+
+    for (size_t pos = 0; pos < size && !quit; ) {
+        const char *nl = static_cast<const char *>(memchr(file + pos, '\n', size - pos));
+        size_t end = nl ? nl - file : size;
+        std::string_view line(file + pos, end - pos);
+        pos = end + 1;
+        while (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
+            continue;
+        }
+
+        if (timed) {
+            double ts;
+            if (!parse_timestamp(line, ts)) {
+                skipped++;
+                continue;
+            }
+            if (first_ts < 0) {
+                first_ts = ts;
+            }
+
+            // Due later: put what's queued on the wire and sleep till
+            // then. Due already (or at full speed): just queue it.
+            if (speed > 0) {
+                uint64_t due = start + uint64_t((ts - first_ts) / speed * 1e9);
+                uint64_t now = now_ns();
+                if (due > now) {
+                    if (!out.flush()) {
+                        cerr << "Failed to send message\n";
+                        return 1;
+                    }
+                    timespec t;
+                    t.tv_sec = due / 1000000000;
+                    t.tv_nsec = due % 1000000000;
+                    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, nullptr) != 0) {
+                    }
+                } else if (now - due > max_lag) {
+                    max_lag = now - due;
+                }
+            }
+        }
+        if (line.empty()) {
+            continue;
+        }
+
+        bool ok = true;
+        if (line[0] != '/') {
+            // a message, the common case: no copy before the frame
+            if (line.size() > max_len) {
+                cerr << "Message exceeds max length\n";
+                skipped++;
+                continue;
+            }
+            ok = out.send(TAG_SENDALL, line);
+            bytes += line.size();
+        } else {
+            Message cmd = interpret(string(line), max_len, ok);
+            if (!ok) {
+                skipped++;
+                continue;
+            }
+            ok = out.send(cmd);
+            quit = cmd.tag == TAG_QUIT;
+        }
+        if (!ok) {
+            cerr << "Failed to send message\n";
+            return 1;
+        }
+        sent++;
+    }
 
-    string host   = argv[1];
-    int port      = stoi(argv[2]);
-    string user   = argv[3];
+    // it's only done once the server has acked everything
+    bool drained = out.drain();
+    double secs = (now_ns() - start) / 1e9;
+    if (size > 0) {
+        munmap(const_cast<char *>(file), size);
+    }
+
+    std::fprintf(stderr,
+                 "replayed %zu commands (%zu message bytes) in %.3f s: %.0f commands/s,"
+                 " %.2f MB/s; %zu errors, %zu lines skipped",
+                 sent, bytes, secs, secs > 0 ? sent / secs : 0.0,
+                 secs > 0 ? bytes / secs / 1e6 : 0.0, out.errors(), skipped);
+    if (timed && speed > 0) {
+        std::fprintf(stderr, "; at most %.1f ms behind schedule", max_lag / 1e6);
+    }
+    std::fprintf(stderr, "\n");
+    return drained ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    // -b: ask for binary framing, which lifts the line length limit
+    // -w: how many commands may be waiting for a reply (default 1,
+    //     i.e. wait for each reply; more is for piped-in scripts)
+    // -u: connect to the server's UNIX domain socket instead of TCP
+    // -r/-t/-x: replay a file instead (see usage)
+    bool binary = false;
+    size_t window = 0;
+    string unix_path;
+    string replay_path;
+    bool timed = false;
+    double speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "bw:u:r:tx:")) != -1) {
+        if (opt == 'r') {
+            replay_path = optarg;
+        } else if (opt == 't') {
+            timed = true;
+        } else if (opt == 'x' && atof(optarg) >= 0) {
+            speed = atof(optarg);
+        } else if (opt == 'b') {
+            binary = true;
+        } else if (opt == 'w' && atoi(optarg) > 0) {
+            window = atoi(optarg);
+        } else if (opt == 'u') {
+            unix_path = optarg;
+        } else {
+            usage();
+        }
+    }
+
+    if (argc - optind != (unix_path.empty() ? 3 : 1) || (timed && replay_path.empty())) {
+        usage();
+    }
+    if (window == 0) {
+        window = replay_path.empty() ? 1 : 256;
+    }
+
+    string user   = argv[argc - 1];
 
     Connection conn;
-    conn.connect(host, port);
+    if (unix_path.empty()) {
+        conn.connect(argv[optind], stoi(argv[optind + 1]));
+    } else {
+        conn.connect_unix(unix_path);
+    }
 
     if (!conn.is_open()) {
         cerr << "Failed to connect to server\n";
@@ -84,26 +317,20 @@ int main(int argc, char *argv[]) {
     }
 
     // login
-    Message login(TAG_SLOGIN, user);
-    if (!conn.send(login)) {
-        cerr << "Failed to send login message\n";
+    if (!client_login(conn, TAG_SLOGIN, user, binary)) {
         return 1;
     }
 
-    Message loginReply;
-    if (!conn.receive(loginReply)) {
-        cerr << loginReply.data;
-        return 1;
-    }
+    // leave room for the "delivery:room:sender:" the server adds
+    size_t max_len = conn.get_format() == WIRE_BINARY
+        ? Message::MAX_FRAME_LEN - 1024 : Message::MAX_LEN;
 
-    if (loginReply.tag == TAG_ERR) {
-        cerr << loginReply.data << "\n";
-        return 1;
-    }
+    // errors come back in the same order the commands went out
+    PipelinedSender out(conn, window);
+    out.on_error([](std::string_view error) { cerr << error << "\n"; });
 
-    if (loginReply.tag != TAG_OK) {
-        cerr << loginReply.tag << "\n";
-        return 1;
+    if (!replay_path.empty()) {
+        return replay(out, replay_path.c_str(), timed, speed, max_len);
     }
 
     // main loop
@@ -115,29 +342,23 @@ int main(int argc, char *argv[]) {
         if (line.empty()) continue;
 
         bool ok = true;
-        Message outgoing = interpret(line, ok);
+        Message outgoing = interpret(line, max_len, ok);
         if (!ok) continue;
 
-        if (!conn.send(outgoing)) {
+        // on the wire right away, but only wait for replies once the
+        // window is full
+        if (!out.send(outgoing) || !out.flush() ||
+            (out.in_flight() >= window && !out.drain())) {
             cerr << "Failed to send message\n";
-            continue;
-        }
-
-        Message serverResp;
-        if (!conn.receive(serverResp)) {
-            cerr << serverResp.data << "\n";
-            continue;
-        }
-
-        if (serverResp.tag == TAG_ERR) {
-            cerr << serverResp.data << "\n";
-            continue;
+            return 1;
         }
 
-        if (outgoing.tag == TAG_QUIT && serverResp.tag == TAG_OK) {
-            return 0;
+        if (outgoing.tag == TAG_QUIT) {
+            // the last reply is the quit's ok
+            return out.drain() ? 0 : 1;
         }
     }
 
+    out.drain();
     return 0;
 }
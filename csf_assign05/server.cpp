@@ -1,12 +1,33 @@
 #include <pthread.h>
+#include <sched.h>
+#include <memory>
+#include <vector>
+#include <string>
+#include <poll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
 #include <cctype>
+#include <cstdio>
+#include <cstring>
 #include <cassert>
 
 #include "message.h"
+#include "pool.h"
+#include "metrics.h"
+#include "frame.h"
+#include "shm_ring.h"
 #include "connection.h"
+#include "coro.h"
 #include "user.h"
 #include "room.h"
-#include "guard.h"
+#include "room_log.h"
+#include "session.h"
+#include "reactor.h"
 #include "server.h"
 
 ////////////////////////////////////////////////////////////////////////
@@ -14,111 +35,228 @@
 ////////////////////////////////////////////////////////////////////////
 
 // Little struct to pass stuff into each worker thread
-struct WorkerArg {
+struct WorkerArg : PoolAllocated {
     Server *server;
     int client_fd;
 };
 
+// and into each reactor thread
+struct ReactorArg {
+    Reactor *reactor;
+    int cpu; // -1 = not pinned
+};
+
+// and into each coroutine loop's thread
+struct CoroArg {
+    Server *server;
+    std::vector<int> listenfds;
+    int cpu; // -1 = not pinned
+};
+
 ////////////////////////////////////////////////////////////////////////
 // Client thread helpers
 ////////////////////////////////////////////////////////////////////////
 
 namespace {
 
+// the admin socket: how long to wait after a failed accept (e.g. out
+// of fds), and at most how long one client may take to read its report
+const useconds_t ADMIN_ACCEPT_BACKOFF_US = 100000;
+const time_t ADMIN_SEND_TIMEOUT_SECS = 1;
+
+// a coro sender gives its loop back once its broadcasts have made this
+// many enqueues (as a reactor's drain_inbound does), so a hot room's
+// sender can't keep the loop's other rooms waiting
+const size_t FANOUT_BUDGET = 4096;
+
 // Handles a sender client after slogin. Basically reads
 // sender commands forever until they quit or something breaks.
 void chat_with_sender(Server *server, Connection &conn, const std::string &username) {
-    Room *current = nullptr;
+    SenderSession session(username, server->get_options().sender_limit);
+
+    // replies waiting to go out, in request order
+    std::vector<Frame *> acks;
+    size_t max_acks = server->get_options().write_batch;
 
     for (;;) {  // infinite loop until they quit or disconnect
-        Message req;
+        MessageView req; // points into conn's buffer, no copies
+        Message reply;
+        bool keep_going = true;
 
         try {
             if (!conn.receive(req)) {
                 break;  // if receive fails, they're basically gone
             }
+            keep_going = handle_sender_request(server, session, req, reply);
         } catch (const std::exception &e) {
             // just tell the client something went wrong and keep going
-            conn.send(Message(TAG_ERR, e.what()));
-            continue;
+            reply = Message(TAG_ERR, e.what());
         }
-
-        if (req.tag == TAG_JOIN) {
-            // join/create room
-            current = server->find_or_create_room(req.data);
-            conn.send(Message(TAG_OK, ""));
-
-        } else if (req.tag == TAG_SENDALL) {
-            if (!current) {
-                conn.send(Message(TAG_ERR, "Not in a room"));
-            } else {
-                // broadcast msg to whoever’s chillin in the room
-                current->broadcast_message(username, req.data);
-                conn.send(Message(TAG_OK, ""));
+        acks.push_back(Frame::create(reply.tag, reply.data));
+
+        // A pipelining client has sent more requests already: handle
+        // whatever is buffered first and answer them all in one write.
+        // Only once we'd have to wait for the client do the acks go out.
+        if (!keep_going || !conn.has_buffered_input() || acks.size() >= max_acks) {
+            bool sent_ok = conn.send(acks.data(), acks.size());
+            for (Frame *ack : acks) {
+                ack->unref();
             }
-
-        } else if (req.tag == TAG_LEAVE) {
-            if (!current) {
-                conn.send(Message(TAG_ERR, "Not in a room"));
-            } else {
-                current = nullptr;
-                conn.send(Message(TAG_OK, ""));
+            acks.clear();
+            if (!sent_ok) {
+                break;
             }
-
-        } else if (req.tag == TAG_QUIT) {
-            // sender wants out — send ok and bail
-            conn.send(Message(TAG_OK, ""));
+        }
+        if (!keep_going) {
             break;
+        }
+    }
 
-        } else {
-            // literally anything else is wrong
-            conn.send(Message(TAG_ERR, "Invalid command"));
+    // answers to anything before a bad request still go out
+    if (!acks.empty()) {
+        conn.send(acks.data(), acks.size());
+        for (Frame *ack : acks) {
+            ack->unref();
         }
     }
 }
 
+// Send a receiver what replay covers of the room's log, a batch per
+// writev. Returns false if the client went away.
+bool replay_log(Connection &conn, RoomLog *log, RoomLog::Cursor &replay,
+                std::vector<Frame *> &batch) {
+    std::string_view sender, text;
+    while (!replay.done()) {
+        size_t n = 0;
+        while (n < batch.size() && log->read(replay, sender, text)) {
+            batch[n++] = Frame::create_delivery(log->get_room_name(), sender, text);
+        }
+        if (replay.done()) {
+            log->finish(replay);  // the frames have copies
+        }
+
+        bool sent_ok = conn.send(batch.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            batch[i]->unref();
+        }
+        if (!sent_ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Handles a receiver client after rlogin. They must immediately
-// send a join, and then they just sit there and get messages forever.
-void chat_with_receiver(Server *server, Connection &conn, User *user) {
-    Message join_msg;
+// send a join, and then they get messages forever, joining and
+// leaving more rooms whenever they like.
+void chat_with_receiver(Server *server, Connection &conn, const std::shared_ptr<User> &user) {
+    MessageView join_msg;
 
     try {
-        // they HAVE to send join first — no join = no party
-        if (!conn.receive(join_msg) || join_msg.tag != TAG_JOIN) {
+        if (!conn.receive(join_msg)) {
             conn.send(Message(TAG_ERR, "Expected join"));
-            delete user;
             return;
         }
     } catch (const std::exception &e) {
         conn.send(Message(TAG_ERR, e.what()));
-        delete user;
         return;
     }
 
-    Room *room = server->find_or_create_room(join_msg.data);
-    room->add_member(user);
-    conn.send(Message(TAG_OK, ""));
+    ReceiverSession session(user);
+    Message reply;
+    bool joined = handle_receiver_join(server, session, join_msg, reply);
+    conn.send(reply);
+    if (!joined) {
+        return;
+    }
+
+    std::vector<Frame *> batch(server->get_options().write_batch);
+
+    // Now the receiver sleeps until either its queue has something
+    // (the queue's eventfd turns readable), it sends a request or it
+    // hangs up. A ring receiver's socket only has doorbells for us,
+    // which the connection deals with itself.
+    pollfd fds[2];
+    fds[0].fd = conn.get_fd();
+    fds[0].events = conn.has_shm() ? POLLRDHUP : POLLIN | POLLRDHUP;
+    fds[1].fd = user->mqueue->get_notify_fd();
+    fds[1].events = POLLIN;
 
-    // Now the receiver just waits for queued messages forever
     for (;;) {
-        Message *delivery = user->mqueue.dequeue();
+        // catch up from a room's log first, live deliveries wait in
+        // the queue meanwhile
+        if (session.replaying() &&
+            !replay_log(conn, session.replay_room->get_log(), session.replay, batch)) {
+            break;
+        }
 
-        if (!delivery) {
-            // nothing ready yet, just keep looping
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[0].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            break;  // client gone, no need to wait for a failed send
+        }
+
+        if (fds[0].revents & POLLIN) {
+            // join/leave requests, replied to in order; a replay one
+            // of them started goes out next time round
+            bool ok = true;
+            do {
+                MessageView req;
+                try {
+                    ok = conn.receive(req);
+                } catch (const std::exception &) {
+                    ok = false;
+                }
+                if (ok) {
+                    handle_receiver_request(server, session, req, reply);
+                    ok = conn.send(reply);
+                }
+            } while (ok && conn.has_buffered_input());
+            if (!ok) {
+                break;
+            }
             continue;
         }
 
-        // try sending the delivery
-        if (!conn.send(*delivery)) {
-            // sending failed → client gone
-            room->remove_member(user);
-            delete user;
-            delete delivery;
-            return;
+        if (user->mqueue->is_overflowed()) {
+            break;  // too slow to keep up (DISCONNECT policy)
         }
 
-        delete delivery;  // done with it
+        // drain in batches, each batch goes out in one writev
+        bool sent_ok = true;
+        for (;;) {
+            size_t n = 0;
+            while (n < batch.size()) {
+                Frame *delivery = user->mqueue->dequeue();
+                if (!delivery) {
+                    break;
+                }
+                batch[n++] = delivery;
+            }
+            if (n == 0) {
+                break;
+            }
+
+            sent_ok = conn.send(batch.data(), n);
+            for (size_t i = 0; i < n; i++) {
+                batch[i]->unref();  // done with it
+            }
+            if (!sent_ok) {
+                break;  // sending failed → client gone
+            }
+        }
+        if (!sent_ok) {
+            break;
+        }
     }
+
+    // the User itself goes away once no room snapshot refers to it
+    session.leave_all();
 }
 
 // The thread that handles each connected client
@@ -131,97 +269,683 @@ void *worker(void *arg) {
     delete warg;
 
     Connection conn(fd);
-    Message login_msg;
+    conn.set_nodelay(true);
+    MessageView login_msg;
+    Metrics::count(Metrics::CONNS_OPENED);
 
     try {
         // first message MUST be slogin or rlogin
         if (!conn.receive(login_msg)) {
             conn.send(Message(TAG_ERR, "Invalid login"));
+            Metrics::count(Metrics::CONNS_CLOSED);
             return nullptr;
         }
     } catch (const std::exception &e) {
         conn.send(Message(TAG_ERR, e.what()));
+        Metrics::count(Metrics::CONNS_CLOSED);
         return nullptr;
     }
 
     // figure out if they’re a sender or receiver
-    if (login_msg.tag == TAG_SLOGIN) {
-        std::string username = login_msg.data;
-        conn.send(Message(TAG_OK, ""));
-        chat_with_sender(server, conn, username);
-
-    } else if (login_msg.tag == TAG_RLOGIN) {
-        std::string username = login_msg.data;
-        conn.send(Message(TAG_OK, ""));
-        User *user = new User(username);
+    if (login_msg.code == TAG_CODE_SLOGIN) {
+        LoginRequest login = parse_login(login_msg.data);
+        conn.send(login_reply(login));
+        if (login.binary) {
+            conn.set_format(WIRE_BINARY);
+        }
+        chat_with_sender(server, conn, login.username);
+
+    } else if (login_msg.code == TAG_CODE_RLOGIN) {
+        LoginRequest login = parse_login(login_msg.data);
+        ShmRing *ring = open_login_shm(fd, login);
+        conn.send(login_reply(login));
+        if (login.binary) {
+            conn.set_format(WIRE_BINARY);
+        }
+        if (ring) {
+            conn.attach_shm(ring, Connection::SHM_SEND);
+        }
+        std::shared_ptr<User> user =
+            server->create_user(login.username, login.binary ? WIRE_BINARY : WIRE_TEXT);
         chat_with_receiver(server, conn, user);
+        server->remove_user(user.get());
 
     } else {
         conn.send(Message(TAG_ERR, "Expected slogin or rlogin"));
     }
 
+    Metrics::count(Metrics::CONNS_CLOSED);
     return nullptr;
 }
 
+// The same as the thread helpers above, written the same way, as
+// coroutines on a CoroLoop: wherever a thread would block, these
+// suspend until the loop sees their socket (or queue) is ready.
+
+// Handles a sender client after slogin, see chat_with_sender
+Task<> async_chat_with_sender(Server *server, Connection &conn, const std::string &username) {
+    SenderSession session(username, server->get_options().sender_limit);
+
+    // replies waiting to go out, in request order
+    std::vector<Frame *> acks;
+    size_t max_acks = server->get_options().write_batch;
+
+    bool keep_going = true;
+    while (keep_going) {
+        MessageView req; // points into conn's buffer, no copies
+        Message reply;
+        if (!co_await conn.async_receive(req)) {
+            break;
+        }
+        try {
+            keep_going = handle_sender_request(server, session, req, reply);
+        } catch (const std::exception &e) {
+            reply = Message(TAG_ERR, e.what());
+        }
+        acks.push_back(Frame::create(reply.tag, reply.data));
+
+        // pipelined requests are answered in one write, as above
+        if (!keep_going || !conn.has_buffered_input() || acks.size() >= max_acks ||
+            session.fanout >= FANOUT_BUDGET) {
+            bool sent_ok = co_await conn.async_send(acks.data(), acks.size());
+            for (Frame *ack : acks) {
+                ack->unref();
+            }
+            acks.clear();
+            if (!sent_ok) {
+                break;
+            }
+
+            // before reading on, let the loop's other clients have a
+            // turn (the next read may well not have to wait)
+            session.fanout = 0;
+            co_await conn.get_watch().loop->yield();
+        }
+    }
+
+    // answers to anything before a bad request still go out
+    if (!acks.empty()) {
+        co_await conn.async_send(acks.data(), acks.size());
+        for (Frame *ack : acks) {
+            ack->unref();
+        }
+    }
+}
+
+// see replay_log
+Task<bool> async_replay_log(Connection &conn, RoomLog *log, RoomLog::Cursor &replay,
+                            std::vector<Frame *> &batch) {
+    std::string_view sender, text;
+    while (!replay.done()) {
+        size_t n = 0;
+        while (n < batch.size() && log->read(replay, sender, text)) {
+            batch[n++] = Frame::create_delivery(log->get_room_name(), sender, text);
+        }
+        if (replay.done()) {
+            log->finish(replay);  // the frames have copies
+        }
+
+        bool sent_ok = co_await conn.async_send(batch.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            batch[i]->unref();
+        }
+        if (!sent_ok) {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+// Handles a receiver client after rlogin, see chat_with_receiver
+Task<> async_chat_with_receiver(Server *server, Connection &conn,
+                                const std::shared_ptr<User> &user) {
+    MessageView join_msg;
+    if (!co_await conn.async_receive(join_msg)) {
+        co_await conn.async_send(Message(TAG_ERR, "Expected join"));
+        co_return;
+    }
+
+    ReceiverSession session(user);
+    Message reply;
+    bool joined = handle_receiver_join(server, session, join_msg, reply);
+    co_await conn.async_send(reply);
+    if (!joined) {
+        co_return;
+    }
+
+    std::vector<Frame *> batch(server->get_options().write_batch);
+    CoroWatch notify(conn.get_watch().loop, user->mqueue->get_notify_fd());
+
+    for (;;) {
+        // catch up from a room's log first, live deliveries wait in
+        // the queue meanwhile
+        if (session.replaying() &&
+            !co_await async_replay_log(conn, session.replay_room->get_log(),
+                                       session.replay, batch)) {
+            break;
+        }
+
+        // sleeps until there's a delivery, or the client has sent a
+        // request or hung up (then there's no delivery)
+        Frame *delivery = co_await user->mqueue->async_dequeue(notify, conn.get_watch());
+
+        if (!delivery) {
+            if (user->mqueue->is_overflowed()) {
+                break;  // too slow to keep up (DISCONNECT policy)
+            }
+            if (!conn.input_ready()) {
+                continue;
+            }
+
+            // join/leave requests, replied to in order
+            bool ok = true;
+            do {
+                MessageView req;
+                ok = co_await conn.async_receive(req);
+                if (ok) {
+                    handle_receiver_request(server, session, req, reply);
+                    ok = co_await conn.async_send(reply);
+                }
+            } while (ok && conn.has_buffered_input());
+            if (!ok) {
+                break;  // includes a hangup
+            }
+            continue;
+        }
+
+        // this one and whatever else is queued go out in one writev
+        size_t n = 0;
+        batch[n++] = delivery;
+        while (n < batch.size() && (delivery = user->mqueue->dequeue())) {
+            batch[n++] = delivery;
+        }
+        bool sent_ok = co_await conn.async_send(batch.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            batch[i]->unref();
+        }
+        if (!sent_ok) {
+            break;
+        }
+
+        // a batch at a time, taking turns with everyone else
+        co_await conn.get_watch().loop->yield();
+    }
+
+    session.leave_all();
+}
+
+// The coroutine that handles each connected client, see worker. No
+// shared-memory rings here, so a receiver asking for one is told no
+// (its ok doesn't list shm) and gets its deliveries on the socket.
+Task<> serve_client(Server *server, CoroLoop *loop, int fd) {
+    Connection conn(fd);
+    conn.set_nodelay(true);
+    conn.attach_loop(loop);
+    MessageView login_msg;
+    Metrics::count(Metrics::CONNS_OPENED);
+
+    // first message MUST be slogin or rlogin
+    if (!co_await conn.async_receive(login_msg)) {
+        co_await conn.async_send(Message(TAG_ERR, "Invalid login"));
+        Metrics::count(Metrics::CONNS_CLOSED);
+        co_return;
+    }
+
+    if (login_msg.code == TAG_CODE_SLOGIN) {
+        LoginRequest login = parse_login(login_msg.data);
+        co_await conn.async_send(login_reply(login));
+        if (login.binary) {
+            conn.set_format(WIRE_BINARY);
+        }
+        co_await async_chat_with_sender(server, conn, login.username);
+
+    } else if (login_msg.code == TAG_CODE_RLOGIN) {
+        LoginRequest login = parse_login(login_msg.data);
+        co_await conn.async_send(login_reply(login));
+        if (login.binary) {
+            conn.set_format(WIRE_BINARY);
+        }
+        std::shared_ptr<User> user =
+            server->create_user(login.username, login.binary ? WIRE_BINARY : WIRE_TEXT);
+        co_await async_chat_with_receiver(server, conn, user);
+        server->remove_user(user.get());
+
+    } else {
+        co_await conn.async_send(Message(TAG_ERR, "Expected slogin or rlogin"));
+    }
+
+    Metrics::count(Metrics::CONNS_CLOSED);
+}
+
+// Accepts clients from listenfd for good, a coroutine each
+Task<> accept_clients(Server *server, CoroLoop *loop, int listenfd) {
+    int flags = fcntl(listenfd, F_GETFL, 0);
+    fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+    CoroWatch watch(loop, listenfd);
+
+    for (;;) {
+        int fd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            loop->spawn(serve_client(server, loop, fd));
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        // nothing waiting (or out of fds): wait for the next client
+        watch.readable = false;
+        co_await CoroLoop::readable(watch);
+    }
+}
+
+// Like open_listenfd, but with SO_REUSEPORT set so several sockets
+// can listen on the same port; the kernel spreads new connections
+// across them.
+int open_reuseport_listenfd(int port) {
+    addrinfo hints{};
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+
+    addrinfo *list;
+    if (getaddrinfo(nullptr, std::to_string(port).c_str(), &hints, &list) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo *p = list; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && ::listen(fd, LISTENQ) == 0) {
+            break;
+        }
+        ::close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(list);
+    return fd;
+}
+
+// Like open_listenfd, for a UNIX domain socket at path. A socket file
+// left behind by an earlier run is removed first.
+int open_unix_listenfd(const std::string &path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        ::listen(fd, LISTENQ) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
 } // anonymous namespace
 
 ////////////////////////////////////////////////////////////////////////
 // Server class functions
 ////////////////////////////////////////////////////////////////////////
 
-Server::Server(int port)
-    : m_port(port), m_ssock(-1)
+Server::Server(int port, const ServerOptions &options)
+    : m_port(port), m_options(options), m_ssock(-1), m_unix_sock(-1),
+      m_admin_sock(-1), m_cluster(this)
 {
-    // main server mutex for room map
-    pthread_mutex_init(&m_lock, nullptr);
-}
+    m_queue_control.max_messages = options.queue_max_messages;
+    m_queue_control.max_bytes = options.queue_max_bytes;
+    m_queue_control.memory_budget = options.queue_memory_budget;
+    m_queue_control.policy = options.queue_policy;
 
-Server::~Server() {
-    {
-        // delete all rooms — otherwise huge leak
-        Guard g(m_lock);
-        for (auto &pair : m_rooms) {
-            delete pair.second;
+    if (!options.log_dir.empty()) {
+        m_rooms.set_log_dir(options.log_dir);
+    }
+    m_rooms.set_rate_limit(options.room_limit);
+
+    if (options.cluster_port != 0 || !options.cluster_peers.empty()) {
+        for (const std::pair<std::string, int> &peer : options.cluster_peers) {
+            m_cluster.add_peer(peer.first, peer.second);
         }
-        m_rooms.clear();
+        m_rooms.set_cluster(&m_cluster);
     }
+}
 
-    pthread_mutex_destroy(&m_lock);
+Server::~Server() {
+    // rooms free themselves once their last member/sender lets go
 }
 
 bool Server::listen() {
+    if (!m_options.unix_path.empty()) {
+        m_unix_sock = open_unix_listenfd(m_options.unix_path);
+        if (m_unix_sock < 0) {
+            return false;
+        }
+    }
+
+    if (!m_options.admin_path.empty()) {
+        m_admin_sock = open_unix_listenfd(m_options.admin_path);
+        if (m_admin_sock < 0) {
+            return false;
+        }
+    }
+
+    if (m_options.cluster_port != 0 && !m_cluster.listen(m_options.cluster_port)) {
+        return false;
+    }
+
+    if (m_options.mode != ServerOptions::THREADED && m_options.reactors > 1) {
+        // a listening socket of its own for every reactor (or loop)
+        for (size_t i = 0; i < m_options.reactors; i++) {
+            int fd = open_reuseport_listenfd(m_port);
+            if (fd < 0) {
+                return false;
+            }
+            m_listenfds.push_back(fd);
+        }
+        m_ssock = m_listenfds[0];
+        return true;
+    }
+
     // open listening socket on the given port
     m_ssock = open_listenfd(std::to_string(m_port).c_str());
     return (m_ssock >= 0);
 }
 
 void Server::handle_client_requests() {
+    if (m_options.stats_interval > 0) {
+        pthread_t tid;
+        Pthread_create(&tid, nullptr, stats_thread, this);
+    }
+
+    if (m_admin_sock >= 0) {
+        pthread_t tid;
+        Pthread_create(&tid, nullptr, admin_thread, this);
+    }
+
+    if (!m_options.log_dir.empty()) {
+        RoomLog::start_log_thread(m_options.log_sync_ms);
+    }
+
+    if (m_options.cluster_port != 0 || !m_options.cluster_peers.empty()) {
+        m_cluster.start();
+    }
+
+    if (m_options.mode == ServerOptions::COROUTINE) {
+        run_coroutines();
+        return;
+    }
+
+    if (m_options.mode == ServerOptions::REACTOR && m_options.reactors > 1) {
+        run_reactors();
+        return;
+    }
+
+    if (m_options.mode == ServerOptions::REACTOR) {
+        // the reactor owns the listening socket from here on
+        Reactor *reactor = Reactor::create(this, m_ssock);
+        if (m_unix_sock >= 0) {
+            reactor->add_listener(m_unix_sock);
+        }
+        reactor->run();
+        return;
+    }
+
+    run_threaded();
+}
+
+void Server::run_threaded() {
+    // wait on the TCP socket and (if there is one) the UNIX socket
+    pollfd listeners[2];
+    nfds_t nlisteners = 0;
+    for (int fd : { m_ssock, m_unix_sock }) {
+        if (fd >= 0) {
+            listeners[nlisteners].fd = fd;
+            listeners[nlisteners].events = POLLIN;
+            nlisteners++;
+        }
+    }
+
     // infinite accept loop. Didn’t want to use while(true) so this works too.
     for (;;) {
-        sockaddr_storage client_addr;
-        socklen_t len = sizeof(client_addr);
+        if (poll(listeners, nlisteners, -1) < 0) {
+            continue;  // EINTR
+        }
+
+        for (nfds_t i = 0; i < nlisteners; i++) {
+            if (!(listeners[i].revents & POLLIN)) {
+                continue;
+            }
+
+            sockaddr_storage client_addr;
+            socklen_t len = sizeof(client_addr);
+
+            int fd = Accept(listeners[i].fd,
+                            reinterpret_cast<sockaddr*>(&client_addr),
+                            &len);
+
+            WorkerArg *arg = new WorkerArg;
+            arg->server = this;
+            arg->client_fd = fd;
+            pthread_t tid;
+            Pthread_create(&tid, nullptr, worker, arg);
+        }
+    }
+}
+
+void Server::run_reactors() {
+    // every reactor exists before any of them runs, since a broadcast
+    // can hand deliveries to any of them
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<ReactorArg> args(m_listenfds.size());
+    for (size_t i = 0; i < m_listenfds.size(); i++) {
+        args[i].reactor = Reactor::create(this, m_listenfds[i]);
+        args[i].cpu = m_options.pin_reactors ? int(i % ncpus) : -1;
+    }
 
-        int fd = Accept(m_ssock,
-                        reinterpret_cast<sockaddr*>(&client_addr),
-                        &len);
+    // local clients are few, the first reactor takes them all
+    if (m_unix_sock >= 0) {
+        args[0].reactor->add_listener(m_unix_sock);
+    }
 
-        auto *arg = new WorkerArg{ this, fd };
+    // the calling thread becomes reactor 0
+    for (size_t i = 1; i < args.size(); i++) {
         pthread_t tid;
-        Pthread_create(&tid, nullptr, worker, arg);
+        Pthread_create(&tid, nullptr, reactor_thread, &args[i]);
+    }
+    reactor_thread(&args[0]);
+}
+
+void *Server::reactor_thread(void *arg) {
+    ReactorArg *rarg = static_cast<ReactorArg *>(arg);
+    if (rarg->cpu >= 0) {
+        pin_to_cpu(rarg->cpu);
+    }
+    rarg->reactor->run();
+    return nullptr;
+}
+
+void Server::run_coroutines() {
+    // one loop per listening socket, each on its own thread; they
+    // share nothing but the rooms, whose broadcasts enqueue directly
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nloops = m_listenfds.empty() ? 1 : m_listenfds.size();
+    std::vector<CoroArg> args(nloops);
+    for (size_t i = 0; i < nloops; i++) {
+        args[i].server = this;
+        args[i].listenfds.push_back(m_listenfds.empty() ? m_ssock : m_listenfds[i]);
+        args[i].cpu = m_options.pin_reactors ? int(i % ncpus) : -1;
+    }
+    if (m_unix_sock >= 0) {
+        args[0].listenfds.push_back(m_unix_sock);
+    }
+
+    // the calling thread runs loop 0
+    for (size_t i = 1; i < nloops; i++) {
+        pthread_t tid;
+        Pthread_create(&tid, nullptr, coro_thread, &args[i]);
+    }
+    coro_thread(&args[0]);
+}
+
+void *Server::coro_thread(void *arg) {
+    CoroArg *carg = static_cast<CoroArg *>(arg);
+    if (carg->cpu >= 0) {
+        pin_to_cpu(carg->cpu);
+    }
+    CoroLoop loop;
+    for (int fd : carg->listenfds) {
+        loop.spawn(accept_clients(carg->server, &loop, fd));
+    }
+    loop.run();
+    return nullptr;
+}
+
+std::shared_ptr<User> Server::create_user(const std::string &username, WireFormat format) {
+    // the User and its shared_ptr control block share one pool block
+    std::shared_ptr<User> user =
+        std::allocate_shared<User>(PoolAllocator<User>(), username,
+                                   m_options.queue_kind, &m_queue_control, format);
+    m_users.add(user);
+    return user;
+}
+
+void Server::remove_user(User *user) {
+    m_users.remove(user);
+}
+
+std::shared_ptr<User> Server::find_user(std::string_view username) {
+    return m_users.find(username);
+}
+
+void *Server::stats_thread(void *arg) {
+    pthread_detach(pthread_self());
+    Server *server = static_cast<Server *>(arg);
+    const QueueControl &qc = server->m_queue_control;
+
+    // counters are only ever bumped, so just sample them
+    for (;;) {
+        sleep(server->m_options.stats_interval);
+        std::fprintf(stderr,
+                     "queues: %zu bytes queued, %lu dropped oldest, "
+                     "%lu dropped newest, %lu disconnects\n",
+                     qc.queued_bytes.load(std::memory_order_relaxed),
+                     qc.dropped_oldest.load(std::memory_order_relaxed),
+                     qc.dropped_newest.load(std::memory_order_relaxed),
+                     qc.disconnects.load(std::memory_order_relaxed));
+
+        // slab allocs going flat means the hot path no longer mallocs
+        Pool::Stats ps = Pool::get_stats();
+        uint64_t slabs = 0, moves = 0;
+        for (const Pool::ClassStats &cs : ps.classes) {
+            slabs += cs.slabs;
+            moves += cs.central_gets + cs.central_puts;
+        }
+        std::fprintf(stderr,
+                     "pool: %lu KB in %lu slabs, %lu oversize allocs, "
+                     "%lu batches moved\n",
+                     ps.slab_bytes / 1024, slabs, ps.oversize_allocs, moves);
     }
+    return nullptr;
 }
 
-Room *Server::find_or_create_room(const std::string &room_name) {
-    Guard lock(m_lock);
+void *Server::admin_thread(void *arg) {
+    pthread_detach(pthread_self());
+    Server *server = static_cast<Server *>(arg);
+
+    // one snapshot per connection, then hang up
+    for (;;) {
+        int fd = accept(server->m_admin_sock, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(ADMIN_ACCEPT_BACKOFF_US);  // e.g. out of fds, don't spin
+            }
+            continue;
+        }
+
+        // a client that doesn't read only holds us up this long
+        timeval tv = { ADMIN_SEND_TIMEOUT_SECS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-    // check if it already exists
-    auto it = m_rooms.find(room_name);
-    if (it != m_rooms.end()) {
-        return it->second;
+        std::string report = server->metrics_report();
+        rio_writen(fd, const_cast<char *>(report.data()), report.size());
+        ::close(fd);
     }
+    return nullptr;
+}
+
+std::string Server::metrics_report() const {
+    Metrics::Stats ms = Metrics::get_stats();
+    const QueueControl &qc = m_queue_control;
+    char buf[256];
+    std::string out;
+
+    std::snprintf(buf, sizeof(buf), "{\"uptime_ns\":%lu,\"threads\":%zu,\"counters\":{",
+                  ms.uptime_ns, ms.threads);
+    out += buf;
+    for (size_t i = 0; i < Metrics::NUM_COUNTERS; i++) {
+        std::snprintf(buf, sizeof(buf), "%s\"%s\":%lu", i ? "," : "",
+                      Metrics::counter_name(Metrics::Counter(i)), ms.counters[i]);
+        out += buf;
+    }
+
+    // things that go down as well as up
+    Pool::Stats ps = Pool::get_stats();
+    std::snprintf(buf, sizeof(buf),
+                  "},\"gauges\":{\"open_connections\":%lu,\"queued_bytes\":%zu,"
+                  "\"dropped_oldest\":%lu,\"dropped_newest\":%lu,"
+                  "\"disconnects\":%lu,\"pool_slab_bytes\":%lu},\"histograms\":{",
+                  ms.counters[Metrics::CONNS_OPENED] - ms.counters[Metrics::CONNS_CLOSED],
+                  qc.queued_bytes.load(std::memory_order_relaxed),
+                  qc.dropped_oldest.load(std::memory_order_relaxed),
+                  qc.dropped_newest.load(std::memory_order_relaxed),
+                  qc.disconnects.load(std::memory_order_relaxed),
+                  ps.slab_bytes);
+    out += buf;
+
+    for (size_t i = 0; i < Metrics::NUM_HISTOGRAMS; i++) {
+        const Metrics::HistogramStats &h = ms.histograms[i];
+        std::snprintf(buf, sizeof(buf),
+                      "%s\"%s\":{\"count\":%lu,\"min\":%lu,\"max\":%lu,\"mean\":%lu,"
+                      "\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"buckets\":[",
+                      i ? "," : "", Metrics::histogram_name(Metrics::Histogram(i)),
+                      h.count, h.min_ns, h.max_ns, h.count ? h.sum_ns / h.count : 0,
+                      h.percentile(0.5), h.percentile(0.9), h.percentile(0.99),
+                      h.percentile(0.999));
+        out += buf;
+
+        // [upper bound, events] per bucket that has any
+        for (size_t j = 0; j < h.buckets.size(); j++) {
+            std::snprintf(buf, sizeof(buf), "%s[%lu,%lu]", j ? "," : "",
+                          h.buckets[j].first, h.buckets[j].second);
+            out += buf;
+        }
+        out += "]}";
+    }
+    out += "}}\n";
+    return out;
+}
 
-    // otherwise make a new room
-    Room *new_room = new Room(room_name);
-    m_rooms[room_name] = new_room;
-    return new_room;
+std::shared_ptr<Room> Server::find_or_create_room(const std::string &room_name) {
+    // only locks the directory shard this room name lives in
+    return m_rooms.find_or_create(room_name);
 }
@@ -1,35 +1,143 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <map>
 #include <string>
-#include <pthread.h>
+#include <string_view>
+#include <memory>
+#include <vector>
+#include <utility>
+#include "wire.h"
+#include "message_queue.h"
+#include "room_directory.h"
+#include "user_directory.h"
+#include "rate_limiter.h"
+#include "cluster.h"
 class Room;
+struct User;
+
+// Startup options for the server
+struct ServerOptions {
+  // how client connections are serviced
+  enum Mode {
+    THREADED, // one detached thread per client (blocking I/O)
+    REACTOR,  // event loop(s), non-blocking sockets
+    COROUTINE, // a coroutine per client on event loop(s), see coro.h
+  };
+
+  Mode mode;
+
+  // REACTOR mode: what the reactors use for I/O. io_uring falls back
+  // to epoll if the kernel can't do everything it needs.
+  enum IoBackend {
+    IO_EPOLL,
+    IO_URING,
+  };
+
+  IoBackend io_backend;
+
+  // REACTOR (COROUTINE) mode: number of reactor (loop) threads, each
+  // with its own SO_REUSEPORT listener, and whether to pin thread i
+  // to CPU i
+  size_t reactors;
+  bool pin_reactors;
+
+  // also listen on a UNIX domain socket at this path (empty = don't);
+  // receivers connecting through it can ask for shared-memory delivery
+  std::string unix_path;
+
+  // which MessageQueue implementation receivers get
+  MessageQueue::Kind queue_kind;
+
+  // receiver queue limits (0 = unlimited) and what happens on overflow
+  size_t queue_max_messages;
+  size_t queue_max_bytes;
+  size_t queue_memory_budget;
+  QueueControl::Policy queue_policy;
+
+  // print queue counters to stderr this often (0 = never)
+  unsigned stats_interval;
+
+  // most queued deliveries written to a receiver in one writev
+  size_t write_batch;
+
+  // keep a durable log of every room under this directory (empty =
+  // don't), synced to disk every log_sync_ms (0 = only when a segment
+  // fills up, otherwise whenever the kernel gets to it)
+  std::string log_dir;
+  unsigned log_sync_ms;
+
+  // serve metrics (metrics.h) on a UNIX domain socket at this path
+  // (empty = don't); every connection gets one JSON snapshot
+  std::string admin_path;
+
+  // how fast one sender, and everyone sending into one room together,
+  // may broadcast; anything over that is refused
+  RateLimit sender_limit;
+  RateLimit room_limit;
+
+  // cluster mode (cluster.h): listen for links from peer servers on
+  // this port (0 = don't), and dial these (host, port) peers
+  int cluster_port;
+  std::vector<std::pair<std::string, int> > cluster_peers;
+
+  ServerOptions()
+    : mode(THREADED), io_backend(IO_EPOLL), reactors(1), pin_reactors(false),
+      queue_kind(MessageQueue::LOCKED),
+      queue_max_messages(0), queue_max_bytes(0), queue_memory_budget(0),
+      queue_policy(QueueControl::DROP_NEWEST), stats_interval(0),
+      write_batch(64), log_sync_ms(10), cluster_port(0) { }
+};
 
 class Server {
 public:
-  Server(int port);
+  Server(int port, const ServerOptions &options = ServerOptions());
   ~Server();
 
   bool listen();
 
   void handle_client_requests();
 
-  Room *find_or_create_room(const std::string &room_name);
+  // rooms are reclaimed once nobody holds on to them anymore
+  std::shared_ptr<Room> find_or_create_room(const std::string &room_name);
+
+  // new receiver with a queue set up according to the options, which
+  // direct messages to username reach until remove_user
+  std::shared_ptr<User> create_user(const std::string &username,
+                                    WireFormat format = WIRE_TEXT);
+  void remove_user(User *user);
+
+  // the receiver logged in as username, or null
+  std::shared_ptr<User> find_user(std::string_view username);
+
+  const ServerOptions &get_options() const { return m_options; }
+  const QueueControl &get_queue_control() const { return m_queue_control; }
 
 private:
   // prohibit value semantics
   Server(const Server &);
   Server &operator=(const Server &);
 
-  typedef std::map<std::string, Room *> RoomMap;
+  void run_threaded();
+  void run_reactors();
+  static void *stats_thread(void *arg);
+  static void *admin_thread(void *arg);
+  std::string metrics_report() const;
+  static void *reactor_thread(void *arg);
+  void run_coroutines();
+  static void *coro_thread(void *arg);
 
   // These member variables are sufficient for implementing
   // the server operations
   int m_port;
+  ServerOptions m_options;
   int m_ssock;
-  RoomMap m_rooms;
-  pthread_mutex_t m_lock;
+  std::vector<int> m_listenfds; // one per reactor (m_ssock is the first)
+  int m_unix_sock;              // -1 unless options.unix_path is set
+  int m_admin_sock;             // -1 unless options.admin_path is set
+  Cluster m_cluster;            // only used with cluster options set
+  RoomDirectory m_rooms;
+  UserDirectory m_users;
+  QueueControl m_queue_control;
 };
 
 #endif // SERVER_H
@@ -0,0 +1,263 @@
+#include <charconv>
+#include <utility>
+#include <sys/socket.h>
+#include "message.h"
+#include "frame.h"
+#include "metrics.h"
+#include "user.h"
+#include "room.h"
+#include "server.h"
+#include "shm_ring.h"
+#include "session.h"
+
+LoginRequest parse_login(std::string_view data) {
+    LoginRequest login;
+    login.binary = false;
+    login.shm = false;
+
+    size_t colon = data.find(':');
+    login.username.assign(data.substr(0, colon));
+
+    while (colon != std::string_view::npos) {
+        data.remove_prefix(colon + 1);
+        colon = data.find(':');
+        std::string_view option = data.substr(0, colon);
+        if (option == "bin") {
+            login.binary = true;
+        } else if (option.substr(0, 4) == "shm=") {
+            login.shm_name.assign(option.substr(4));
+        }
+    }
+    return login;
+}
+
+ShmRing *open_login_shm(int fd, LoginRequest &login) {
+    if (login.shm_name.empty()) {
+        return nullptr;
+    }
+
+    // a remote client's ring name would mean nothing here
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0 ||
+        addr.ss_family != AF_UNIX) {
+        return nullptr;
+    }
+
+    ShmRing *ring = ShmRing::open(login.shm_name);
+    login.shm = ring != nullptr;
+    return ring;
+}
+
+Message login_reply(const LoginRequest &login) {
+    std::string accepted;
+    if (login.binary) {
+        accepted = "bin";
+    }
+    if (login.shm) {
+        accepted += accepted.empty() ? "shm" : ":shm";
+    }
+    return Message(TAG_OK, accepted);
+}
+
+JoinRequest parse_join(std::string_view data) {
+    JoinRequest join;
+    join.replay = false;
+    join.from = 0;
+
+    size_t colon = data.find(':');
+    join.room.assign(data.substr(0, colon));
+
+    while (colon != std::string_view::npos) {
+        data.remove_prefix(colon + 1);
+        colon = data.find(':');
+        std::string_view option = data.substr(0, colon);
+        if (option.substr(0, 5) == "from=") {
+            option.remove_prefix(5);
+            std::from_chars_result r =
+                std::from_chars(option.data(), option.data() + option.size(), join.from);
+            join.replay = r.ec == std::errc() && r.ptr == option.data() + option.size();
+        }
+    }
+    return join;
+}
+
+bool handle_sender_request(Server *server, SenderSession &session,
+                           const MessageView &req, Message &reply) {
+    reply = Message(TAG_OK, "");
+
+    switch (req.code) {
+    case TAG_CODE_JOIN: {
+        // join/create room
+        std::shared_ptr<Room> room = server->find_or_create_room(std::string(req.data));
+        if (room) {
+            session.room = room;
+        } else {
+            reply = Message(TAG_ERR, "Could not open room log");
+        }
+        break;
+    }
+
+    case TAG_CODE_SENDALL:
+        if (!session.room) {
+            reply = Message(TAG_ERR, "Not in a room");
+        } else if (sizeof(TAG_DELIVERY) + session.room->get_room_name().size() +
+                   session.username.size() + req.data.size() + 3 >
+                   Message::MAX_FRAME_LEN) {
+            // the delivery has to fit in a frame receivers will accept
+            reply = Message(TAG_ERR, "Message too long");
+        } else if (!session.limiter.take()) {
+            // over the sender's own rate, before any fan-out
+            Metrics::count(Metrics::RATE_LIMITED);
+            reply = Message(TAG_ERR, "Rate limit exceeded");
+        } else if (!session.room->get_limiter().take()) {
+            // over the room's: the message isn't sent, so it doesn't
+            // count against the sender's own rate either
+            session.limiter.give_back();
+            Metrics::count(Metrics::RATE_LIMITED);
+            reply = Message(TAG_ERR, "Rate limit exceeded");
+        } else {
+            // broadcast msg to whoever's chillin in the room
+            size_t reached = 0;
+            if (!session.room->broadcast_message(session.username, req.data, &reached)) {
+                reply = Message(TAG_ERR, "Could not log message");
+            }
+            session.fanout += reached;
+        }
+        break;
+
+    case TAG_CODE_SENDUSER: {
+        // "recipient:text", delivered with an empty room name so the
+        // receiver can tell it from a room's messages
+        size_t colon = req.data.find(':');
+        if (colon == std::string_view::npos || colon == 0) {
+            reply = Message(TAG_ERR, "Expected username:message");
+        } else if (sizeof(TAG_DELIVERY) + session.username.size() +
+                   req.data.size() - colon + 2 > Message::MAX_FRAME_LEN) {
+            reply = Message(TAG_ERR, "Message too long");
+        } else if (!session.limiter.take()) {
+            Metrics::count(Metrics::RATE_LIMITED);
+            reply = Message(TAG_ERR, "Rate limit exceeded");
+        } else {
+            std::shared_ptr<User> user = server->find_user(req.data.substr(0, colon));
+            if (!user) {
+                reply = Message(TAG_ERR, "No such user");
+            } else {
+                Frame *frame = Frame::create_delivery("", session.username,
+                                                      req.data.substr(colon + 1));
+                if (!user->can_take(frame)) {
+                    // a text receiver, and it wouldn't fit in one line
+                    session.limiter.give_back();
+                    frame->unref();
+                    reply = Message(TAG_ERR, "Message too long");
+                } else {
+                    // queues take enqueues from any thread
+                    user->mqueue->enqueue(frame);
+                }
+            }
+        }
+        break;
+    }
+
+    case TAG_CODE_LEAVE:
+        if (!session.room) {
+            reply = Message(TAG_ERR, "Not in a room");
+        } else {
+            session.room.reset();
+        }
+        break;
+
+    case TAG_CODE_QUIT:
+        // sender wants out, the ok still goes back to them
+        return false;
+
+    default:
+        // literally anything else is wrong
+        reply = Message(TAG_ERR, "Invalid command");
+        break;
+    }
+
+    return true;
+}
+
+void ReceiverSession::leave_all() {
+    for (const std::shared_ptr<Room> &room : rooms) {
+        room->remove_member(user.get());
+    }
+    // the cursor first, it needs the room's log
+    replay = RoomLog::Cursor();
+    replay_room.reset();
+    rooms.clear();
+}
+
+bool handle_receiver_join(Server *server, ReceiverSession &session,
+                          const MessageView &req, Message &reply) {
+    // they HAVE to send join first, no join = no party
+    if (req.code != TAG_CODE_JOIN) {
+        reply = Message(TAG_ERR, "Expected join");
+        return false;
+    }
+
+    JoinRequest join = parse_join(req.data);
+    for (const std::shared_ptr<Room> &joined : session.rooms) {
+        if (joined->get_room_name() == join.room) {
+            reply = Message(TAG_ERR, "Already in that room");
+            return false;
+        }
+    }
+    if (join.replay && session.replaying()) {
+        reply = Message(TAG_ERR, "Replay in progress");
+        return false;
+    }
+
+    std::shared_ptr<Room> room = server->find_or_create_room(join.room);
+    if (!room) {
+        reply = Message(TAG_ERR, "Could not open room log");
+        return false;
+    }
+    session.rooms.push_back(room);
+
+    // live deliveries start at next, the log has everything before
+    uint64_t next = room->add_member(session.user);
+    RoomLog *log = room->get_log();
+    if (log) {
+        RoomLog::Cursor replay = log->cursor(join.replay ? join.from : next, next);
+        reply = Message(TAG_OK, std::to_string(replay.offset));
+        if (!replay.done()) {
+            session.replay_room = room;
+            session.replay = std::move(replay);
+        }
+    } else {
+        reply = Message(TAG_OK, "");
+    }
+    return true;
+}
+
+void handle_receiver_request(Server *server, ReceiverSession &session,
+                             const MessageView &req, Message &reply) {
+    if (req.code == TAG_CODE_JOIN) {
+        handle_receiver_join(server, session, req, reply);
+        return;
+    }
+
+    if (req.code != TAG_CODE_LEAVE) {
+        reply = Message(TAG_ERR, "Invalid command");
+        return;
+    }
+
+    for (size_t i = 0; i < session.rooms.size(); i++) {
+        std::shared_ptr<Room> room = session.rooms[i];
+        if (room->get_room_name() == req.data) {
+            room->remove_member(session.user.get());
+            session.rooms.erase(session.rooms.begin() + i);
+            if (session.replay_room == room) {
+                // nothing more from it, catching up included
+                session.replay = RoomLog::Cursor();
+                session.replay_room.reset();
+            }
+            reply = Message(TAG_OK, "");
+            return;
+        }
+    }
+    reply = Message(TAG_ERR, "Not in that room");
+}
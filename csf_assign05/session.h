@@ -0,0 +1,131 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include "room_log.h"
+#include "rate_limiter.h"
+class Server;
+class Room;
+struct User;
+struct Message;
+struct MessageView;
+class ShmRing;
+
+// Protocol logic shared by the server's execution modes (thread per
+// client, the reactors and coroutines). These functions handle exactly one
+// request and fill in the reply to send back; they never do any I/O,
+// so the caller decides how and when the reply reaches the client.
+
+// The data of an slogin/rlogin: the username, optionally followed by
+// ":option"s. The options are
+//
+//   bin         binary framing (see wire.h)
+//   shm=<name>  rlogin over the UNIX socket only: deliver through the
+//               shared-memory ring the receiver created under <name>
+//               (see shm_ring.h) instead of the socket
+//
+// Unknown options are ignored rather than refused, and the ok lists
+// the ones that were accepted ("bin", "shm", separated by ':'), so a
+// client can ask for whatever it supports and go by the reply.
+struct LoginRequest {
+  std::string username;
+  bool binary;
+  std::string shm_name; // ring asked for, empty if none
+  bool shm;             // the ring was mapped, see open_login_shm
+};
+
+LoginRequest parse_login(std::string_view data);
+
+// Map the ring an rlogin asked for, if the client is on the same host
+// (fd is an AF_UNIX socket). Sets login.shm if that worked; the caller
+// owns the ring and hands it to the connection after the ok.
+ShmRing *open_login_shm(int fd, LoginRequest &login);
+
+// the ok to send back; switch the connection to binary framing after
+// sending it if login.binary is set, and to the ring if login.shm is
+Message login_reply(const LoginRequest &login);
+
+// The data of a receiver's join: the room name, optionally followed
+// by ":from=<offset>" to be replayed the room's log from that offset
+// on before live deliveries start (rooms only have logs if the
+// server keeps them, see room_log.h). In a logged room the ok says
+// which offset the receiver's first delivery has, so it can count
+// from there and rejoin where it left off.
+struct JoinRequest {
+  std::string room;
+  bool replay;
+  uint64_t from;
+};
+
+JoinRequest parse_join(std::string_view data);
+
+// state a sender carries between requests
+struct SenderSession {
+  std::string username;
+  std::shared_ptr<Room> room; // room the sender has joined, or null
+  RateLimiter limiter;        // the sender's own limit, see ServerOptions
+  size_t fanout;              // deliveries its broadcasts made (for the
+                              // caller to reset whenever it likes)
+
+  SenderSession(const std::string &username, const RateLimit &limit = RateLimit())
+    : username(username), limiter(limit), fanout(0) { }
+};
+
+// Handle one request from a logged-in sender. Returns false once the
+// sender has asked to quit (the reply must still be sent).
+//
+// Besides a room broadcast (sendall), a sender can message a single
+// receiver with "senduser:<username>:<text>", in or out of a room. It
+// reaches the receiver logged in under that name as a delivery with an
+// empty room name ("delivery::<sender>:<text>"), wherever they are.
+bool handle_sender_request(Server *server, SenderSession &session,
+                           const MessageView &req, Message &reply);
+
+// state a receiver carries between requests
+struct ReceiverSession {
+  std::shared_ptr<User> user;
+  std::vector<std::shared_ptr<Room> > rooms; // rooms joined, oldest first
+
+  // what's left of a catch-up from replay_room's log, to send before
+  // anything (else) from the user's queue
+  std::shared_ptr<Room> replay_room;
+  RoomLog::Cursor replay;
+
+  ReceiverSession() { }
+  ReceiverSession(const std::shared_ptr<User> &user)
+    : user(user) { }
+
+  bool replaying() const { return !replay.done(); }
+
+  // take the user out of every room it joined (on disconnect)
+  void leave_all();
+};
+
+// Handle the join a receiver must send right after rlogin. On success
+// the user is added to the room and true is returned; if the room is
+// logged and the join asked for a replay, the session's replay is set
+// to the part of the log to send first. On failure the reply holds
+// the error and the receiver should be disconnected.
+bool handle_receiver_join(Server *server, ReceiverSession &session,
+                          const MessageView &req, Message &reply);
+
+// Handle a request from a receiver after its first join. A receiver
+// can be in any number of rooms at once, all delivered through its
+// one queue (each delivery names its room):
+//
+//   join:<room>[:from=<offset>]  join another room, as above; only one
+//                                replay can run at a time
+//   leave:<room>                 leave one (deliveries from it that
+//                                are queued already still arrive)
+//
+// Errors are just replied, the receiver stays connected. Receivers
+// that take deliveries through a ring can't send anything after their
+// first join (the socket only carries doorbells from then on).
+void handle_receiver_request(Server *server, ReceiverSession &session,
+                             const MessageView &req, Message &reply);
+
+#endif // SESSION_H
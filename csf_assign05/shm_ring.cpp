@@ -0,0 +1,202 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "shm_ring.h"
+
+namespace {
+
+const uint32_t RING_MAGIC = 0x52696e67; // "Ring"
+
+// the data starts this far into the mapping
+const size_t DATA_OFFSET = 256;
+
+std::atomic<unsigned> ring_counter(0);
+
+} // anonymous namespace
+
+// head and tail are only ever increased; each side owns one of them
+// and the sleep flag next to it, on a cache line of its own
+struct ShmRing::Header {
+  uint32_t magic;
+  uint64_t capacity;
+
+  alignas(64) std::atomic<uint64_t> head; // next byte to read
+  std::atomic<uint32_t> reader_asleep;
+
+  alignas(64) std::atomic<uint64_t> tail; // next byte to write
+  std::atomic<uint32_t> writer_asleep;
+};
+
+ShmRing *ShmRing::create(size_t capacity) {
+    static_assert(sizeof(Header) <= DATA_OFFSET, "ring header too big");
+
+    size_t cap = 4096;
+    while (cap < capacity) {
+        cap *= 2;
+    }
+    size_t map_len = DATA_OFFSET + cap;
+
+    // pid plus a counter is unique unless a stale ring is left over
+    std::string name;
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < 100; attempt++) {
+        name = "/chatring." + std::to_string(getpid()) + "." +
+               std::to_string(ring_counter.fetch_add(1));
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 && errno != EEXIST) {
+            return nullptr;
+        }
+    }
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, map_len) == 0) {
+        base = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int saved = errno;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        errno = saved;
+        return nullptr;
+    }
+
+    // the fresh mapping is all zeroes, so only magic and size to set
+    Header *hdr = new (base) Header;
+    hdr->capacity = cap;
+    hdr->magic = RING_MAGIC;
+    return new ShmRing(name, base, map_len, cap);
+}
+
+ShmRing *ShmRing::open(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) > DATA_OFFSET) {
+        base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // a power of two that fits the mapping, or it isn't one of ours
+    const Header *hdr = static_cast<const Header *>(base);
+    size_t cap = hdr->capacity;
+    if (hdr->magic != RING_MAGIC || cap == 0 || (cap & (cap - 1)) != 0 ||
+        cap > size_t(st.st_size) - DATA_OFFSET) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return nullptr;
+    }
+    return new ShmRing(name, base, st.st_size, cap);
+}
+
+ShmRing::ShmRing(const std::string &name, void *base, size_t map_len,
+                 size_t capacity)
+    : m_name(name), m_base(base), m_map_len(map_len),
+      m_hdr(static_cast<Header *>(base)),
+      m_data(static_cast<char *>(base) + DATA_OFFSET),
+      m_capacity(capacity) {
+}
+
+ShmRing::~ShmRing() {
+    munmap(m_base, m_map_len);
+}
+
+void ShmRing::unlink() {
+    shm_unlink(m_name.c_str());
+}
+
+size_t ShmRing::write(const iovec *iov, int count) {
+    uint64_t tail = m_hdr->tail.load(std::memory_order_relaxed);
+    uint64_t used = tail - m_hdr->head.load(std::memory_order_acquire);
+    size_t room = used < m_capacity ? m_capacity - used : 0;
+
+    size_t done = 0;
+    for (int i = 0; i < count && done < room; i++) {
+        const char *src = static_cast<const char *>(iov[i].iov_base);
+        size_t n = std::min(iov[i].iov_len, room - done);
+
+        // the copy can wrap around the end of the data area
+        size_t off = (tail + done) & (m_capacity - 1);
+        size_t first = std::min(n, m_capacity - off);
+        memcpy(m_data + off, src, first);
+        memcpy(m_data, src + first, n - first);
+        done += n;
+    }
+
+    // seq_cst so the sleep flag check that follows can't be reordered
+    // before it (see reader_may_sleep)
+    if (done > 0) {
+        m_hdr->tail.store(tail + done, std::memory_order_seq_cst);
+    }
+    return done;
+}
+
+size_t ShmRing::read(char *buf, size_t len) {
+    uint64_t head = m_hdr->head.load(std::memory_order_relaxed);
+    uint64_t avail = m_hdr->tail.load(std::memory_order_acquire) - head;
+    size_t n = std::min(size_t(std::min<uint64_t>(avail, m_capacity)), len);
+
+    size_t off = head & (m_capacity - 1);
+    size_t first = std::min(n, m_capacity - off);
+    memcpy(buf, m_data + off, first);
+    memcpy(buf + first, m_data, n - first);
+
+    if (n > 0) {
+        m_hdr->head.store(head + n, std::memory_order_seq_cst);
+    }
+    return n;
+}
+
+bool ShmRing::reader_may_sleep() {
+    // flag first, then look: either we see the writer's data or the
+    // writer sees our flag
+    m_hdr->reader_asleep.store(1, std::memory_order_seq_cst);
+    if (m_hdr->tail.load(std::memory_order_seq_cst) !=
+        m_hdr->head.load(std::memory_order_relaxed)) {
+        m_hdr->reader_asleep.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::writer_may_sleep() {
+    m_hdr->writer_asleep.store(1, std::memory_order_seq_cst);
+    if (m_hdr->tail.load(std::memory_order_relaxed) -
+        m_hdr->head.load(std::memory_order_seq_cst) < m_capacity) {
+        m_hdr->writer_asleep.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::reader_needs_wakeup() {
+    return m_hdr->reader_asleep.load(std::memory_order_seq_cst) &&
+           m_hdr->reader_asleep.exchange(0, std::memory_order_seq_cst);
+}
+
+bool ShmRing::writer_needs_wakeup() {
+    return m_hdr->writer_asleep.load(std::memory_order_seq_cst) &&
+           m_hdr->writer_asleep.exchange(0, std::memory_order_seq_cst);
+}
+
+void ShmRing::ring_doorbell(int sockfd) {
+    // if the socket is full of doorbells already, the other side is
+    // bound to wake up anyway
+    ssize_t rc = send(sockfd, "\n", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void) rc;
+}
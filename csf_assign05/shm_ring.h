@@ -0,0 +1,75 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+
+// Single-producer, single-consumer byte ring in POSIX shared memory,
+// used to hand deliveries to a receiver on the same host without
+// copying them through a socket. The receiver creates the ring, passes
+// its name in rlogin (see session.h), and the server maps it too.
+// The bytes in the ring are exactly what would otherwise go over the
+// socket, so the wire formats don't change.
+//
+// Neither side polls the ring. A side with nothing to do marks itself
+// asleep and blocks reading the socket it logged in on; the other side
+// sends it a doorbell byte over that socket, but only if it is marked
+// asleep. A busy stream needs no system calls at all.
+class ShmRing {
+public:
+  // Create a ring with room for at least capacity bytes under a fresh
+  // name. Returns nullptr (with errno set) on failure.
+  static ShmRing *create(size_t capacity);
+
+  // Map a ring that another process created. Returns nullptr if it
+  // doesn't exist or doesn't look like a ring.
+  static ShmRing *open(const std::string &name);
+
+  ~ShmRing();
+
+  const std::string &get_name() const { return m_name; }
+
+  // remove the name, the mapping stays valid
+  void unlink();
+
+  // producer: copy as much of iov as fits, returns the bytes copied
+  size_t write(const iovec *iov, int count);
+
+  // consumer: copy up to len available bytes to buf
+  size_t read(char *buf, size_t len);
+
+  // Mark the reader (writer) asleep before blocking for a doorbell.
+  // Returns false, and stays awake, if there turned out to be data
+  // (room) after all.
+  bool reader_may_sleep();
+  bool writer_may_sleep();
+
+  // After a write (read): whether the other side is asleep and needs
+  // a doorbell. Clears the mark, so it's only rung once.
+  bool reader_needs_wakeup();
+  bool writer_needs_wakeup();
+
+  // send a doorbell byte over the socket shared with the other side
+  static void ring_doorbell(int sockfd);
+
+private:
+  struct Header; // lives at the start of the shared memory
+
+  ShmRing(const std::string &name, void *base, size_t map_len, size_t capacity);
+
+  // prohibit value semantics
+  ShmRing(const ShmRing &);
+  ShmRing &operator=(const ShmRing &);
+
+  std::string m_name;
+  void *m_base;
+  size_t m_map_len;
+  Header *m_hdr;
+  char *m_data;
+  size_t m_capacity; // our own copy, the shared one can't be trusted
+};
+
+#endif // SHM_RING_H
@@ -0,0 +1,95 @@
+#! /usr/bin/env bash
+
+# Exactly-once check for cluster mode: three local servers, fully
+# linked (one pair dialing each other both ways), a receiver in the
+# same room on each, and a sender on each. Every receiver has to get
+# every sender's messages, each one exactly once.
+#
+# usage: ./test_cluster.sh [server options, e.g. -m epoll] [-- count]
+
+SERVER_OPTS=()
+COUNT=1000
+while [ $# -gt 0 ]; do
+  if [ "$1" = "--" ]; then
+    COUNT=$2
+    break
+  fi
+  SERVER_OPTS+=("$1")
+  shift
+done
+
+DIR=$(mktemp -d)
+BASE=$((20000 + RANDOM % 20000))
+PIDS=()
+
+cleanup() {
+  [ ${#PIDS[@]} -gt 0 ] && kill ${PIDS[@]} 2>/dev/null
+  wait 2>/dev/null
+  rm -rf $DIR
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+# node i serves clients on BASE+i and links on BASE+10+i
+port() { echo $((BASE + $1)); }
+cport() { echo $((BASE + 10 + $1)); }
+
+./server "${SERVER_OPTS[@]}" -C $(cport 1) -N localhost:$(cport 2) $(port 1) 2>$DIR/s1.err &
+PIDS+=($!)
+./server "${SERVER_OPTS[@]}" -C $(cport 2) -N localhost:$(cport 1) $(port 2) 2>$DIR/s2.err &
+PIDS+=($!)
+./server "${SERVER_OPTS[@]}" -C $(cport 3) -N localhost:$(cport 1) -N localhost:$(cport 2) \
+  $(port 3) 2>$DIR/s3.err &
+PIDS+=($!)
+
+# give the links time to come up
+sleep 1.5
+for i in 1 2 3; do
+  kill -0 ${PIDS[$((i - 1))]} 2>/dev/null || fail "server $i didn't start: $(cat $DIR/s$i.err)"
+done
+
+for i in 1 2 3; do
+  ./receiver localhost $(port $i) r$i lobby > $DIR/r$i.out 2>&1 &
+  PIDS+=($!)
+done
+
+# and for the joins to reach the other servers
+sleep 0.5
+
+for i in 1 2 3; do
+  (echo "/join lobby"; seq -f "s$i-%05g" 1 $COUNT; echo "/quit") |
+    ./sender localhost $(port $i) s$i > /dev/null &
+done
+wait $(jobs -p | tail -3)
+
+for i in 1 2 3; do
+  seq -f "s$i: s$i-%05g" 1 $COUNT
+done | sort > $DIR/expected
+
+# wait for the deliveries to stop coming in
+for i in 1 2 3; do
+  for try in $(seq 1 50); do
+    [ $(wc -l < $DIR/r$i.out) -ge $((3 * COUNT)) ] && break
+    sleep 0.1
+  done
+done
+sleep 0.3
+
+for i in 1 2 3; do
+  sort $DIR/r$i.out > $DIR/r$i.sorted
+  dups=$(uniq -d $DIR/r$i.sorted | wc -l)
+  [ $dups -eq 0 ] || fail "receiver $i got $dups messages more than once"
+  diff $DIR/expected $DIR/r$i.sorted > /dev/null ||
+    fail "receiver $i got $(wc -l < $DIR/r$i.sorted) of $((3 * COUNT)) messages"
+  # each sender's messages in the order they were sent
+  for j in 1 2 3; do
+    grep "^s$j: " $DIR/r$i.out | sort -c 2>/dev/null ||
+      fail "receiver $i got sender $j's messages out of order"
+  done
+done
+
+echo "PASS"
@@ -0,0 +1,79 @@
+#! /usr/bin/env bash
+
+# Recovery check for the room logs: log some messages, cut the segment
+# off in the middle of a record (as a crash mid-append would leave it),
+# restart the server and check the log ends at the last whole record,
+# and that appends carry on from there.
+#
+# usage: ./test_room_log.sh [server options, e.g. -m epoll]
+
+SERVER_OPTS="$@"
+DIR=$(mktemp -d)
+PORT=$((20000 + RANDOM % 20000))
+SERVER=
+
+cleanup() {
+  [ -n "$SERVER" ] && kill $SERVER 2>/dev/null && wait $SERVER 2>/dev/null
+  rm -rf $DIR
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+start_server() {
+  ./server -L $DIR/logs $SERVER_OPTS $PORT 2>>$DIR/server.err &
+  SERVER=$!
+  sleep 0.3
+  kill -0 $SERVER 2>/dev/null || fail "server didn't start (see $DIR/server.err)"
+}
+
+stop_server() {
+  kill $SERVER
+  wait $SERVER 2>/dev/null
+  SERVER=
+}
+
+# every record here is the same size: a 16 byte header, then sender
+# "alice" and a 5 character text, padded to a multiple of 4
+RECORD=28
+COUNT=100
+KEEP=60
+
+start_server
+for i in $(seq 1 $COUNT); do
+  printf "m%04d\n" $i
+done | (echo "/join hist"; cat; echo "/quit") | ./sender localhost $PORT alice > /dev/null
+stop_server
+
+SEGMENT=$(ls $DIR/logs/hist/*.log | head -1)
+[ $(ls $DIR/logs/hist/*.log | wc -l) -eq 1 ] || fail "expected one segment"
+
+# half way into record KEEP (counting from 0)
+truncate -s $((KEEP * RECORD + RECORD / 2)) $SEGMENT
+
+start_server
+grep -q "discarding" $DIR/server.err && fail "recovery threw whole segments away"
+
+# replayed from the start, the log must hold exactly the first KEEP
+# messages, and the next message must get offset KEEP
+./receiver -o $DIR/offset localhost $PORT bob hist > $DIR/replay.out 2>&1 &
+RECEIVER=$!
+sleep 0.5
+printf "/join hist\nafter\n/quit\n" | ./sender localhost $PORT alice > /dev/null
+sleep 0.5
+kill $RECEIVER
+wait $RECEIVER 2>/dev/null
+
+for i in $(seq 1 $KEEP); do
+  printf "alice: m%04d\n" $i
+done > $DIR/expected
+echo "alice: after" >> $DIR/expected
+
+diff $DIR/expected $DIR/replay.out > /dev/null || fail "replay after recovery differs:
+$(diff $DIR/expected $DIR/replay.out | head -20)"
+[ "$(cat $DIR/offset)" -eq $((KEEP + 1)) ] || fail "offset file has $(cat $DIR/offset), expected $((KEEP + 1))"
+
+echo "PASS"
@@ -0,0 +1,649 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "csapp.h"
+#include "user.h"
+#include "uring_reactor.h"
+
+namespace {
+
+const unsigned SQ_ENTRIES = 1024;
+const unsigned CQ_ENTRIES = 8192; // multishot requests complete many times
+
+// provided receive buffers, shared by all of a reactor's connections
+const unsigned BUF_COUNT = 1024; // must be a power of two
+const unsigned BUF_SIZE = 4096;
+const unsigned BUF_GROUP = 0;
+
+// what a completion is for, kept in the low bits of its user_data;
+// the rest is the connection, if any (for an accept, the listener's
+// index)
+enum Op : uint64_t {
+    OP_RECV = 0,
+    OP_SEND = 1,
+    OP_QUEUE = 2,   // poll on a receiver's queue eventfd
+    OP_ACCEPT = 3,
+    OP_INBOUND = 4, // poll on the inbound eventfd
+    OP_IGNORE = 5,  // nothing to do (poll removals, the probe)
+    OP_OVERFLOW = 6, // multishot poll on a queue eventfd, for overflows
+};
+const uint64_t OP_MASK = 7;
+
+void fatal(const char *msg) {
+    unix_error(const_cast<char *>(msg));
+}
+
+int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return int(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+} // anonymous namespace
+
+////////////////////////////////////////////////////////////////////////
+// Per-connection state
+////////////////////////////////////////////////////////////////////////
+
+// A connection can't be freed while the kernel might still complete a
+// request referring to it, so closing one only shuts the socket down
+// (which ends its recv and fails its send) and cancels its queue polls;
+// it is freed once the last of its requests has come back.
+struct UringReactor::UConn : Conn {
+  unsigned ops;       // requests in flight
+  bool receiving;     // multishot recv is armed
+  bool sending;       // a sendmsg is in flight
+  bool queue_polled;  // a poll on the queue eventfd is in flight
+  bool overflow_watched; // so is a multishot one, see watch_overflow
+  bool on_flush_list; // in m_flush
+
+  // what the sendmsg in flight points at
+  std::vector<iovec> iov;
+  msghdr msg;
+
+  UConn(int fd)
+    : Conn(fd), ops(0), receiving(false), sending(false),
+      queue_polled(false), overflow_watched(false), on_flush_list(false), msg() { }
+
+  uint64_t user_data(Op op) { return reinterpret_cast<uint64_t>(this) | op; }
+};
+
+////////////////////////////////////////////////////////////////////////
+// UringReactor member functions
+////////////////////////////////////////////////////////////////////////
+
+UringReactor *UringReactor::create(Server *server, int listenfd) {
+    UringReactor *reactor = new UringReactor(server, listenfd);
+    if (!reactor->setup_ring() || !reactor->setup_buffers() ||
+        !reactor->probe_multishot_recv()) {
+        int saved = errno;
+        delete reactor;
+        errno = saved;
+        return nullptr;
+    }
+    return reactor;
+}
+
+UringReactor::UringReactor(Server *server, int listenfd)
+    : Reactor(server, listenfd), m_ring_fd(-1),
+      m_sq_khead(nullptr), m_sq_ktail(nullptr), m_sq_mask(0), m_sq_entries(0),
+      m_sq_tail(0), m_sqes(nullptr),
+      m_cq_khead(nullptr), m_cq_ktail(nullptr), m_cq_mask(0), m_cqes(nullptr),
+      m_sq_map(MAP_FAILED), m_cq_map(MAP_FAILED),
+      m_sq_map_len(0), m_cq_map_len(0), m_sqes_len(0),
+      m_buf_ring(nullptr), m_bufs(nullptr), m_buf_tail(0) {
+}
+
+UringReactor::~UringReactor() {
+    close_all_conns();
+
+    // closing the ring cancels whatever is still in flight, after
+    // which the lingering connections can go too
+    if (m_ring_fd >= 0) {
+        ::close(m_ring_fd);
+    }
+    for (UConn *conn : m_closing) {
+        ::close(conn->fd);
+        delete conn;
+    }
+    free_dead_conns();
+
+    if (m_sqes) {
+        munmap(m_sqes, m_sqes_len);
+    }
+    if (m_cq_map != MAP_FAILED && m_cq_map != m_sq_map) {
+        munmap(m_cq_map, m_cq_map_len);
+    }
+    if (m_sq_map != MAP_FAILED) {
+        munmap(m_sq_map, m_sq_map_len);
+    }
+    if (m_buf_ring) {
+        munmap(m_buf_ring, BUF_COUNT * sizeof(io_uring_buf));
+    }
+    if (m_bufs) {
+        munmap(m_bufs, BUF_COUNT * BUF_SIZE);
+    }
+}
+
+bool UringReactor::setup_ring() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                   IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = CQ_ENTRIES;
+    m_ring_fd = io_uring_setup(SQ_ENTRIES, &params);
+    if (m_ring_fd < 0 && errno == EINVAL) {
+        // the extra flags are only optimizations
+        params = io_uring_params();
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = CQ_ENTRIES;
+        m_ring_fd = io_uring_setup(SQ_ENTRIES, &params);
+    }
+    if (m_ring_fd < 0) {
+        return false;
+    }
+
+    m_sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        m_sq_map_len = m_cq_map_len = std::max(m_sq_map_len, m_cq_map_len);
+    }
+
+    m_sq_map = mmap(nullptr, m_sq_map_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_map == MAP_FAILED) {
+        return false;
+    }
+    m_cq_map = single_mmap
+        ? m_sq_map
+        : mmap(nullptr, m_cq_map_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+    if (m_cq_map == MAP_FAILED) {
+        return false;
+    }
+    m_sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, m_sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    m_sqes = static_cast<io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(m_sq_map);
+    m_sq_khead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    m_sq_ktail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_sq_entries = params.sq_entries;
+    m_sq_tail = *m_sq_ktail;
+
+    // slot i of the submission ring always holds sqe i
+    unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < m_sq_entries; i++) {
+        array[i] = i;
+    }
+
+    char *cq = static_cast<char *>(m_cq_map);
+    m_cq_khead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_cq_ktail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+}
+
+bool UringReactor::setup_buffers() {
+    void *ring = mmap(nullptr, BUF_COUNT * sizeof(io_uring_buf),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    m_buf_ring = static_cast<io_uring_buf_ring *>(ring);
+
+    void *bufs = mmap(nullptr, BUF_COUNT * BUF_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED) {
+        return false;
+    }
+    m_bufs = static_cast<char *>(bufs);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(m_buf_ring);
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < BUF_COUNT; i++) {
+        recycle_buffer(i);
+    }
+    return true;
+}
+
+bool UringReactor::probe_multishot_recv() {
+    // older kernels take the flag but reject the request, so try one
+    // on a socketpair before committing to the ring
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return false;
+    }
+
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = OP_IGNORE;
+
+    char byte = 0;
+    ssize_t rc = write(fds[1], &byte, 1);
+    int result = rc == 1 ? submit(1) : -1;
+
+    bool ok = false;
+    if (result >= 0) {
+        unsigned head = *m_cq_khead;
+        if (head != __atomic_load_n(m_cq_ktail, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+            ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE);
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                recycle_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!ok) {
+                errno = cqe.res < 0 ? -cqe.res : EINVAL;
+            }
+            __atomic_store_n(m_cq_khead, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    // the recv finishes with EOF, the event loop ignores that
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return ok;
+}
+
+io_uring_sqe *UringReactor::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_khead, __ATOMIC_ACQUIRE);
+    if (m_sq_tail - head == m_sq_entries) {
+        // full, hand what we have to the kernel now
+        submit(0);
+        head = __atomic_load_n(m_sq_khead, __ATOMIC_ACQUIRE);
+        if (m_sq_tail - head == m_sq_entries) {
+            fatal("io_uring submission ring stuck");
+        }
+    }
+
+    io_uring_sqe *sqe = &m_sqes[m_sq_tail & m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_tail++;
+    return sqe;
+}
+
+int UringReactor::submit(unsigned wait_for) {
+    __atomic_store_n(m_sq_ktail, m_sq_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sq_tail - __atomic_load_n(m_sq_khead, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        int rc = io_uring_enter(m_ring_fd, to_submit, wait_for,
+                                wait_for ? IORING_ENTER_GETEVENTS : 0);
+        if (rc >= 0) {
+            return rc;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            // completions backed up, the caller has to reap some
+            return 0;
+        }
+        return -1;
+    }
+}
+
+void UringReactor::event_loop() {
+    for (size_t i = 0; i < m_listenfds.size(); i++) {
+        arm_accept(i);
+    }
+    arm_inbound();
+
+    for (;;) {
+        // send off this round's requests, wait for the next completion
+        if (submit(1) < 0) {
+            fatal("io_uring_enter error");
+        }
+
+        unsigned head = *m_cq_khead;
+        unsigned tail = __atomic_load_n(m_cq_ktail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            // copied, so the slot can go back to the kernel right away
+            io_uring_cqe cqe = m_cqes[head & m_cq_mask];
+            head++;
+            __atomic_store_n(m_cq_khead, head, __ATOMIC_RELEASE);
+            handle_completion(cqe);
+        }
+
+        start_sends();
+        free_dead_conns();
+    }
+}
+
+void UringReactor::handle_completion(const io_uring_cqe &cqe) {
+    Op op = Op(cqe.user_data & OP_MASK);
+    UConn *conn = reinterpret_cast<UConn *>(cqe.user_data & ~OP_MASK);
+
+    switch (op) {
+    case OP_ACCEPT:
+        on_accept(cqe);
+        return;
+    case OP_INBOUND:
+        drain_inbound();
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            arm_inbound();
+        }
+        return;
+    case OP_IGNORE:
+        return;
+    case OP_RECV:
+        on_recv(conn, cqe);
+        break;
+    case OP_SEND:
+        on_send(conn, cqe);
+        break;
+    case OP_QUEUE:
+        on_queue(conn);
+        break;
+    case OP_OVERFLOW:
+        on_overflow_watch(conn, cqe);
+        break;
+    }
+
+    // a multishot recv or poll is only done with the connection once
+    // the kernel says there is no more coming
+    if ((op != OP_RECV && op != OP_OVERFLOW) || !(cqe.flags & IORING_CQE_F_MORE)) {
+        conn->ops--;
+        if (conn->dead && conn->ops == 0) {
+            finish_conn(conn);
+        }
+    }
+}
+
+void UringReactor::arm_accept(size_t listener) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfds[listener];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t(listener) << 3) | OP_ACCEPT;
+}
+
+void UringReactor::arm_inbound() {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = m_inbound_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_INBOUND;
+}
+
+void UringReactor::arm_recv(UConn *conn) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = conn->user_data(OP_RECV);
+    conn->receiving = true;
+    conn->ops++;
+}
+
+void UringReactor::arm_queue(UConn *conn) {
+    // only listen while there is room to take deliveries, a slow (or
+    // still replaying) receiver's backlog stays in its queue meanwhile
+    if (conn->state != Conn::RECEIVER || conn->queue_polled) {
+        return;
+    }
+    if (conn->replaying() || conn->pending_output() >= OUTPUT_HIGH_WATER) {
+        watch_overflow(conn);
+        return;
+    }
+
+    // one-shot, and completes right away if the queue is non-empty
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->receiver.user->mqueue->get_notify_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = conn->user_data(OP_QUEUE);
+    conn->queue_polled = true;
+    conn->ops++;
+}
+
+void UringReactor::watch_overflow(UConn *conn) {
+    // A receiver not taking deliveries still has to hear about its
+    // queue overflowing. A multishot poll completes once for every
+    // signal on the eventfd (the queue only signals when it goes
+    // non-empty, and when it overflows), not for as long as it's
+    // readable, so it doesn't spin on the backlog. Once a receiver has
+    // needed one it keeps it until it's closed.
+    if (conn->overflow_watched) {
+        return;
+    }
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->receiver.user->mqueue->get_notify_fd();
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = conn->user_data(OP_OVERFLOW);
+    conn->overflow_watched = true;
+    conn->ops++;
+}
+
+void UringReactor::start_send(UConn *conn) {
+    if (conn->iov.empty()) {
+        conn->iov.resize(m_max_iov);
+    }
+    size_t count = gather_output(conn, conn->iov.data(), conn->iov.size());
+
+    conn->msg = msghdr();
+    conn->msg.msg_iov = conn->iov.data();
+    conn->msg.msg_iovlen = count;
+
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn->msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = conn->user_data(OP_SEND);
+    conn->sending = true;
+    conn->ops++;
+}
+
+void UringReactor::start_sends() {
+    for (UConn *conn : m_flush) {
+        conn->on_flush_list = false;
+        if (conn->dead) {
+            continue;
+        }
+
+        if (!conn->sending) {
+            top_up_replay(conn);
+            if (conn->output_via_shm()) {
+                // what doesn't fit waits for the receiver's doorbell
+                do {
+                    write_shm(conn);
+                } while (conn->out.empty() && top_up_replay(conn));
+            } else if (!conn->out.empty()) {
+                start_send(conn);
+            }
+            if (conn->out.empty() && conn->state == Conn::CLOSING) {
+                close_conn(conn);
+                continue;
+            }
+        }
+        arm_queue(conn);
+    }
+    m_flush.clear();
+}
+
+void UringReactor::flush(Conn *c) {
+    // sends go out at the end of the round, all in one submission
+    UConn *conn = static_cast<UConn *>(c);
+    if (!conn->on_flush_list) {
+        conn->on_flush_list = true;
+        m_flush.push_back(conn);
+    }
+}
+
+void UringReactor::recycle_buffer(unsigned short bid) {
+    // not m_buf_ring->bufs: the header's flexible array comes out at
+    // the wrong offset when compiled as C++
+    io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(m_buf_ring) +
+                        (m_buf_tail & (BUF_COUNT - 1));
+    buf->addr = reinterpret_cast<uint64_t>(m_bufs + size_t(bid) * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    m_buf_tail++;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+void UringReactor::on_accept(const io_uring_cqe &cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        arm_accept(cqe.user_data >> 3);
+    }
+    if (cqe.res < 0) {
+        // e.g. out of fds, the accept is still there for later
+        return;
+    }
+
+    int fd = cqe.res;
+
+    // we batch our own writes, don't let Nagle delay a lone one
+    // (fails harmlessly on a UNIX socket)
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    UConn *conn = new UConn(fd);
+    add_conn(conn);
+    arm_recv(conn);
+}
+
+void UringReactor::on_recv(UConn *conn, const io_uring_cqe &cqe) {
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        // copy out and give the buffer straight back to the kernel
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn->dead) {
+            conn->in.append(m_bufs + size_t(bid) * BUF_SIZE, cqe.res);
+        }
+        recycle_buffer(bid);
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        conn->receiving = false;
+    }
+    if (conn->dead) {
+        return;
+    }
+
+    // EOF or a real error: the client is gone, but still act on
+    // whatever complete requests it sent before leaving. ENOBUFS just
+    // means the buffers ran out for a moment.
+    bool gone = cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS);
+    if (cqe.res > 0) {
+        handle_input(conn);
+        if (conn->dead) {
+            return;
+        }
+    }
+    if (gone) {
+        close_conn(conn);
+        return;
+    }
+    if (!conn->receiving) {
+        arm_recv(conn);
+    }
+
+    flush(conn);
+}
+
+void UringReactor::on_send(UConn *conn, const io_uring_cqe &cqe) {
+    conn->sending = false;
+    if (conn->dead) {
+        return;
+    }
+    if (cqe.res <= 0) {
+        // sending failed → client gone
+        close_conn(conn);
+        return;
+    }
+
+    retire_output(conn, cqe.res);
+
+    // send the rest, finish closing, or take more deliveries
+    flush(conn);
+}
+
+void UringReactor::on_queue(UConn *conn) {
+    conn->queue_polled = false;
+    if (!conn->dead) {
+        // the receiver's queue went non-empty
+        deliver(conn);
+    }
+}
+
+void UringReactor::on_overflow_watch(UConn *conn, const io_uring_cqe &cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        conn->overflow_watched = false;  // the next stall re-arms it
+    }
+    if (!conn->dead && conn->receiver.user->mqueue->is_overflowed()) {
+        // too slow to keep up (DISCONNECT policy)
+        close_conn(conn);
+    }
+}
+
+void UringReactor::release_conn(Conn *c) {
+    UConn *conn = static_cast<UConn *>(c);
+
+    // ends the recv and fails a send in flight
+    shutdown(conn->fd, SHUT_RDWR);
+
+    if (conn->queue_polled) {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = conn->user_data(OP_QUEUE);
+        sqe->user_data = OP_IGNORE;
+    }
+    if (conn->overflow_watched) {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = conn->user_data(OP_OVERFLOW);
+        sqe->user_data = OP_IGNORE;
+    }
+
+    if (conn->ops == 0) {
+        finish_conn(conn);
+    } else {
+        m_closing.insert(conn);
+    }
+}
+
+void UringReactor::finish_conn(UConn *conn) {
+    // nothing in the kernel refers to it anymore
+    m_closing.erase(conn);
+    ::close(conn->fd);
+    m_dead.push_back(conn);
+}
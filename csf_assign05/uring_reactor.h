@@ -0,0 +1,98 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <vector>
+#include <unordered_set>
+#include <linux/io_uring.h>
+#include "reactor.h"
+
+// The io_uring flavor of the reactor. Instead of asking which sockets
+// are ready and then making a read or writev call for each, it keeps
+// requests posted in the kernel and works off their completions:
+//
+//  - one multishot accept on the listening socket, which keeps
+//    producing new connections
+//  - one multishot recv per connection, reading into buffers the
+//    kernel picks from a ring of provided buffers, so an idle
+//    connection doesn't tie up a buffer of its own
+//  - a poll on a receiver's queue eventfd while it has room for more
+//    deliveries, and a multishot poll on the inbound eventfd
+//  - at most one sendmsg per connection, gathering up to a batch of
+//    frames like the epoll flush does (a receiver with a ring gets
+//    its deliveries copied straight in instead)
+//
+// New requests are only written into the submission ring while
+// completions are handled. All of them (typically a send for every
+// receiver a broadcast reached) go to the kernel together in the one
+// io_uring_enter call that also waits for the next completions.
+//
+// The ring is set up with raw system calls, there is no liburing
+// dependency. Needs Linux 6.0 or later (multishot recv).
+class UringReactor : public Reactor {
+public:
+  // nullptr with errno set if the kernel doesn't support everything
+  // this needs
+  static UringReactor *create(Server *server, int listenfd);
+
+  ~UringReactor() override;
+
+protected:
+  void event_loop() override;
+  void flush(Conn *conn) override;
+  void release_conn(Conn *conn) override;
+
+private:
+  struct UConn; // Conn plus its requests in flight
+
+  UringReactor(Server *server, int listenfd);
+
+  bool setup_ring();
+  bool setup_buffers();
+  bool probe_multishot_recv();
+
+  io_uring_sqe *get_sqe();
+  int submit(unsigned wait_for);
+  void handle_completion(const io_uring_cqe &cqe);
+
+  void arm_accept(size_t listener);
+  void arm_inbound();
+  void arm_recv(UConn *conn);
+  void arm_queue(UConn *conn);
+  void watch_overflow(UConn *conn);
+  void start_send(UConn *conn);
+  void start_sends();
+  void recycle_buffer(unsigned short bid);
+
+  void on_accept(const io_uring_cqe &cqe);
+  void on_recv(UConn *conn, const io_uring_cqe &cqe);
+  void on_send(UConn *conn, const io_uring_cqe &cqe);
+  void on_queue(UConn *conn);
+  void on_overflow_watch(UConn *conn, const io_uring_cqe &cqe);
+  void finish_conn(UConn *conn);
+
+  int m_ring_fd;
+
+  // submission ring; m_sq_tail is ours until submit publishes it
+  unsigned *m_sq_khead, *m_sq_ktail;
+  unsigned m_sq_mask, m_sq_entries;
+  unsigned m_sq_tail;
+  io_uring_sqe *m_sqes;
+
+  // completion ring
+  unsigned *m_cq_khead, *m_cq_ktail;
+  unsigned m_cq_mask;
+  io_uring_cqe *m_cqes;
+
+  void *m_sq_map, *m_cq_map;
+  size_t m_sq_map_len, m_cq_map_len, m_sqes_len;
+
+  // provided receive buffers
+  io_uring_buf_ring *m_buf_ring;
+  char *m_bufs;
+  unsigned short m_buf_tail;
+
+  std::vector<UConn *> m_flush; // output or queue state changed this round
+  std::unordered_set<UConn *> m_closing; // closed, requests still in flight
+};
+
+#endif // URING_REACTOR_H
@@ -2,15 +2,56 @@
 #define USER_H
 
 #include <string>
+#include "message.h"
+#include "frame.h"
 #include "message_queue.h"
+class Reactor;
 
 struct User {
   std::string username;
 
   // queue of pending messages awaiting delivery
-  MessageQueue mqueue;
+  MessageQueue *mqueue;
 
-  User(const std::string &username) : username(username) { }
+  // reactor thread that owns this receiver's connection (null in the
+  // threaded mode). With several reactors, broadcasts hand deliveries
+  // to the home reactor instead of enqueueing from a foreign thread.
+  Reactor *home;
+
+  // what the receiver's connection speaks; a text client reads lines
+  // of at most Message::MAX_LEN, so it can't be sent anything longer
+  WireFormat format;
+
+  User(const std::string &username,
+       MessageQueue::Kind queue_kind = MessageQueue::LOCKED,
+       QueueControl *queue_control = nullptr,
+       WireFormat format = WIRE_TEXT)
+    : username(username),
+      mqueue(MessageQueue::create(queue_kind, queue_control)),
+      home(nullptr),
+      format(format) { }
+
+  bool can_take(const Frame *frame) const {
+    return format != WIRE_TEXT || frame->size() <= Message::MAX_LEN;
+  }
+
+  // enqueue a delivery, taking over the caller's reference; one too
+  // long for the receiver is dropped (and counted) instead
+  void deliver(Frame *frame) {
+    if (!can_take(frame)) {
+      Metrics::count(Metrics::TOO_LONG);
+      frame->unref();
+      return;
+    }
+    mqueue->enqueue(frame);
+  }
+
+  ~User() { delete mqueue; }
+
+private:
+  // value semantics prohibited (we own mqueue)
+  User(const User &);
+  User &operator=(const User &);
 };
 
 #endif // USER_H
@@ -0,0 +1,51 @@
+#include "guard.h"
+#include "user.h"
+#include "user_directory.h"
+
+UserDirectory::UserDirectory() {
+    for (Shard &shard : m_shards) {
+        pthread_mutex_init(&shard.lock, nullptr);
+    }
+}
+
+UserDirectory::~UserDirectory() {
+    for (Shard &shard : m_shards) {
+        pthread_mutex_destroy(&shard.lock);
+    }
+}
+
+UserDirectory::Shard &UserDirectory::shard_for(std::string_view username) {
+    size_t h = NameHash()(username);
+    return m_shards[h & (NUM_SHARDS - 1)];
+}
+
+void UserDirectory::add(const std::shared_ptr<User> &user) {
+    Shard &shard = shard_for(user->username);
+    Guard g(shard.lock);
+    shard.users[user->username] = user;
+}
+
+void UserDirectory::remove(User *user) {
+    Shard &shard = shard_for(user->username);
+    Guard g(shard.lock);
+
+    // only if the name is still ours; an expired entry has to be ours
+    // or a receiver's that's gone too, either way it can go
+    UserMap::iterator it = shard.users.find(user->username);
+    if (it != shard.users.end()) {
+        std::shared_ptr<User> current = it->second.lock();
+        if (!current || current.get() == user) {
+            shard.users.erase(it);
+        }
+    }
+}
+
+std::shared_ptr<User> UserDirectory::find(std::string_view username) {
+    Shard &shard = shard_for(username);
+    Guard g(shard.lock);
+    UserMap::iterator it = shard.users.find(username);
+    if (it == shard.users.end()) {
+        return std::shared_ptr<User>();
+    }
+    return it->second.lock();
+}
@@ -0,0 +1,63 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
+struct User;
+
+// Concurrent map from username to logged-in receiver, so a direct
+// message (senduser) is one hash lookup and one enqueue instead of a
+// broadcast. Split into independently locked shards like
+// RoomDirectory; a lookup only locks the shard the name hashes to.
+//
+// Receivers are added at rlogin and removed when they disconnect. A
+// name belongs to whoever logged in with it last: adding replaces the
+// old entry, and removing an entry someone else has taken over since
+// leaves it alone. The directory only keeps weak_ptrs, so it never
+// keeps a User alive on its own.
+class UserDirectory {
+public:
+  UserDirectory();
+  ~UserDirectory();
+
+  void add(const std::shared_ptr<User> &user);
+  void remove(User *user);
+
+  // null if nobody is logged in as username
+  std::shared_ptr<User> find(std::string_view username);
+
+private:
+  // value semantics prohibited
+  UserDirectory(const UserDirectory &);
+  UserDirectory &operator=(const UserDirectory &);
+
+  static const unsigned NUM_SHARDS = 64; // must be a power of 2
+
+  // hashes strings and string_views alike, so find can look up a
+  // name straight out of a request without copying it first
+  struct NameHash {
+    typedef void is_transparent;
+    size_t operator()(std::string_view name) const {
+      return std::hash<std::string_view>()(name);
+    }
+  };
+
+  typedef std::unordered_map<std::string, std::weak_ptr<User>,
+                             NameHash, std::equal_to<> > UserMap;
+
+  struct Shard {
+    pthread_mutex_t lock; // must be held while accessing users
+    UserMap users;
+    char pad[64];         // keep neighbouring shard locks apart
+  };
+
+  Shard &shard_for(std::string_view username);
+
+  Shard m_shards[NUM_SHARDS];
+};
+
+#endif // USER_DIRECTORY_H
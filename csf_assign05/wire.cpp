@@ -0,0 +1,127 @@
+#include <cstring>
+#include "message.h"
+#include "wire.h"
+
+namespace {
+
+// indexed by TagCode
+const std::string_view TAG_NAMES[] = {
+    "",
+    TAG_ERR,
+    TAG_OK,
+    TAG_SLOGIN,
+    TAG_RLOGIN,
+    TAG_JOIN,
+    TAG_LEAVE,
+    TAG_SENDALL,
+    TAG_SENDUSER,
+    TAG_QUIT,
+    TAG_DELIVERY,
+    TAG_EMPTY,
+    TAG_PEER,
+};
+
+const size_t NUM_TAGS = sizeof(TAG_NAMES) / sizeof(TAG_NAMES[0]);
+
+WireParse parse_text(const char *buf, size_t len, MessageView &msg,
+                     size_t *consumed) {
+    // text lines are held to the original protocol's limit, longer
+    // messages need binary framing
+    const char *nl = static_cast<const char *>(memchr(buf, '\n', len));
+    if (!nl) {
+        if (len >= Message::MAX_LEN) {
+            *consumed = 0;
+            return WIRE_INVALID;
+        }
+        return WIRE_INCOMPLETE;
+    }
+    *consumed = nl - buf + 1;
+    if (*consumed > Message::MAX_LEN) {
+        *consumed = 0;
+        return WIRE_INVALID;
+    }
+
+    // strip newline + CR characters
+    size_t line_len = nl - buf;
+    while (line_len > 0 && buf[line_len - 1] == '\r') {
+        line_len--;
+    }
+
+    // find first colon
+    const char *colon = static_cast<const char *>(memchr(buf, ':', line_len));
+    if (!colon) {
+        return WIRE_INVALID;
+    }
+
+    msg.tag = std::string_view(buf, colon - buf);
+    msg.data = std::string_view(colon + 1, buf + line_len - (colon + 1));
+    msg.code = wire_tag_code(msg.tag);
+    return WIRE_PARSED;
+}
+
+WireParse parse_binary(const char *buf, size_t len, MessageView &msg,
+                       size_t *consumed) {
+    if (len < WIRE_BINARY_HEADER_LEN) {
+        return WIRE_INCOMPLETE;
+    }
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(buf);
+    uint32_t frame_len = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+                         (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    if (frame_len < 1 || frame_len > Message::MAX_FRAME_LEN - 4) {
+        *consumed = 0;
+        return WIRE_INVALID;
+    }
+    if (len < 4 + size_t(frame_len)) {
+        return WIRE_INCOMPLETE;
+    }
+
+    // an unknown code just comes out as an empty tag, which every
+    // handler already rejects as an invalid command
+    msg.tag = wire_tag_name(p[4]);
+    msg.code = msg.tag.empty() ? TAG_CODE_NONE : TagCode(p[4]);
+    msg.data = std::string_view(buf + WIRE_BINARY_HEADER_LEN, frame_len - 1);
+    *consumed = 4 + frame_len;
+    return WIRE_PARSED;
+}
+
+} // anonymous namespace
+
+TagCode wire_tag_code(std::string_view tag) {
+    // the length and first letter leave at most one candidate, so
+    // there's only ever one comparison
+    TagCode code = TAG_CODE_NONE;
+    switch (tag.size()) {
+    case 2: code = TAG_CODE_OK; break;
+    case 3: code = TAG_CODE_ERR; break;
+    case 4:
+        code = tag[0] == 'j' ? TAG_CODE_JOIN : tag[0] == 'p' ? TAG_CODE_PEER : TAG_CODE_QUIT;
+        break;
+    case 5: code = tag[0] == 'l' ? TAG_CODE_LEAVE : TAG_CODE_EMPTY; break;
+    case 6: code = tag[0] == 's' ? TAG_CODE_SLOGIN : TAG_CODE_RLOGIN; break;
+    case 7: code = TAG_CODE_SENDALL; break;
+    case 8: code = tag[0] == 's' ? TAG_CODE_SENDUSER : TAG_CODE_DELIVERY; break;
+    }
+    return code != TAG_CODE_NONE && TAG_NAMES[code] == tag ? code : TAG_CODE_NONE;
+}
+
+std::string_view wire_tag_name(uint8_t code) {
+    return code < NUM_TAGS ? TAG_NAMES[code] : std::string_view();
+}
+
+void wire_put_header(char *header, TagCode code, size_t data_len) {
+    uint32_t frame_len = uint32_t(data_len + 1);
+    header[0] = char(frame_len >> 24);
+    header[1] = char(frame_len >> 16);
+    header[2] = char(frame_len >> 8);
+    header[3] = char(frame_len);
+    header[4] = char(code);
+}
+
+WireParse wire_parse(const char *buf, size_t len, WireFormat format,
+                     MessageView &msg, size_t *consumed) {
+    if (format == WIRE_BINARY) {
+        return parse_binary(buf, len, msg, consumed);
+    }
+    return parse_text(buf, len, msg, consumed);
+}
@@ -0,0 +1,69 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+struct MessageView;
+
+// The two wire formats. Every connection starts out in text mode
+// ("tag:data\n"). A client can ask for binary framing by putting
+// ":bin" after its username in slogin/rlogin; if the server agrees it
+// answers "ok:bin", and from then on both directions use frames of
+//
+//     4-byte big-endian length | tag code | data
+//
+// where the length counts the tag code byte plus the data. Binary
+// frames need no escaping or scanning for newlines, and the data can
+// be up to Message::MAX_FRAME_LEN long.
+enum WireFormat {
+  WIRE_TEXT,
+  WIRE_BINARY,
+};
+
+const size_t WIRE_BINARY_HEADER_LEN = 5;
+
+// one-byte codes for the standard tags (0 is never a valid tag)
+enum TagCode : uint8_t {
+  TAG_CODE_NONE = 0,
+  TAG_CODE_ERR,
+  TAG_CODE_OK,
+  TAG_CODE_SLOGIN,
+  TAG_CODE_RLOGIN,
+  TAG_CODE_JOIN,
+  TAG_CODE_LEAVE,
+  TAG_CODE_SENDALL,
+  TAG_CODE_SENDUSER,
+  TAG_CODE_QUIT,
+  TAG_CODE_DELIVERY,
+  TAG_CODE_EMPTY,
+  TAG_CODE_PEER,
+};
+
+// code for a tag, TAG_CODE_NONE if it isn't a standard one (every
+// text message is looked up once, when it's parsed)
+TagCode wire_tag_code(std::string_view tag);
+
+// tag for a code, empty if the code is unknown
+std::string_view wire_tag_name(uint8_t code);
+
+// fill in the 5-byte header of a binary frame carrying data_len bytes
+void wire_put_header(char *header, TagCode code, size_t data_len);
+
+enum WireParse {
+  WIRE_PARSED,     // msg holds the next message
+  WIRE_INCOMPLETE, // need more bytes
+  WIRE_INVALID,    // malformed (see below)
+};
+
+// Parse the next message out of buf without copying it: msg's views
+// point into buf, and msg.code is set from the tag. *consumed is set
+// to the number of bytes the message took up. A text line with no ':'
+// is WIRE_INVALID with *consumed set so the caller can skip it; a line
+// longer than Message::MAX_LEN or a frame longer than
+// Message::MAX_FRAME_LEN is WIRE_INVALID with *consumed set to 0,
+// since there is no way to find where the next message starts.
+WireParse wire_parse(const char *buf, size_t len, WireFormat format,
+                     MessageView &msg, size_t *consumed);
+
+#endif // WIRE_H